@@ -0,0 +1,118 @@
+# Runs every script in bench/ against a topaz binary and reports the median and
+# 95th percentile wall time and the peak resident memory of each. The results
+# are written as JSON, and when a baseline file from an earlier run exists,
+# any script that got slower by more than the threshold fails the run.
+#
+# usage: ruby bench/run.rb [options] [scripts...]
+#   --topaz PATH       binary to run, ./topaz by default
+#   --runs N           timed runs per script, 10 by default
+#   --warmup N         untimed runs first, 2 by default
+#   --output PATH      where to write results, bench/results.json by default
+#   --baseline PATH    results to compare against, bench/baseline.json by default
+#   --threshold PCT    allowed slowdown of the median in percent, 5 by default
+#   --save-baseline    also write the results to the baseline file
+
+require 'json'
+require 'optparse'
+
+project_root = File.expand_path('..', __dir__)
+options = {
+	topaz: File.join(project_root, 'topaz'),
+	runs: 10,
+	warmup: 2,
+	output: File.join(__dir__, 'results.json'),
+	baseline: File.join(__dir__, 'baseline.json'),
+	threshold: 5.0,
+	save_baseline: false,
+}
+
+OptionParser.new do |opts|
+	opts.on('--topaz PATH') { |v| options[:topaz] = v }
+	opts.on('--runs N', Integer) { |v| options[:runs] = v }
+	opts.on('--warmup N', Integer) { |v| options[:warmup] = v }
+	opts.on('--output PATH') { |v| options[:output] = v }
+	opts.on('--baseline PATH') { |v| options[:baseline] = v }
+	opts.on('--threshold PCT', Float) { |v| options[:threshold] = v }
+	opts.on('--save-baseline') { options[:save_baseline] = true }
+end.parse!
+
+scripts = ARGV.empty? ? Dir.glob(File.join(__dir__, '*.tz')).sort : ARGV
+
+# the high water mark of a running process's resident set, in KB. getrusage
+# can't give this per run on Linux, where a child's maxrss starts out at
+# that of the process that forked it, so the runner's own memory would show
+def peak_rss_kb(pid)
+	File.read("/proc/#{pid}/status")[/^VmHWM:\s*(\d+)/, 1].to_i
+rescue SystemCallError
+	nil
+end
+
+# returns wall seconds and peak rss in KB, or nil if topaz failed.
+# the high water mark only grows, so sampling it until topaz exits misses at
+# most what it allocates in its last millisecond
+def measure(topaz, script)
+	start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+	pid = Process.spawn(topaz, script, out: File::NULL)
+
+	rss = 0
+	sampler = Thread.new do
+		loop do
+			rss = [rss, peak_rss_kb(pid) || break].max
+			sleep 0.001
+		end
+	end
+
+	_, status = Process.wait2(pid)
+	seconds = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+	sampler.kill.join
+
+	status.success? ? [seconds, rss] : nil
+end
+
+def percentile(sorted, p)
+	sorted[((sorted.size - 1) * p).round]
+end
+
+baseline = File.exist?(options[:baseline]) ? JSON.parse(File.read(options[:baseline])) : {}
+results = {}
+regressions = []
+
+printf("%-12s %10s %10s %10s %10s\n", 'script', 'median', 'p95', 'rss', 'baseline')
+
+scripts.each do |script|
+	name = File.basename(script, '.tz')
+
+	options[:warmup].times { measure(options[:topaz], script) }
+	runs = options[:runs].times.map { measure(options[:topaz], script) }
+
+	if runs.any?(&:nil?)
+		puts "#{name}: topaz failed"
+		exit 1
+	end
+
+	times = runs.map(&:first).sort
+	result = {
+		'median' => percentile(times, 0.5),
+		'p95' => percentile(times, 0.95),
+		'peak_rss_kb' => runs.map(&:last).max,
+		'runs' => times.size,
+	}
+	results[name] = result
+
+	comparison = ''
+	if (old = baseline[name])
+		change = (result['median'] / old['median'] - 1) * 100
+		comparison = format('%+.1f%%', change)
+		regressions << name if change > options[:threshold]
+	end
+
+	printf("%-12s %9.1fms %8.1fms %8dKB %10s\n", name, result['median'] * 1000, result['p95'] * 1000, result['peak_rss_kb'], comparison)
+end
+
+File.write(options[:output], JSON.pretty_generate(results) + "\n")
+File.write(options[:baseline], JSON.pretty_generate(results) + "\n") if options[:save_baseline]
+
+if !regressions.empty?
+	puts "slower than #{options[:baseline]} by more than #{options[:threshold]}%: #{regressions.join(', ')}"
+	exit 1
+end
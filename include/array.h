@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+#include "object.h"
+#include "value.h"
+
+// storage for an array's elements, shared by every copy of the array until one of them writes
+struct ArrayBuffer
+{
+	std::pmr::vector<Value> elements;
+	int refs = 1;
+};
+
+// Arrays have value semantics. Copying one only shares its buffer, and
+// the buffer is cloned the first time a copy is written to while shared.
+struct Array : Obj
+{
+	Array(Value const *, Value const *);
+	Array(ArrayBuffer *);
+	Array(Array &&);
+	~Array();
+
+	size_t size() const { return buffer->elements.size(); }
+	Value get(size_t index) const { return buffer->elements[index]; }
+	std::pmr::vector<Value> const &elements() const { return buffer->elements; }
+
+	// writes past the last element grow the array by one
+	void set(size_t, Value);
+	Array *copy();
+
+	// drops the array's reference to its buffer, freeing the buffer if it was the last
+	void release();
+
+	ArrayBuffer *buffer;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "common.h"
+#include "compiler.h"
+#include "globals.h"
+
+struct Function;
+
+// A .tzc file holds a compiled script: every function with its bytecode,
+// line table and constants, and the names of the globals the code refers to
+// by slot. It is keyed by a hash of the script's source and the options the
+// script was compiled with, so a file that no longer matches is ignored.
+// bump the version whenever the bytecode or the layout of the file changes
+constexpr u32 BYTECODE_VERSION = 2;
+
+// where the compiled form of a script lives: next to it, with a .tzc extension
+std::string bytecode_path(const char *);
+
+// 64 bit FNV-1a of a script's source
+u64 hash_source(const char *, size_t);
+
+// writes script and the functions it refers to. returns false if the file couldn't be written
+bool write_bytecode_file(const char *, Function *, Globals const &, CompilerOptions const &, u64);
+
+// A .tzc file mapped into memory. Functions loaded from it run their code
+// and read their lines in place, so the mapping must outlive them, and
+// processes running the same file share its pages.
+class BytecodeFile
+{
+public:
+	BytecodeFile() = default;
+	BytecodeFile(BytecodeFile const &) = delete;
+	~BytecodeFile();
+
+	// returns the script in the file at path, declaring its globals, or nullptr if there is no usable file.
+	// stale is set when there is a file, but it was compiled from other source or by another version of topaz
+	Function *load(const char *, Globals &, CompilerOptions const &, u64, bool &stale);
+
+private:
+	void *data = nullptr;
+	size_t size = 0;
+};
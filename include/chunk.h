@@ -1,12 +1,45 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdio>
 #include <vector>
 
 #include "common.h"
+#include "shape.h"
 
 class Value;
 
+// bytecode from start on that came from one source line, until the next run starts
+struct LineRun
+{
+	u32 start;
+	int line;
+};
+
+// the line of the byte at offset, given runs in order of where they start
+int find_line(LineRun const *, size_t, size_t offset);
+
+// The source line of every byte of a chunk's code, kept as runs of bytes
+// from the same line. A line usually compiles to several instructions, so
+// this takes a fraction of the memory of a line per byte.
+class LineTable
+{
+public:
+	// the line of the next count bytes of code
+	void add(int line, size_t count = 1);
+
+	// forgets the lines of every byte from size on
+	void truncate(size_t size);
+
+	int line(size_t offset) const { return find_line(runs.data(), runs.size(), offset); }
+	size_t size() const { return bytes; }
+
+	std::vector<LineRun> runs;
+
+private:
+	size_t bytes = 0;
+};
+
 class Chunk
 {
 public:
@@ -14,18 +47,40 @@ public:
 
 	void write(u8, int);
 	size_t add_constant(Value);
-	void disassemble(const char *);
-	size_t size();
+	size_t add_cache();
+	void disassemble(const char *, std::FILE * = stdout);
+	size_t size() const;
+
+	// the bytecode the vm runs, and the line each of its bytes came from
+	u8 const *bytecode() const { return mapped_code ? mapped_code : code.data(); }
+	int line(size_t offset) const
+	{
+		return mapped_lines ? find_line(mapped_lines, mapped_line_runs, offset) : lines.line(offset);
+	}
 
 	std::vector<u8> code;
 	std::vector<Value> constants;
-	std::vector<int> lines;
+	LineTable lines;
+
+	// a chunk loaded from a .tzc file runs its code and reads its lines straight out of the mapped file
+	u8 const *mapped_code = nullptr;
+	size_t mapped_size = 0;
+	LineRun const *mapped_lines = nullptr;
+	size_t mapped_line_runs = 0;
+
+	// one inline cache per property access instruction
+	std::vector<InlineCache> caches;
+
+	// prints the instruction at offset and returns the offset of the next one
+	size_t disassemble_instruction(size_t, std::FILE *);
 
 private:
-	size_t disassemble_instruction(size_t);
-	size_t simple_instruction(const char *, size_t);
-	size_t constant_instruction(const char *, size_t);
-	size_t byte_instruction(const char *, size_t);
-	size_t jump_instruction(const char *, int, size_t);
-	size_t array_instruction(const char *, size_t);
+	size_t simple_instruction(const char *, size_t, std::FILE *);
+	size_t constant_instruction(const char *, size_t, std::FILE *);
+	size_t byte_instruction(const char *, size_t, std::FILE *);
+	size_t short_instruction(const char *, size_t, std::FILE *);
+	size_t jump_instruction(const char *, int, size_t, std::FILE *);
+	size_t property_instruction(const char *, size_t, std::FILE *);
+	size_t locals_instruction(const char *, size_t, std::FILE *);
+	size_t call_global_instruction(const char *, size_t, std::FILE *);
 };
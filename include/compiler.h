@@ -1,10 +1,14 @@
 #pragma once
 
+#include <cstdint>
 #include <stack>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "chunk.h"
 #include "function.h"
+#include "globals.h"
 #include "opcode.h"
 #include "scanner.h"
 #include "token_type.h"
@@ -26,13 +30,60 @@ enum Precedence : int
 	PREC_PRIMARY
 };
 
+struct CompilerOptions
+{
+	// also translate every function to register code, for running with Vm::use_registers
+	bool registers = false;
+
+	// clean up each function's bytecode in finish_chunk
+	bool peephole = true;
+
+	// print how many bytes the peephole pass saved once compilation is done
+	bool peephole_stats = false;
+};
+
+// an expression whose value the compiler knows, so the expression using it can be folded
+struct ConstantExpression
+{
+	// where its code starts, and how big the constant pool was before it
+	size_t start;
+	size_t constants;
+	Value value;
+};
+
+// a local variable of the function being compiled
+struct Local
+{
+	Token name;
+	int depth;
+};
+
+// A function being compiled. The Function is allocated up front and built
+// in place, the rest is only needed until its code is done.
+struct FunctionScope
+{
+	Function *function;
+	std::vector<Local> locals;
+
+	// slot of the latest local with each name
+	std::unordered_map<std::string_view, int> local_slots;
+
+	// where each constant is in the pool, so a constant used again shares its slot.
+	// keyed by bits rather than ==, which would merge 0 and -0
+	std::unordered_map<std::uint64_t, size_t> constant_slots;
+
+	int scope_depth = 0;
+};
 
 class Compiler
 {
 public:
-	Compiler(const char *);
+	Compiler(const char *, Globals &, CompilerOptions = {});
+
+	Function *compile();
 
-	Function compile();
+	// whether compile reported an error
+	bool failed() const { return had_error; }
 
 	void array(bool);
 	void binary(bool);
@@ -48,9 +99,33 @@ public:
 
 private:
 	Scanner scanner;
+	Globals &globals;
+	CompilerOptions options;
 	Token current;
 	Token previous;
-	std::stack<Function> functions;
+	std::stack<FunctionScope> functions;
+
+	// start of the last two instructions emitted into the current function,
+	// which emit_op may fuse with the next one into a superinstruction
+	size_t last_instruction = NO_INSTRUCTION;
+	size_t previous_instruction = NO_INSTRUCTION;
+
+	// a jump lands here, so no instruction before it may be fused with one after it
+	size_t fusion_barrier = 0;
+
+	// a global read that was left out because a call of it follows, see call()
+	int global_callee = -1;
+
+	static constexpr size_t NO_INSTRUCTION = -1;
+
+	// the code emitted last, when it is a constant expression. cleared by anything else that is emitted
+	ConstantExpression last_constant = { NO_INSTRUCTION };
+
+	bool had_error = false;
+
+	// bytecode size of every function compiled, and how much of it finish_chunk optimized away
+	size_t bytes_emitted = 0;
+	size_t bytes_saved = 0;
 
 	void advance();
 	void consume(TokenType, const char *);
@@ -66,14 +141,28 @@ private:
 	void return_expression();
 	void function_declaration();
 	void class_declaration();
+	void end_function(Function &);
+	Chunk &current_chunk() { return functions.top().function->chunk; }
 
 	size_t make_constant(Value);
+	void emit_op(Opcode);
+	bool fuse(Opcode);
+	bool fusable(size_t);
+	void rewind(size_t);
+	void reset_fusion();
+	size_t emit_branch(bool &);
+	void emit_instruction(Opcode, size_t a = 0, size_t b = 0);
 	void emit_byte(u8);
 	void emit_bytes(u8, u8);
 	void emit_constant(Value);
+	void emit_literal(Value);
+	bool is_constant(size_t);
+	void drop_constant(ConstantExpression const &);
 	size_t emit_jump(Opcode);
 	void patch_jump(size_t);
 	void emit_loop(size_t);
+	void emit_global(Opcode, std::string_view);
+	int global_slot(std::string_view);
 
 	void error(const char *);
 	void error_at_current(const char *);
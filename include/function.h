@@ -2,28 +2,39 @@
 
 #include <cstddef>
 #include <string>
-#include <vector>
 
 #include "chunk.h"
-#include "token.h"
+#include "object.h"
+#include "register_code.h"
 
 class Chunk;
+struct JitCode;
 
-// represents a local variable
-struct Local
-{
-	Token name;
-	int depth;
-};
-
-struct Function
+struct Function : Obj
 {
 	Function(std::string const &name);
 
-	std::vector<Local> locals;
+	// the compiler builds functions in place, so nothing ever needs a copy of one
+	Function(Function const &) = delete;
+
+	// call frames and the interpreter loop hold raw pointers into functions, so they never move
+	static constexpr bool tenured = true;
+
 	size_t num_params;
 	Chunk chunk;
+
+	// the most values its code has on the stack at once, on top of the callee and arguments
+	size_t max_stack = 0;
+
+	// only filled in when compiling for the register tier
+	RegisterChunk registers;
+
 	std::string name;
 	bool native;
-	int scope_depth = 0;
+
+	// how hot the function is, and its machine code once the jit has compiled it
+	u32 calls = 0;
+	u32 back_edges = 0;
+	JitCode *jit_code = nullptr;
+	bool jit_failed = false;
 };
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// every global variable gets a fixed slot the first time the compiler sees its name,
+// so the vm can read and write globals with a single indexed load
+struct Globals
+{
+	u32 resolve(String *);
+
+	// names are interned, so they are keyed by pointer
+	std::unordered_map<String *, u32> slots;
+	std::vector<String *> names;
+
+	// slots for names that haven't been assigned yet hold Value::undefined()
+	std::vector<Value> values;
+};
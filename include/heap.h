@@ -0,0 +1,202 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "object.h"
+#include "region.h"
+#include "value.h"
+
+struct Array;
+
+// bytes of young objects that can be bump allocated between minor collections
+constexpr size_t NURSERY_SIZE = 1024 * 1024;
+
+// old generation size that triggers the first major collection
+constexpr size_t OLD_THRESHOLD = 8 * 1024 * 1024;
+
+// how much the old generation may grow after a major collection before the next
+constexpr int OLD_GROWTH_FACTOR = 2;
+
+struct GcStats
+{
+	size_t minor_collections = 0;
+	size_t major_collections = 0;
+	size_t bytes_promoted = 0;
+	size_t bytes_freed = 0;
+
+	// pause times in microseconds
+	double minor_pause_total = 0;
+	double minor_pause_max = 0;
+	double major_pause_total = 0;
+	double major_pause_max = 0;
+};
+
+// Generational heap shared by the compiler and the vm.
+// Young objects are bump allocated in a nursery and promoted to the old
+// generation by copying when they survive a minor collection. The old
+// generation is a list of individually allocated objects that is collected
+// by mark-sweep. Collections only run when the vm asks for one at a
+// safepoint, so allocating never moves or frees anything.
+//
+// While a region is active, young objects and the containers they own are
+// bump allocated out of the region instead, and nothing is collected. The
+// region is thrown away as a whole when it ends, without visiting any object.
+class Heap
+{
+public:
+	Heap();
+
+	template <typename T, typename... Args>
+	T *allocate(Args &&...);
+
+	// allocates straight into the old generation, for objects that old ones point to
+	// without a write barrier, like the constants the compiler builds
+	template <typename T, typename... Args>
+	T *allocate_old(Args &&...);
+
+	// whether the vm should call collect at its next safepoint
+	bool wants_collection() const { return !region && (minor_requested || major_requested); }
+
+	// allocates young objects out of region until end_region is called
+	void begin_region(Region *);
+
+	// frees everything allocated since begin_region, keeping its blocks if reuse_blocks is set.
+	// nothing allocated in the region may be referenced afterwards
+	void end_region(bool reuse_blocks);
+
+	// records an array in the region that shares a buffer from outside it. objects in a region
+	// are never destroyed, so end_region drops the reference for it
+	void borrow_buffer(Array *array) { borrowed_buffers.push_back(array); }
+
+	// where young objects allocate the memory their containers own
+	std::pmr::memory_resource *resource() const { return region ? region : std::pmr::new_delete_resource(); }
+
+	// runs a minor collection, followed by a major one if the old generation has grown enough.
+	// mark_roots must pass every root to visit()
+	void collect(std::function<void(Heap &)> mark_roots);
+
+	void visit(Value &);
+	void visit(Obj *&);
+
+	template <typename T>
+	void visit(T *&obj)
+	{
+		auto o = static_cast<Obj *>(obj);
+		visit(o);
+		obj = static_cast<T *>(o);
+	}
+
+	// must be called after storing value into owner, so old objects that point into the nursery are found
+	void write_barrier(Obj *owner, Value value)
+	{
+		if (!owner->remembered && !owner->in_region && !in_nursery(owner) && value.is_obj() && in_nursery(value.as_obj()))
+			remember(owner);
+	}
+
+	bool in_nursery(Obj *obj) const
+	{
+		auto p = reinterpret_cast<u8 *>(obj);
+		return p >= nursery.get() && p < nursery_end;
+	}
+
+	void free_all();
+	void print_stats(std::FILE *);
+
+	GcStats stats;
+
+private:
+	std::unique_ptr<u8[]> nursery;
+	u8 *nursery_top;
+	u8 *nursery_end;
+
+	Region *region = nullptr;
+	std::vector<Array *> borrowed_buffers;
+
+	Obj *old_objects = nullptr;
+	size_t old_bytes = 0;
+	size_t next_major = OLD_THRESHOLD;
+
+	bool minor_requested = false;
+	bool major_requested = false;
+
+	// visit() marks objects during a major collection, and promotes them during a minor one
+	bool marking = false;
+
+	std::vector<Obj *> remembered_set;
+
+	// promoted or marked objects whose children haven't been visited yet
+	std::vector<Obj *> gray;
+
+	void track_old(Obj *);
+	void remember(Obj *);
+	Obj *promote(Obj *);
+	void trace(Obj *);
+	void collect_minor(std::function<void(Heap &)> &);
+	void collect_major(std::function<void(Heap &)> &);
+	void sweep_nursery();
+	void sweep_old();
+};
+
+extern Heap heap;
+
+// every object is allocated through here so the collector can find it again
+template <typename T, typename... Args>
+T *allocate(Args &&... args)
+{
+	return heap.allocate<T>(std::forward<Args>(args)...);
+}
+
+// frees every object when the program exits
+void free_objects();
+
+inline size_t align_object(size_t size)
+{
+	return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+}
+
+template <typename T, typename... Args>
+T *Heap::allocate(Args &&... args)
+{
+	if constexpr (!T::tenured)
+	{
+		if (region)
+		{
+			auto obj = new (region->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+			obj->in_region = true;
+			return obj;
+		}
+
+		auto size = align_object(sizeof(T));
+		if (nursery_top + size <= nursery_end)
+		{
+			auto obj = new (nursery_top) T(std::forward<Args>(args)...);
+			nursery_top += size;
+			return obj;
+		}
+
+		// the nursery is full until the next safepoint, so the object is tenured early.
+		// it may have been built out of young objects, so it is remembered right away
+		minor_requested = true;
+		auto obj = allocate_old<T>(std::forward<Args>(args)...);
+		remember(obj);
+		return obj;
+	}
+
+	return allocate_old<T>(std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+T *Heap::allocate_old(Args &&... args)
+{
+	auto obj = new T(std::forward<Args>(args)...);
+	track_old(obj);
+	return obj;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "function.h"
+#include "value.h"
+
+class Vm;
+
+// machine code is only generated for x86-64, everywhere else functions stay interpreted
+#if defined(__x86_64__) && !defined(NO_JIT)
+#define HAVE_JIT
+#endif
+
+// calls of a function, or jumps back to the start of one of its loops, before it is compiled
+constexpr u32 JIT_CALL_THRESHOLD = 100;
+constexpr u32 JIT_LOOP_THRESHOLD = 1000;
+
+// The machine code of one function, in its own mapping
+struct JitCode
+{
+	JitCode(u8 *code, size_t size) :
+		code(code),
+		size(size)
+	{ }
+
+	JitCode(JitCode const &) = delete;
+	~JitCode();
+
+	u8 *code;
+	size_t size;
+
+	// where a call starts running the function
+	u8 const *entry = nullptr;
+
+	// where a call in tail position jumps into the function, reusing the frame of its caller
+	u8 const *tail_entry = nullptr;
+
+	// where the code of each instruction that can be entered from the interpreter starts,
+	// by offset in the bytecode: the first one, and the first of every loop
+	std::unordered_map<size_t, size_t> entries;
+};
+
+// A baseline compiler from bytecode to x86-64, one template per opcode.
+// Values stay in their slots on the vm's stack, so the interpreter can hand a
+// function over at the top of any loop. Arithmetic and comparisons on
+// numbers, locals, globals, constants and jumps are done inline, and
+// everything else calls back into the runtime. A function is compiled once it
+// has been called JIT_CALL_THRESHOLD times or looped JIT_LOOP_THRESHOLD
+// times. With perf_map set, every function compiled is listed in
+// /tmp/perf-<pid>.map so perf can name it.
+class Jit
+{
+public:
+	explicit Jit(bool perf_map = false) :
+		perf_map_wanted(perf_map)
+	{ }
+
+	Jit(Jit const &) = delete;
+	~Jit();
+
+	// counts a call of fn, and returns whether it has machine code to run
+	bool hot_call(Function *fn)
+	{
+		return fn->jit_code || (++fn->calls >= JIT_CALL_THRESHOLD && compile(fn));
+	}
+
+	// counts a jump back to the start of a loop in fn, and returns whether it has machine code to run
+	bool hot_loop(Function *fn)
+	{
+		return fn->jit_code || (++fn->back_edges >= JIT_LOOP_THRESHOLD && compile(fn));
+	}
+
+	// compiles fn unless it has been already, and returns whether it has machine code
+	bool compile(Function *);
+
+	// runs fn's machine code from the instruction at until the function returns.
+	// base is the frame's first slot, and sp the top of the stack
+	Value run(Vm *, Function *, Value *base, Value *sp, u8 const *at);
+
+private:
+	std::vector<std::unique_ptr<JitCode>> functions;
+	bool perf_map_wanted;
+	std::FILE *perf_map = nullptr;
+
+	void write_perf_map(Function *, JitCode const &);
+};
@@ -1,22 +1,74 @@
 #pragma once
 
-#include <memory>
-#include <string>
-#include <unordered_map>
+#include <memory_resource>
+#include <vector>
 
-class Value;
+#include "heap.h"
+#include "object.h"
+#include "shape.h"
+#include "value.h"
 
-struct Klass
+struct Klass : Obj
 {
-	Klass(std::string const &);
+	Klass(String *);
 
-	std::string name;
+	String *name;
 };
 
-struct Instance
+struct Instance : Obj
 {
-	Instance(std::shared_ptr<Klass> klass);
+	Instance(Klass *klass);
 
-	std::shared_ptr<Klass> klass;
-	std::unordered_map<std::string, std::shared_ptr<Value>> fields;
+	Klass *klass;
+	Shape *shape;
+
+	// indexed by the slots of shape
+	std::pmr::vector<Value> fields;
+
+	// reads a field through the cache of the instruction doing the access.
+	// fields that were never set read as nil
+	Value get(String *name, InlineCache &cache)
+	{
+		auto entry = cache.find(shape);
+		auto slot = entry ? entry->slot : shape->lookup(name);
+
+		if (!entry)
+			cache.add({ shape, nullptr, slot });
+
+		return slot == -1 ? Value(nullptr) : fields[slot];
+	}
+
+	void set(String *name, Value value, InlineCache &cache)
+	{
+		auto hit = cache.find(shape);
+		InlineCache::Entry entry;
+
+		if (hit)
+			entry = *hit;
+
+		else
+		{
+			entry = { shape, nullptr, shape->lookup(name) };
+
+			// adding a field moves the instance to a new shape
+			if (entry.slot == -1)
+			{
+				entry.slot = fields.size();
+				entry.next = shape->transition(name);
+			}
+
+			cache.add(entry);
+		}
+
+		if (entry.next)
+		{
+			shape = entry.next;
+			fields.push_back(value);
+		}
+
+		else
+			fields[entry.slot] = value;
+
+		heap.write_barrier(this, value);
+	}
 };
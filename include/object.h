@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "common.h"
+
+enum class ObjType : u8
+{
+	String,
+	Function,
+	Array,
+	Klass,
+	Instance,
+};
+
+// header shared by every heap allocated object a Value can point to
+struct Obj
+{
+	Obj(ObjType type) :
+		type(type)
+	{ }
+
+	virtual ~Obj() = default;
+
+	// objects are allocated in the nursery unless their type is tenured,
+	// in which case they go straight to the old generation and never move
+	static constexpr bool tenured = false;
+
+	ObjType type;
+
+	// set by the collector during a major collection
+	bool marked = false;
+
+	// an old object that may point into the nursery
+	bool remembered = false;
+
+	// a nursery object that has been promoted, next then points at its new location
+	bool forwarded = false;
+
+	// allocated in a region, so it is freed with the region rather than collected
+	bool in_region = false;
+
+	// links old objects together, or forwards a promoted nursery object
+	Obj *next = nullptr;
+};
+
+// Strings are immutable and interned, so two strings with the same
+// characters are always the same object and compare by pointer.
+struct String : Obj
+{
+	String(std::string_view, size_t);
+
+	// the intern table and shapes hold raw String pointers, so strings must never move
+	static constexpr bool tenured = true;
+
+	const std::string str;
+	const size_t hash;
+};
+
+// returns the unique String holding these characters, creating it if needed
+String *intern(std::string_view);
+
+// drops a string that is about to be freed from the intern table
+void unintern(String *);
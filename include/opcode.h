@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 #include "common.h"
 
 enum Opcode : u8
@@ -25,8 +27,8 @@ enum Opcode : u8
 	OP_BITWISE_OR,
 	OP_PRINT,
 	OP_POP,
-	OP_GET_GLOBAL,
-	OP_SET_GLOBAL,
+	OP_GET_GLOBAL_SLOT,
+	OP_SET_GLOBAL_SLOT,
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
 	OP_JUMP_IF_FALSE,
@@ -39,4 +41,70 @@ enum Opcode : u8
 	OP_CLASS,
 	OP_GET_PROPERTY,
 	OP_SET_PROPERTY,
+
+	// superinstructions the compiler fuses common sequences into, see tools/opcode_pairs.sh
+	OP_NOT_EQUAL,
+	OP_GREATER_EQUAL,
+	OP_LESS_EQUAL,
+	OP_ADD_CONSTANT,
+	OP_SUBTRACT_CONSTANT,
+	OP_ADD_LOCALS,
+	OP_SUBTRACT_LOCALS,
+	OP_SET_GLOBAL_POP,
+	OP_SET_LOCAL_POP,
+	OP_POP_JUMP_IF_FALSE,
+	OP_JUMP_IF_NOT_LESS,
+	OP_JUMP_IF_NOT_GREATER,
+	OP_JUMP_IF_NOT_EQUAL,
+	OP_JUMP_IF_LESS,
+	OP_JUMP_IF_GREATER,
+	OP_JUMP_IF_EQUAL,
+	OP_CALL_GLOBAL,
+
+	// pushes a copy of an array literal whose elements are all constants, built once at compile time
+	OP_ARRAY_CONSTANT,
+
+	// gives each operand of the instruction after it WIDE_OPERAND_WIDTH bytes,
+	// for the rare constant index, jump or count that doesn't fit the usual width
+	OP_WIDE,
+
+	// calls whose result is returned straight away. a function called this way takes over
+	// the caller's frame instead of pushing one of its own, anything else is called normally
+	// and the return that always follows the instruction returns its result
+	OP_TAIL_CALL,
+	OP_TAIL_CALL_GLOBAL,
+
+	// quickened forms the interpreter rewrites an instruction to in place, once it has seen
+	// the operands it runs with. each is the size of its generic form and guards on what it
+	// assumes, rewriting the instruction back to the generic form when that stops holding.
+	// the compiler never emits them
+	OP_ADD_NUM,
+	OP_ADD_CONSTANT_NUM,
+	OP_ADD_LOCALS_NUM,
+	OP_EQUAL_NUM,
+	OP_JUMP_IF_NOT_EQUAL_NUM,
+
+	// property accesses whose inline cache has seen a single shape, holding the field
+	OP_GET_PROPERTY_MONO,
+	OP_SET_PROPERTY_MONO,
 };
+
+constexpr size_t WIDE_OPERAND_WIDTH = 3;
+constexpr size_t WIDE_OPERAND_MAX = 0xffffff;
+
+// printable name of an opcode, for tools that report on bytecode
+const char *opcode_name(u8);
+
+// bytes taken by an instruction without an OP_WIDE prefix, including its operands
+size_t instruction_size(u8);
+
+int operand_count(u8);
+
+// bytes taken by operand n of an instruction without an OP_WIDE prefix
+size_t operand_width(u8, int);
+
+// for reading bytecode that may contain OP_WIDE: the size, opcode and
+// operand n of the instruction starting at the given byte
+size_t instruction_size(u8 const *);
+Opcode instruction_opcode(u8 const *);
+size_t read_operand(u8 const *, int);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+
+#include "chunk.h"
+
+// Finishes the bytecode of a chunk once the compiler is done with it, working
+// on a single decoded copy of the code. When optimize is set, jumps to jumps
+// are threaded, unreachable code is removed and values pushed only to be
+// popped again are never pushed. Calls in tail position become OP_TAIL_CALL
+// and OP_TAIL_CALL_GLOBAL, so recursion that ends in a call runs in constant
+// stack space. Last, every operand is laid out at the smallest width that holds
+// it, narrowing the forward jumps the compiler emits wide. Lines stay in step
+// with the code. Returns how many bytes optimizing saved, and sets max_stack
+// to the most values the code has on the stack at once
+size_t finish_chunk(Chunk &, bool optimize, size_t &max_stack);
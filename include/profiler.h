@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "function.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+// Counts how often every instruction of every function runs and how long it
+// takes, for topaz --profile. The vm calls enter() as each instruction starts,
+// and the time until the next call is charged to that instruction, so calls
+// are charged the work of getting into the callee and returns that of getting
+// back out.
+class Profiler
+{
+public:
+	void enter(Function *function, u8 const *ip)
+	{
+		auto now = ticks();
+		if (last)
+			last->ticks += now - last_tick;
+
+		if (function != current_function)
+		{
+			auto &counts = samples[function];
+			if (counts.empty())
+				counts.resize(function->chunk.size());
+
+			current_function = function;
+			current = counts.data();
+		}
+
+		last = &current[ip - function->chunk.bytecode()];
+		last->count += 1;
+		last_tick = ticks();
+	}
+
+	// charges the last instruction when the run is over
+	void stop();
+
+	// prints every opcode by the time spent running it, then the code of every
+	// function that ran with how often each instruction ran and its share of the time
+	void report(std::FILE *);
+
+private:
+	struct Sample
+	{
+		u64 count = 0;
+		u64 ticks = 0;
+	};
+
+	std::unordered_map<Function *, std::vector<Sample>> samples;
+	Function *current_function = nullptr;
+	Sample *current = nullptr;
+	Sample *last = nullptr;
+	u64 last_tick = 0;
+
+	// cycles where there is a time stamp counter, nanoseconds elsewhere
+	static u64 ticks()
+	{
+		#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+		#else
+		return std::chrono::steady_clock::now().time_since_epoch() / std::chrono::nanoseconds(1);
+		#endif
+	}
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+#include "common.h"
+
+// size of the blocks a region bumps through, larger allocations get a block of their own
+constexpr size_t REGION_BLOCK_SIZE = 256 * 1024;
+
+// Bump allocator whose memory is only ever freed all at once.
+// Deallocating is a no-op, so containers backed by a region never give memory back
+// until the region is reset or released.
+class Region : public std::pmr::memory_resource
+{
+public:
+	Region() = default;
+	Region(Region const &) = delete;
+	~Region();
+
+	// forgets every allocation but keeps the standard sized blocks for the next run
+	void reset();
+
+	// forgets every allocation and frees every block
+	void release();
+
+	size_t bytes_allocated() const { return allocated; }
+	size_t blocks() const { return chunks.size(); }
+
+private:
+	struct Block
+	{
+		u8 *data;
+		size_t size;
+	};
+
+	std::vector<Block> chunks;
+
+	// index of the block being bumped through
+	size_t current = 0;
+	u8 *top = nullptr;
+	u8 *end = nullptr;
+
+	size_t allocated = 0;
+
+	void next_block(size_t);
+
+	void *do_allocate(size_t, size_t) override;
+	void do_deallocate(void *, size_t, size_t) override { }
+	bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override { return this == &other; }
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "common.h"
+
+struct Function;
+
+// Instructions of the register tier, selected with --registers.
+// They are three address operations on the slots of the current call frame,
+// which are laid out like the stack vm's: the callee in slot 0, its
+// parameters after it, and temporaries above those.
+// Operands name registers, except where a constant index is noted. Arithmetic,
+// comparisons and branches have a _CONSTANT form right after them whose right
+// operand c is a constant, so no instruction has to check what kind of operand it got.
+// Jumps go to the absolute instruction index in d.
+enum RegisterOpcode : u8
+{
+	R_MOVE,                          // a = b
+	R_LOAD_CONSTANT,                 // a = constant d
+	R_NIL,                           // a = nil
+	R_TRUE,                          // a = true
+	R_FALSE,                         // a = false
+	R_GET_GLOBAL,                    // a = global d
+	R_SET_GLOBAL,                    // global d = b
+	R_SET_GLOBAL_CONSTANT,           // global d = constant b
+	R_ADD,                           // a = b + c
+	R_ADD_CONSTANT,                  // a = b + constant c
+	R_SUBTRACT,
+	R_SUBTRACT_CONSTANT,
+	R_MULTIPLY,
+	R_MULTIPLY_CONSTANT,
+	R_DIVIDE,
+	R_DIVIDE_CONSTANT,
+	R_MOD,
+	R_MOD_CONSTANT,
+	R_EQUAL,
+	R_EQUAL_CONSTANT,
+	R_NOT_EQUAL,
+	R_NOT_EQUAL_CONSTANT,
+	R_GREATER,
+	R_GREATER_CONSTANT,
+	R_LESS,
+	R_LESS_CONSTANT,
+	R_GREATER_EQUAL,
+	R_GREATER_EQUAL_CONSTANT,
+	R_LESS_EQUAL,
+	R_LESS_EQUAL_CONSTANT,
+	R_LOGICAL_AND,
+	R_LOGICAL_OR,
+	R_BITWISE_AND,
+	R_BITWISE_OR,
+	R_NEGATE,                        // a = -b
+	R_NOT,                           // a = !b
+	R_PRINT,                         // print b
+	R_JUMP,                          // jump to d
+	R_LOOP,                          // jump back to d
+	R_JUMP_IF_FALSE,                 // jump to d if b is falsy
+	R_JUMP_IF_NOT_LESS,              // jump to d unless b < c
+	R_JUMP_IF_NOT_LESS_CONSTANT,     // jump to d unless b < constant c
+	R_JUMP_IF_NOT_GREATER,
+	R_JUMP_IF_NOT_GREATER_CONSTANT,
+	R_JUMP_IF_NOT_EQUAL,
+	R_JUMP_IF_NOT_EQUAL_CONSTANT,
+	R_JUMP_IF_LESS,                  // jump to d if b < c
+	R_JUMP_IF_LESS_CONSTANT,
+	R_JUMP_IF_GREATER,
+	R_JUMP_IF_GREATER_CONSTANT,
+	R_JUMP_IF_EQUAL,
+	R_JUMP_IF_EQUAL_CONSTANT,
+	R_CALL,                          // a = a(a + 1, ..., a + b)
+	R_CALL_GLOBAL,                   // a = global d(a, ..., a + b - 1)
+	R_RETURN,                        // return b
+	R_BUILD_ARRAY,                   // a = [a, ..., a + b - 1]
+	R_GET_SUBSCRIPT,                 // a = b[c]
+	R_SET_SUBSCRIPT,                 // a = b[c] = d
+	R_CLASS,                         // a = class named by constant d
+	R_GET_PROPERTY,                  // a = b.(constant c), using cache d
+	R_SET_PROPERTY,                  // a = a.(constant c) = a + 1, using cache d
+	R_ARRAY_CONSTANT,                // a = copy of the array constant d
+	R_TAIL_CALL,                     // return a(a + 1, ..., a + b), reusing the frame for a function
+	R_TAIL_CALL_GLOBAL,              // return global d(a, ..., a + b - 1), reusing the frame for a function
+};
+
+struct RegisterInstruction
+{
+	RegisterOpcode op;
+	u8 a;
+	u8 b;
+	u8 c;
+	u32 d;
+};
+
+struct RegisterChunk
+{
+	std::vector<RegisterInstruction> code;
+	std::vector<int> lines;
+
+	// how many frame slots the function uses, counting the callee and parameters
+	int num_registers = 0;
+
+	void disassemble(const char *) const;
+};
+
+// translates the stack bytecode of fn into fn->registers. the stack code is kept as is.
+// returns false, leaving fn->registers empty, if the function needs more registers than
+// a frame has or more constants than an operand can name. it then runs on the stack tier
+bool compile_registers(Function &);
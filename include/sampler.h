@@ -0,0 +1,51 @@
+#pragma once
+
+#include <csignal>
+#include <cstdio>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "function.h"
+
+struct CallFrame;
+
+// A sampling profiler for topaz --sample. A SIGPROF timer marks a sample as
+// due, and the vm takes it the next time it jumps back in a loop, makes a
+// call or returns, by walking its frames. Each sample records the function
+// and line of every frame, and the samples are written out as folded stacks,
+// one "script:7;outer:3;inner:12 count" line per distinct stack, for flamegraph.pl
+class Sampler
+{
+public:
+	// samples per second of cpu time
+	static constexpr int DEFAULT_RATE = 1000;
+
+	explicit Sampler(int rate = DEFAULT_RATE) :
+		rate(rate)
+	{ }
+
+	// the timer only runs between start and stop, so compiling isn't sampled
+	void start();
+	void stop();
+
+	// whether the timer has fired since the last sample. cheap enough for the vm to check on every loop, call and return
+	static bool due() { return pending; }
+
+	// records the stack of frames, the innermost at the top running the instruction at ip
+	void sample(CallFrame const *frames, int frame_count, u8 const *ip);
+
+	void write_folded(std::FILE *);
+
+private:
+	int rate;
+
+	static volatile std::sig_atomic_t pending;
+	static void on_timer(int);
+
+	// the function and line of each frame, outermost first
+	using Stack = std::vector<std::pair<Function *, int>>;
+	std::map<Stack, u64> stacks;
+	Stack stack;
+};
@@ -1,24 +1,24 @@
 #pragma once
 
-#include <list>
-#include <sstream>
-#include <string>
-
-#include <FlexLexer.h>
-
 #include "token.h"
 
+// Splits source into tokens on demand. Tokens point into the source rather
+// than copying it, so the source must outlive them, and it must end with a null.
 class Scanner
 {
 public:
 	Scanner(const char *);
-	~Scanner();
-	void scan();
-	std::string to_string();
 	Token next();
 
 private:
-	std::list<Token> tokens;
-	std::istringstream istream;
-	FlexLexer *lexer;
+	const char *current;
+	const char *end;
+
+	// where the line current is on starts, for the column of each token
+	const char *line_start;
+	int line = 1;
+
+	void skip_whitespace();
+	const char *skip_identifier(const char *);
+	bool match(char);
 };
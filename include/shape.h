@@ -0,0 +1,68 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+
+#include "common.h"
+#include "object.h"
+
+// A Shape (hidden class) describes which field lives in which slot of an instance.
+// Instances that had the same fields added in the same order share a shape,
+// so a shape pointer compare is enough to know where a field lives.
+struct Shape
+{
+	Shape() = default;
+	Shape(Shape const &) = delete;
+
+	// slot of a field, or -1 when the shape has no such field
+	int lookup(String *) const;
+
+	// the shape reached by appending a new field to this one
+	Shape *transition(String *);
+
+	// every instance starts out with the empty root shape
+	static Shape *root();
+
+	// field names are interned, so they are keyed by pointer
+	std::unordered_map<String *, u32> slots;
+	std::unordered_map<String *, std::unique_ptr<Shape>> transitions;
+};
+
+// max number of shapes a single property access site remembers
+constexpr int INLINE_CACHE_ENTRIES = 4;
+
+// per instruction cache of the shapes seen by a property access
+struct InlineCache
+{
+	struct Entry
+	{
+		Shape *shape;
+
+		// for stores that add a field, the shape the instance transitions to
+		Shape *next;
+
+		// -1 caches a lookup of a field the shape doesn't have
+		int slot;
+	};
+
+	Entry entries[INLINE_CACHE_ENTRIES];
+	int count = 0;
+
+	Entry *find(Shape *shape)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (entries[i].shape == shape)
+				return &entries[i];
+		}
+
+		return nullptr;
+	}
+
+	// once every entry is taken the site is megamorphic and new shapes always miss
+	void add(Entry entry)
+	{
+		if (count < INLINE_CACHE_ENTRIES)
+			entries[count++] = entry;
+	}
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
 #include "token_type.h"
 
@@ -8,16 +9,17 @@ struct Token
 {
 public:
 	Token() = default;
-	Token(std::string, TokenType, int, int);
-	std::string to_string();
+	Token(std::string_view, TokenType, int, int);
+	std::string to_string() const;
 
-	std::string value() { return m_value; }
-	TokenType type() { return m_type; }
-	int line() { return m_line; }
-	int col() { return m_col; }
+	// points into the source the token was scanned from
+	std::string_view value() const { return m_value; }
+	TokenType type() const { return m_type; }
+	int line() const { return m_line; }
+	int col() const { return m_col; }
 
 private:
-	std::string m_value;
+	std::string_view m_value;
 	TokenType m_type;
 	int m_line;
 	int m_col;
@@ -1,59 +1,87 @@
 #pragma once
 
 #include <cstddef>
-#include <memory>
+#include <cstdint>
+#include <cstring>
 #include <string>
-#include <variant>
-#include <vector>
+#include <string_view>
 
-struct Instance;
+#include "object.h"
+
+struct Array;
 struct Function;
+struct Instance;
 struct Klass;
 
+// A Value is a single NaN-boxed 64 bit word.
+// Any bit pattern that isn't a quiet NaN is a double. Quiet NaNs carry a tag
+// in their low bits for nil/true/false, or an object pointer when the sign bit is set.
 class Value
 {
 public:
-	Value(bool);
-	Value(void *);
-	Value(double);
-	Value(std::string);
-	Value(std::shared_ptr<Function>);
-	Value(std::vector<Value>);
-	Value(std::shared_ptr<Klass>);
-	Value(std::shared_ptr<Instance>);
-
-	bool operator==(const Value);
-
-	bool as_bool();
-	double as_number();
-	std::string as_string();
-	std::shared_ptr<Function> as_fn();
-	std::vector<Value> as_array();
-	std::shared_ptr<Klass> as_klass();
-	std::shared_ptr<Instance> as_instance();
-
-	bool is_bool() const;
-	bool is_nil() const;
-	bool is_number() const;
-	bool is_string() const;
-	bool is_fn() const;
-	bool is_array() const;
-	bool is_klass() const;
-	bool is_instance() const;
-
-	bool is_falsy() const;
-	std::string to_string();
-	void store_at(int, Value);
+	Value() : bits(NIL_VAL) { }
+	Value(bool b) : bits(b ? TRUE_VAL : FALSE_VAL) { }
+	Value(std::nullptr_t) : bits(NIL_VAL) { }
+	Value(double d) { std::memcpy(&bits, &d, sizeof(double)); }
+	Value(Obj *obj) : bits(SIGN_BIT | QNAN | reinterpret_cast<std::uintptr_t>(obj)) { }
+	Value(std::string_view);
+
+	// marks a global that has been declared but never assigned
+	static Value undefined()
+	{
+		Value v;
+		v.bits = UNDEFINED_VAL;
+		return v;
+	}
+
+	bool operator==(const Value &) const;
+
+	// the same for two values only if they are the same value. unlike ==, this tells 0 from -0 and matches NaN
+	std::uint64_t bit_pattern() const { return bits; }
+
+	bool as_bool() const { return bits == TRUE_VAL; }
+	double as_number() const
+	{
+		double d;
+		std::memcpy(&d, &bits, sizeof(double));
+		return d;
+	}
+
+	Obj *as_obj() const { return reinterpret_cast<Obj *>(bits & ~(SIGN_BIT | QNAN)); }
+	String *as_string() const { return static_cast<String *>(as_obj()); }
+	Function *as_fn() const { return reinterpret_cast<Function *>(as_obj()); }
+	Array *as_array() const { return reinterpret_cast<Array *>(as_obj()); }
+	Klass *as_klass() const { return reinterpret_cast<Klass *>(as_obj()); }
+	Instance *as_instance() const { return reinterpret_cast<Instance *>(as_obj()); }
+
+	bool is_bool() const { return (bits | 1) == TRUE_VAL; }
+	bool is_nil() const { return bits == NIL_VAL; }
+	bool is_undefined() const { return bits == UNDEFINED_VAL; }
+	bool is_number() const { return (bits & QNAN) != QNAN; }
+	bool is_obj() const { return (bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN); }
+	bool is_string() const { return is_obj_type(ObjType::String); }
+	bool is_fn() const { return is_obj_type(ObjType::Function); }
+	bool is_array() const { return is_obj_type(ObjType::Array); }
+	bool is_klass() const { return is_obj_type(ObjType::Klass); }
+	bool is_instance() const { return is_obj_type(ObjType::Instance); }
+
+	// only nil and false are falsy
+	bool is_falsy() const { return bits == NIL_VAL || bits == FALSE_VAL; }
+	std::string to_string() const;
 
 private:
-	std::variant<
-		bool,                      // Bool
-		std::monostate,            // Nil
-		double,                    // Number
-		std::string,               // String
-		std::shared_ptr<Function>, // Fn
-		std::vector<Value>,        // Array
-		std::shared_ptr<Klass>,    // Class
-		std::shared_ptr<Instance>  // Instance
-	> value;
+	// the jit tests and builds these bit patterns in machine code
+	friend class JitCompiler;
+
+	static constexpr std::uint64_t SIGN_BIT = 0x8000000000000000;
+	static constexpr std::uint64_t QNAN = 0x7ffc000000000000;
+
+	static constexpr std::uint64_t NIL_VAL = QNAN | 1;
+	static constexpr std::uint64_t FALSE_VAL = QNAN | 2;
+	static constexpr std::uint64_t TRUE_VAL = QNAN | 3;
+	static constexpr std::uint64_t UNDEFINED_VAL = QNAN | 4;
+
+	bool is_obj_type(ObjType type) const { return is_obj() && as_obj()->type == type; }
+
+	std::uint64_t bits;
 };
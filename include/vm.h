@@ -1,60 +1,131 @@
 #pragma once
 
+#include <cstdio>
 #include <memory>
-#include <stack>
-#include <unordered_map>
-#include <vector>
+#include <string>
 
 #include "common.h"
 #include "function.h"
+#include "globals.h"
+#include "jit.h"
+#include "profiler.h"
+#include "region.h"
+#include "register_code.h"
+#include "sampler.h"
 #include "value.h"
 
-enum class Operator
-{
-    Plus,
-    Minus,
-    Star,
-    Slash,
-    Mod,
-    LessThan,
-    GreaterThan,
-    Amp,
-    AmpAmp,
-    Pipe,
-    PipePipe,
-};
+// labels-as-values threaded dispatch, with a portable switch as the fallback
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// max depth of nested calls
+constexpr int FRAMES_MAX = 16 * 1024;
+
+// max number of values that can live on the stack at once
+constexpr int STACK_MAX = 64 * 1024;
 
 struct CallFrame
 {
-	CallFrame(Function f, uint base) :
-		function(f),
-		base(base)
-	{ }
-
-	Function function;
-	uint ip = 0;
-	uint base;
+	Function *function;
+	u8 const *ip;
+	Value *base;
+
+	// position in the function's register code when running the register tier
+	RegisterInstruction *pc = nullptr;
 };
 
 class Vm
 {
 public:
-	Value run(Function);
+	Vm();
+	Vm(Vm const &) = delete;
+
+	Value run(Function *);
+
+	// Allocates every object a run creates out of a region owned by the vm, and frees
+	// them all at once when the run returns instead of collecting them.
+	// Globals left pointing at those objects are reset to nil, but nothing else is
+	// checked: a value from the region must not be stored into an object created before
+	// the run, or it is left dangling once the run returns. reuse_blocks keeps the
+	// region's memory around so later runs don't have to allocate it again.
+	void use_region(bool reuse_blocks);
+
+	// runs the register code of functions instead of their stack code.
+	// a function compiled without register code runs on the stack tier
+	void use_registers() { register_tier = true; }
+
+	// counts every instruction the stack tier runs in the profiler, see Profiler
+	void use_profiler(Profiler *p) { profiler = p; }
+
+	// lets the sampler take the samples its timer asks for, see Sampler
+	void use_sampler(Sampler *s) { sampler = s; }
+
+	// runs functions as machine code once they get hot, see Jit
+	void use_jit(Jit *j) { jit = j; }
+
+	// shared with the compiler so globals persist across separately compiled chunks
+	Globals globals;
 
 private:
-	std::vector<std::shared_ptr<Value>> stack;
-	std::unordered_map<std::string, std::shared_ptr<Value>> globals;
-	std::stack<CallFrame> frames;
+	std::unique_ptr<Value[]> stack;
+	Value *stack_top;
+	std::unique_ptr<CallFrame[]> frames;
+	int frame_count = 0;
+
+	// frame of the currently executing function
+	CallFrame *frame;
+
+	std::unique_ptr<Region> region;
+	bool reuse_region_blocks = false;
+
+	bool register_tier = false;
+	Profiler *profiler = nullptr;
+	Sampler *sampler = nullptr;
+	Jit *jit = nullptr;
+
+	void push(Value value) { *stack_top++ = value; }
+	Value pop() { return *--stack_top; }
+	Value &peek(uint offset = 0) { return stack_top[-1 - (int) offset]; }
+
+	Value interpret(int);
+	Value run_jit(u8 const *);
 
-	void push(std::shared_ptr<Value>);
-	std::shared_ptr<Value> pop();
-	std::shared_ptr<Value> peek(uint offset = 0);
+	bool call(Function *, int);
 
-	void binary_op(Operator);
+	// pushes a frame for fn, which sits on the stack below its arguments
+	void push_frame(Function *fn, int num_args)
+	{
+		if ((size_t) num_args != fn->num_params || frame_count == FRAMES_MAX || stack_top + fn->max_stack > stack.get() + STACK_MAX)
+			call_error(fn, num_args);
 
-	u8 read_byte();
-	u16 read_short();
-	Value read_constant();
+		frame = &frames[frame_count++];
+		*frame = CallFrame { fn, fn->chunk.bytecode(), stack_top - num_args - 1 };
+	}
+
+	[[noreturn]] void call_error(Function *, int);
+	bool call_value(int);
+	bool tail_call(int);
+
+	Value run_registers(Function *);
+	void call_registers(Value *, int);
+	void tail_call_registers(Value *, int);
+	void call_stack_tier(Value *, int);
+	void cover_registers(Value *);
+	void collect_garbage();
+	Value end_region(Value);
+
+	#ifdef DEBUG
+	void print_stack();
+	#endif
 
 	void runtime_error(std::string const &);
+
+	// machine code calls back into the vm through here
+	friend struct JitRuntime;
 };
+
+#ifdef OPCODE_HISTOGRAM
+// writes one "count previous next" line per pair of opcodes that ran back to back
+void print_opcode_pairs(std::FILE *);
+#endif
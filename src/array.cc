@@ -0,0 +1,78 @@
+#include "array.h"
+
+#include "heap.h"
+
+// buffers come from the same place as the objects that own them,
+// so a region's arrays don't touch malloc and vanish along with it
+template <typename... Args>
+static ArrayBuffer *new_buffer(std::pmr::memory_resource *resource, Args &&... args)
+{
+	std::pmr::polymorphic_allocator<ArrayBuffer> alloc(resource);
+	return alloc.new_object<ArrayBuffer>(std::pmr::vector<Value>(std::forward<Args>(args)..., alloc));
+}
+
+static void delete_buffer(ArrayBuffer *buffer)
+{
+	std::pmr::polymorphic_allocator<ArrayBuffer> alloc(buffer->elements.get_allocator());
+	alloc.delete_object(buffer);
+}
+
+Array::Array(Value const *begin, Value const *end) :
+	Obj(ObjType::Array),
+	buffer(new_buffer(heap.resource(), begin, end))
+{ }
+
+Array::Array(ArrayBuffer *buffer) :
+	Obj(ObjType::Array),
+	buffer(buffer)
+{
+	buffer->refs += 1;
+}
+
+// used by the collector to promote an array out of the nursery
+Array::Array(Array &&other) :
+	Obj(other),
+	buffer(other.buffer)
+{
+	other.buffer = nullptr;
+}
+
+Array::~Array()
+{
+	release();
+}
+
+void Array::release()
+{
+	if (buffer && --buffer->refs == 0)
+		delete_buffer(buffer);
+
+	buffer = nullptr;
+}
+
+void Array::set(size_t index, Value value)
+{
+	// an array from before a region that is written to during it mustn't end up with a buffer in the region
+	if (buffer->refs > 1)
+	{
+		buffer->refs -= 1;
+		auto resource = in_region ? heap.resource() : std::pmr::new_delete_resource();
+		buffer = new_buffer(resource, buffer->elements.begin(), buffer->elements.end());
+	}
+
+	if (index == buffer->elements.size())
+		buffer->elements.push_back(value);
+	else
+		buffer->elements[index] = value;
+
+	heap.write_barrier(this, value);
+}
+
+Array *Array::copy()
+{
+	auto array = allocate<Array>(buffer);
+	if (array->in_region && buffer->elements.get_allocator().resource() != heap.resource())
+		heap.borrow_buffer(array);
+
+	return array;
+}
@@ -0,0 +1,470 @@
+#include "bytecode_file.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "function.h"
+#include "heap.h"
+#include "register_code.h"
+#include "value.h"
+
+// Layout of a .tzc file, in host byte order:
+// the header, then the name of every global in slot order, then every
+// function, each one after the functions among its constants, ending with
+// the script itself. A function is its name, parameter count, inline cache
+// count, code size, the code, the number of line runs, the line runs aligned
+// for LineRun, and its constants.
+struct FileHeader
+{
+	char magic[4];
+	u32 version;
+	u64 source_hash;
+	u32 flags;
+	u32 num_globals;
+	u32 num_functions;
+	u32 padding;
+};
+
+static constexpr char MAGIC[4] = { 'T', 'Z', 'C', '\0' };
+
+// options that change the bytecode a script compiles to
+enum : u32
+{
+	FLAG_PEEPHOLE = 1,
+	FLAG_SUPERINSTRUCTIONS = 2,
+};
+
+// the kind of a constant, written before its value
+enum ConstantTag : u8
+{
+	TAG_NUMBER,
+	TAG_NIL,
+	TAG_TRUE,
+	TAG_FALSE,
+	TAG_STRING,
+	TAG_FUNCTION,
+	TAG_ARRAY,
+};
+
+static u32 option_flags(CompilerOptions const &options)
+{
+	u32 flags = options.peephole ? FLAG_PEEPHOLE : 0;
+
+	#ifndef NO_SUPERINSTRUCTIONS
+	flags |= FLAG_SUPERINSTRUCTIONS;
+	#endif
+
+	return flags;
+}
+
+std::string bytecode_path(const char *script)
+{
+	std::string path = script;
+	return path.ends_with(".tz") ? path + "c" : path + ".tzc";
+}
+
+u64 hash_source(const char *source, size_t size)
+{
+	u64 hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= static_cast<u8>(source[i]);
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+class BytecodeWriter
+{
+public:
+	std::vector<u8> out;
+	u32 num_functions = 0;
+
+	// false once a constant turns up that can't be written
+	bool ok = true;
+
+	void write(void const *bytes, size_t size)
+	{
+		auto p = static_cast<u8 const *>(bytes);
+		out.insert(out.end(), p, p + size);
+	}
+
+	void write_u32(u32 n) { write(&n, sizeof(n)); }
+
+	void write_string(std::string_view s)
+	{
+		write_u32(s.size());
+		write(s.data(), s.size());
+	}
+
+	void write_function(Function *);
+
+private:
+	std::unordered_map<Function *, u32> indices;
+
+	void write_functions_in(Value);
+	void write_value(Value);
+};
+
+void BytecodeWriter::write_function(Function *fn)
+{
+	for (auto constant : fn->chunk.constants)
+		write_functions_in(constant);
+
+	auto &chunk = fn->chunk;
+	write_string(fn->name);
+	write_u32(fn->num_params);
+	write_u32(fn->max_stack);
+	write_u32(chunk.caches.size());
+	write_u32(chunk.size());
+	write(chunk.bytecode(), chunk.size());
+
+	// the lines are read in place, so they must be aligned in the file
+	auto &runs = chunk.lines.runs;
+	write_u32(runs.size());
+	out.resize((out.size() + alignof(LineRun) - 1) & ~(alignof(LineRun) - 1));
+	write(runs.data(), runs.size() * sizeof(LineRun));
+
+	write_u32(chunk.constants.size());
+	for (auto constant : chunk.constants)
+		write_value(constant);
+
+	indices[fn] = num_functions++;
+}
+
+void BytecodeWriter::write_functions_in(Value value)
+{
+	if (value.is_fn() && !indices.contains(value.as_fn()))
+		write_function(value.as_fn());
+
+	else if (value.is_array())
+	{
+		for (auto element : value.as_array()->elements())
+			write_functions_in(element);
+	}
+}
+
+void BytecodeWriter::write_value(Value value)
+{
+	if (value.is_number())
+	{
+		auto number = value.as_number();
+		out.push_back(TAG_NUMBER);
+		write(&number, sizeof(number));
+	}
+
+	else if (value.is_nil())
+		out.push_back(TAG_NIL);
+
+	else if (value.is_bool())
+		out.push_back(value.as_bool() ? TAG_TRUE : TAG_FALSE);
+
+	else if (value.is_string())
+	{
+		out.push_back(TAG_STRING);
+		write_string(value.as_string()->str);
+	}
+
+	else if (value.is_fn())
+	{
+		out.push_back(TAG_FUNCTION);
+		write_u32(indices[value.as_fn()]);
+	}
+
+	else if (value.is_array())
+	{
+		auto &elements = value.as_array()->elements();
+		out.push_back(TAG_ARRAY);
+		write_u32(elements.size());
+		for (auto element : elements)
+			write_value(element);
+	}
+
+	else
+		ok = false;
+}
+
+bool write_bytecode_file(const char *path, Function *script, Globals const &globals, CompilerOptions const &options, u64 source_hash)
+{
+	BytecodeWriter writer;
+	writer.out.resize(sizeof(FileHeader));
+
+	for (auto name : globals.names)
+		writer.write_string(name->str);
+
+	writer.write_function(script);
+	if (!writer.ok)
+		return false;
+
+	FileHeader header = {};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = BYTECODE_VERSION;
+	header.source_hash = source_hash;
+	header.flags = option_flags(options);
+	header.num_globals = globals.names.size();
+	header.num_functions = writer.num_functions;
+	std::memcpy(writer.out.data(), &header, sizeof(header));
+
+	// written next to the file and renamed over it, so a process loading the file never sees half of it
+	auto temp = std::string(path) + ".tmp" + std::to_string(getpid());
+	auto file = std::fopen(temp.c_str(), "wb");
+	if (!file)
+		return false;
+
+	auto written = std::fwrite(writer.out.data(), 1, writer.out.size(), file) == writer.out.size();
+	if (std::fclose(file) != 0 || !written || std::rename(temp.c_str(), path) != 0)
+	{
+		std::remove(temp.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// Builds the functions of a mapped file. Every read is bounds checked,
+// and a file that doesn't hold what it should is treated as stale.
+class BytecodeReader
+{
+public:
+	BytecodeReader(u8 const *data, size_t size) :
+		data(data),
+		size(size)
+	{ }
+
+	bool read_globals(Globals &, u32);
+	Function *read_function();
+
+private:
+	u8 const *data;
+	size_t size;
+	size_t offset = sizeof(FileHeader);
+
+	// functions read so far, which later constants refer to by index
+	std::vector<Function *> functions;
+
+	u8 const *take(size_t n)
+	{
+		if (size - offset < n)
+			return nullptr;
+
+		auto p = data + offset;
+		offset += n;
+		return p;
+	}
+
+	bool read(void *bytes, size_t n)
+	{
+		auto p = take(n);
+		if (p)
+			std::memcpy(bytes, p, n);
+
+		return p;
+	}
+
+	bool read_u32(u32 &n) { return read(&n, sizeof(n)); }
+
+	bool read_string(std::string_view &s)
+	{
+		u32 length;
+		if (!read_u32(length))
+			return false;
+
+		auto p = take(length);
+		s = std::string_view(reinterpret_cast<const char *>(p), p ? length : 0);
+		return p;
+	}
+
+	bool read_value(Value &);
+};
+
+bool BytecodeReader::read_globals(Globals &globals, u32 count)
+{
+	for (u32 slot = 0; slot < count; slot++)
+	{
+		// the code refers to globals by slot, so they must land in the same ones they were compiled with
+		std::string_view name;
+		if (!read_string(name) || globals.resolve(intern(name)) != slot)
+			return false;
+	}
+
+	return true;
+}
+
+Function *BytecodeReader::read_function()
+{
+	std::string_view name;
+	u32 num_params, max_stack, num_caches, code_size, num_line_runs, num_constants;
+	if (!read_string(name) || !read_u32(num_params) || !read_u32(max_stack) || !read_u32(num_caches) || !read_u32(code_size))
+		return nullptr;
+
+	auto code = take(code_size);
+	if (!code || !read_u32(num_line_runs))
+		return nullptr;
+
+	offset = (offset + alignof(LineRun) - 1) & ~(alignof(LineRun) - 1);
+	auto lines = offset <= size ? take(static_cast<size_t>(num_line_runs) * sizeof(LineRun)) : nullptr;
+	if (!lines || !read_u32(num_constants))
+		return nullptr;
+
+	auto fn = allocate<Function>(std::string(name));
+	fn->num_params = num_params;
+	fn->max_stack = max_stack;
+	fn->chunk.mapped_code = code;
+	fn->chunk.mapped_size = code_size;
+	fn->chunk.mapped_lines = reinterpret_cast<LineRun const *>(lines);
+	fn->chunk.mapped_line_runs = num_line_runs;
+	fn->chunk.caches.resize(num_caches);
+
+	for (u32 i = 0; i < num_constants; i++)
+	{
+		Value constant;
+		if (!read_value(constant))
+			return nullptr;
+
+		fn->chunk.constants.push_back(constant);
+	}
+
+	functions.push_back(fn);
+	return fn;
+}
+
+bool BytecodeReader::read_value(Value &value)
+{
+	u8 tag;
+	if (!read(&tag, sizeof(tag)))
+		return false;
+
+	switch (tag)
+	{
+		case TAG_NUMBER:
+		{
+			double number;
+			if (!read(&number, sizeof(number)))
+				return false;
+
+			value = Value(number);
+			return true;
+		}
+
+		case TAG_NIL:   value = Value(nullptr); return true;
+		case TAG_TRUE:  value = Value(true);    return true;
+		case TAG_FALSE: value = Value(false);   return true;
+
+		case TAG_STRING:
+		{
+			std::string_view s;
+			if (!read_string(s))
+				return false;
+
+			value = Value(intern(s));
+			return true;
+		}
+
+		case TAG_FUNCTION:
+		{
+			u32 index;
+			if (!read_u32(index) || index >= functions.size())
+				return false;
+
+			value = Value(functions[index]);
+			return true;
+		}
+
+		case TAG_ARRAY:
+		{
+			u32 count;
+			if (!read_u32(count))
+				return false;
+
+			std::vector<Value> elements(count);
+			for (auto &element : elements)
+			{
+				if (!read_value(element))
+					return false;
+			}
+
+			// a constant, so it lives as long as the function holding it
+			value = Value(heap.allocate_old<Array>(elements.data(), elements.data() + elements.size()));
+			return true;
+		}
+
+		default:
+			return false;
+	}
+}
+
+BytecodeFile::~BytecodeFile()
+{
+	if (data)
+		munmap(data, size);
+}
+
+Function *BytecodeFile::load(const char *path, Globals &globals, CompilerOptions const &options, u64 source_hash, bool &stale)
+{
+	stale = false;
+
+	auto fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FileHeader))
+	{
+		close(fd);
+		stale = true;
+		return nullptr;
+	}
+
+	// a private read only mapping is backed by the page cache, so every process mapping the file shares it
+	size = st.st_size;
+	data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		data = nullptr;
+		return nullptr;
+	}
+
+	FileHeader header;
+	std::memcpy(&header, data, sizeof(header));
+
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != BYTECODE_VERSION || header.source_hash != source_hash)
+	{
+		stale = true;
+		return nullptr;
+	}
+
+	// a file compiled with other options isn't stale, it is just not for this run
+	if (header.flags != option_flags(options))
+		return nullptr;
+
+	BytecodeReader reader(static_cast<u8 const *>(data), size);
+	Function *script = nullptr;
+
+	if (header.num_functions > 0 && reader.read_globals(globals, header.num_globals))
+	{
+		for (u32 i = 0; i < header.num_functions; i++)
+		{
+			script = reader.read_function();
+			if (!script)
+				break;
+
+			if (options.registers)
+				compile_registers(*script);
+		}
+	}
+
+	stale = !script;
+	return script;
+}
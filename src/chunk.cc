@@ -1,5 +1,6 @@
 #include "chunk.h"
 
+#include <algorithm>
 #include <cstdio>
 
 #include "opcode.h"
@@ -8,7 +9,33 @@
 void Chunk::write(u8 byte, int line)
 {
 	code.push_back(byte);
-	lines.push_back(line);
+	lines.add(line);
+}
+
+int find_line(LineRun const *runs, size_t count, size_t offset)
+{
+	// the last run that starts at or before offset
+	auto run = std::upper_bound(runs, runs + count, offset, [](size_t offset, LineRun const &run) {
+		return offset < run.start;
+	});
+
+	return run == runs ? 0 : run[-1].line;
+}
+
+void LineTable::add(int line, size_t count)
+{
+	if (runs.empty() || runs.back().line != line)
+		runs.push_back({ static_cast<u32>(bytes), line });
+
+	bytes += count;
+}
+
+void LineTable::truncate(size_t size)
+{
+	while (!runs.empty() && runs.back().start >= size)
+		runs.pop_back();
+
+	bytes = std::min(bytes, size);
 }
 
 size_t Chunk::add_constant(Value value)
@@ -17,132 +44,229 @@ size_t Chunk::add_constant(Value value)
 	return constants.size() - 1;
 }
 
-void Chunk::disassemble(const char *name)
+size_t Chunk::add_cache()
 {
-	std::printf("== %s ==\n", name);
+	caches.emplace_back();
+	return caches.size() - 1;
+}
+
+void Chunk::disassemble(const char *name, std::FILE *out)
+{
+	std::fprintf(out, "== %s ==\n", name);
 	size_t offset = 0;
-	while (offset < code.size())
-		offset = disassemble_instruction(offset);
+	while (offset < size())
+		offset = disassemble_instruction(offset, out);
 	
-	std::printf("\n");
+	std::fprintf(out, "\n");
 }
 
-size_t Chunk::size()
+size_t Chunk::size() const
 {
-	return code.size();
+	return mapped_code ? mapped_size : code.size();
 }
 
-size_t Chunk::disassemble_instruction(size_t offset)
+size_t Chunk::disassemble_instruction(size_t offset, std::FILE *out)
 {
-	std::printf("%04d ", offset);
-	if (offset != 0 && lines[offset] == lines[offset + 1])
-		std::printf("   | ");
+	std::fprintf(out, "%04zu ", offset);
+	if (offset != 0 && line(offset) == line(offset - 1))
+		std::fprintf(out, "   | ");
 	else
-		std::printf("%*d ", 4, lines[offset]);
+		std::fprintf(out, "%*d ", 4, line(offset));
+
+	// the helpers below read operands at whatever width the prefix gives them
+	if (bytecode()[offset] == OP_WIDE)
+		std::fprintf(out, "OP_WIDE ");
 
-	auto instruction = static_cast<Opcode>(code[offset]);
+	auto instruction = instruction_opcode(bytecode() + offset);
 	switch (instruction)
 	{
 		case OP_RETURN:
-			return simple_instruction("OP_RETURN", offset);
+			return simple_instruction("OP_RETURN", offset, out);
 		case OP_CONSTANT:
-      		return constant_instruction("OP_CONSTANT", offset);
+      		return constant_instruction("OP_CONSTANT", offset, out);
 		case OP_NIL:
-			return simple_instruction("OP_NIL", offset);
+			return simple_instruction("OP_NIL", offset, out);
 		case OP_TRUE:
-			return simple_instruction("OP_TRUE", offset);
+			return simple_instruction("OP_TRUE", offset, out);
 		case OP_FALSE:
-			return simple_instruction("OP_FALSE", offset);
+			return simple_instruction("OP_FALSE", offset, out);
 		case OP_POP:
-			return simple_instruction("OP_POP", offset);
+			return simple_instruction("OP_POP", offset, out);
 		case OP_GET_LOCAL:
-			return byte_instruction("OP_GET_LOCAL", offset);
+			return byte_instruction("OP_GET_LOCAL", offset, out);
 		case OP_SET_LOCAL:
-			return byte_instruction("OP_SET_LOCAL", offset);
-		case OP_GET_GLOBAL:
-			return constant_instruction("OP_GET_GLOBAL", offset);
-		case OP_SET_GLOBAL:
-			return constant_instruction("OP_SET_GLOBAL", offset);
+			return byte_instruction("OP_SET_LOCAL", offset, out);
+		case OP_GET_GLOBAL_SLOT:
+			return short_instruction("OP_GET_GLOBAL_SLOT", offset, out);
+		case OP_SET_GLOBAL_SLOT:
+			return short_instruction("OP_SET_GLOBAL_SLOT", offset, out);
 		case OP_EQUAL:
-			return simple_instruction("OP_EQUAL", offset);
+			return simple_instruction("OP_EQUAL", offset, out);
 		case OP_GREATER:
-			return simple_instruction("OP_GREATER", offset);
+			return simple_instruction("OP_GREATER", offset, out);
 		case OP_LESS:
-			return simple_instruction("OP_LESS", offset);
+			return simple_instruction("OP_LESS", offset, out);
 		case OP_ADD:
-			return simple_instruction("OP_ADD", offset);
+			return simple_instruction("OP_ADD", offset, out);
 		case OP_SUBTRACT:
-			return simple_instruction("OP_SUBTRACT", offset);
+			return simple_instruction("OP_SUBTRACT", offset, out);
 		case OP_MULTIPLY:
-			return simple_instruction("OP_MULTIPLY", offset);
+			return simple_instruction("OP_MULTIPLY", offset, out);
 		case OP_DIVIDE:
-			return simple_instruction("OP_DIVIDE", offset);
+			return simple_instruction("OP_DIVIDE", offset, out);
+		case OP_MOD:
+			return simple_instruction("OP_MOD", offset, out);
+		case OP_LOGICAL_AND:
+			return simple_instruction("OP_LOGICAL_AND", offset, out);
+		case OP_LOGICAL_OR:
+			return simple_instruction("OP_LOGICAL_OR", offset, out);
+		case OP_BITWISE_AND:
+			return simple_instruction("OP_BITWISE_AND", offset, out);
+		case OP_BITWISE_OR:
+			return simple_instruction("OP_BITWISE_OR", offset, out);
 		case OP_NOT:
-			return simple_instruction("OP_NOT", offset);
+			return simple_instruction("OP_NOT", offset, out);
 		case OP_NEGATE:
-			return simple_instruction("OP_NEGATE", offset);
+			return simple_instruction("OP_NEGATE", offset, out);
 		case OP_PRINT:
-			return simple_instruction("OP_PRINT", offset);
+			return simple_instruction("OP_PRINT", offset, out);
 		case OP_JUMP:
-			return jump_instruction("OP_JUMP", 1, offset);
+			return jump_instruction("OP_JUMP", 1, offset, out);
 		case OP_JUMP_IF_FALSE:
-			return jump_instruction("OP_JUMP_IF_FALSE", 1, offset);
+			return jump_instruction("OP_JUMP_IF_FALSE", 1, offset, out);
 		case OP_LOOP:
-			return jump_instruction("OP_LOOP", -1, offset);
+			return jump_instruction("OP_LOOP", -1, offset, out);
 		case OP_CALL:
-			return byte_instruction("OP_CALL", offset);
+			return byte_instruction("OP_CALL", offset, out);
 		case OP_BUILD_ARRAY:
-			return byte_instruction("OP_BUILD_ARRAY", offset);
+			return byte_instruction("OP_BUILD_ARRAY", offset, out);
 		case OP_GET_SUBSCRIPT:
-			return byte_instruction("OP_GET_SUBSCRIPT", offset);
+			return simple_instruction("OP_GET_SUBSCRIPT", offset, out);
 		case OP_SET_SUBSCRIPT:
-			return array_instruction("OP_SET_SUBSCRIPT", offset);
+			return simple_instruction("OP_SET_SUBSCRIPT", offset, out);
 		case OP_CLASS:
-			return constant_instruction("OP_CLASS", offset);
+			return constant_instruction("OP_CLASS", offset, out);
 		case OP_GET_PROPERTY:
-			return constant_instruction("OP_GET_PROPERTY", offset);
+			return property_instruction("OP_GET_PROPERTY", offset, out);
 		case OP_SET_PROPERTY:
-			return constant_instruction("OP_SET_PROPERTY", offset);
+			return property_instruction("OP_SET_PROPERTY", offset, out);
+		case OP_NOT_EQUAL:
+			return simple_instruction("OP_NOT_EQUAL", offset, out);
+		case OP_GREATER_EQUAL:
+			return simple_instruction("OP_GREATER_EQUAL", offset, out);
+		case OP_LESS_EQUAL:
+			return simple_instruction("OP_LESS_EQUAL", offset, out);
+		case OP_ADD_CONSTANT:
+			return constant_instruction("OP_ADD_CONSTANT", offset, out);
+		case OP_SUBTRACT_CONSTANT:
+			return constant_instruction("OP_SUBTRACT_CONSTANT", offset, out);
+		case OP_ADD_LOCALS:
+			return locals_instruction("OP_ADD_LOCALS", offset, out);
+		case OP_SUBTRACT_LOCALS:
+			return locals_instruction("OP_SUBTRACT_LOCALS", offset, out);
+		case OP_SET_GLOBAL_POP:
+			return short_instruction("OP_SET_GLOBAL_POP", offset, out);
+		case OP_SET_LOCAL_POP:
+			return byte_instruction("OP_SET_LOCAL_POP", offset, out);
+		case OP_POP_JUMP_IF_FALSE:
+			return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, offset, out);
+		case OP_JUMP_IF_NOT_LESS:
+			return jump_instruction("OP_JUMP_IF_NOT_LESS", 1, offset, out);
+		case OP_JUMP_IF_NOT_GREATER:
+			return jump_instruction("OP_JUMP_IF_NOT_GREATER", 1, offset, out);
+		case OP_JUMP_IF_NOT_EQUAL:
+			return jump_instruction("OP_JUMP_IF_NOT_EQUAL", 1, offset, out);
+		case OP_JUMP_IF_LESS:
+			return jump_instruction("OP_JUMP_IF_LESS", 1, offset, out);
+		case OP_JUMP_IF_GREATER:
+			return jump_instruction("OP_JUMP_IF_GREATER", 1, offset, out);
+		case OP_JUMP_IF_EQUAL:
+			return jump_instruction("OP_JUMP_IF_EQUAL", 1, offset, out);
+		case OP_CALL_GLOBAL:
+			return call_global_instruction("OP_CALL_GLOBAL", offset, out);
+		case OP_ARRAY_CONSTANT:
+			return constant_instruction("OP_ARRAY_CONSTANT", offset, out);
+		case OP_TAIL_CALL:
+			return byte_instruction("OP_TAIL_CALL", offset, out);
+		case OP_TAIL_CALL_GLOBAL:
+			return call_global_instruction("OP_TAIL_CALL_GLOBAL", offset, out);
+		case OP_ADD_NUM:
+			return simple_instruction("OP_ADD_NUM", offset, out);
+		case OP_ADD_CONSTANT_NUM:
+			return constant_instruction("OP_ADD_CONSTANT_NUM", offset, out);
+		case OP_ADD_LOCALS_NUM:
+			return locals_instruction("OP_ADD_LOCALS_NUM", offset, out);
+		case OP_EQUAL_NUM:
+			return simple_instruction("OP_EQUAL_NUM", offset, out);
+		case OP_JUMP_IF_NOT_EQUAL_NUM:
+			return jump_instruction("OP_JUMP_IF_NOT_EQUAL_NUM", 1, offset, out);
+		case OP_GET_PROPERTY_MONO:
+			return property_instruction("OP_GET_PROPERTY_MONO", offset, out);
+		case OP_SET_PROPERTY_MONO:
+			return property_instruction("OP_SET_PROPERTY_MONO", offset, out);
 		default:
-			std::printf("Unknown opcode: %d\n", instruction);
+			std::fprintf(out, "Unknown opcode: %d\n", instruction);
 			return offset + 1;
 	}
 }
 
-size_t Chunk::simple_instruction(const char *name, size_t offset)
+size_t Chunk::simple_instruction(const char *name, size_t offset, std::FILE *out)
 {
-	std::printf("%s\n", name);
+	std::fprintf(out, "%s\n", name);
 	return offset + 1;
 }
 
-size_t Chunk::constant_instruction(const char *name, size_t offset)
+size_t Chunk::constant_instruction(const char *name, size_t offset, std::FILE *out)
+{
+	auto constant = read_operand(bytecode() + offset, 0);
+	std::fprintf(out, "%-16s %4zu ", name, constant);
+	std::fprintf(out, "%s\n", constants[constant].to_string().c_str());
+	return offset + instruction_size(bytecode() + offset);
+}
+
+size_t Chunk::byte_instruction(const char *name, size_t offset, std::FILE *out)
+{
+	auto slot = read_operand(bytecode() + offset, 0);
+	std::fprintf(out, "%-16s %4zu\n", name, slot);
+	return offset + instruction_size(bytecode() + offset);
+}
+
+size_t Chunk::short_instruction(const char *name, size_t offset, std::FILE *out)
+{
+	auto operand = read_operand(bytecode() + offset, 0);
+	std::fprintf(out, "%-16s %4zu\n", name, operand);
+	return offset + instruction_size(bytecode() + offset);
+}
+
+size_t Chunk::jump_instruction(const char *name, int sign, size_t offset, std::FILE *out)
 {
-	auto constant = code[offset + 1];
-	std::printf("%-16s %4d ", name, constant);
-	std::printf("%s\n", constants[constant].to_string().c_str());
-	return offset + 2;
+	auto jump = read_operand(bytecode() + offset, 0);
+	auto end = offset + instruction_size(bytecode() + offset);
+	std::fprintf(out, "%-16s %4zu -> %zu\n", name, offset, sign < 0 ? end - jump : end + jump);
+	return end;
 }
 
-size_t Chunk::byte_instruction(const char *name, size_t offset)
+size_t Chunk::property_instruction(const char *name, size_t offset, std::FILE *out)
 {
-	auto slot = code[offset + 1];
-	std::printf("%-16s %4d\n", name, slot);
-	return offset + 2;
+	auto constant = read_operand(bytecode() + offset, 0);
+	auto cache = read_operand(bytecode() + offset, 1);
+	std::fprintf(out, "%-16s %4zu ", name, constant);
+	std::fprintf(out, "%s (cache %zu)\n", constants[constant].to_string().c_str(), cache);
+	return offset + instruction_size(bytecode() + offset);
 }
 
-size_t Chunk::jump_instruction(const char *name, int sign, size_t offset)
+size_t Chunk::locals_instruction(const char *name, size_t offset, std::FILE *out)
 {
-	auto jump = (uint16_t) (code[offset + 1] << 8) | code[offset + 2];
-	std::printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
-	return offset + 3;
+	auto a = read_operand(bytecode() + offset, 0);
+	auto b = read_operand(bytecode() + offset, 1);
+	std::fprintf(out, "%-16s %4zu %4zu\n", name, a, b);
+	return offset + instruction_size(bytecode() + offset);
 }
 
-size_t Chunk::array_instruction(const char *name, size_t offset)
+size_t Chunk::call_global_instruction(const char *name, size_t offset, std::FILE *out)
 {
-	auto constant = code[offset + 1];
-	auto constant2 = code[offset + 2];
-	std::printf("%-16s %4d ", name, constant);
-	std::printf("%s ", constants[constant].to_string().c_str());
-	std::printf("%s\n", constants[constant2].to_string().c_str());
-	return offset + 3;
+	auto slot = read_operand(bytecode() + offset, 0);
+	auto num_args = read_operand(bytecode() + offset, 1);
+	std::fprintf(out, "%-16s %4zu (%zu args)\n", name, slot, num_args);
+	return offset + instruction_size(bytecode() + offset);
 }
@@ -1,6 +1,14 @@
 #include "compiler.h"
 
+#include <charconv>
+#include <cstdio>
 #include <functional>
+#include <iostream>
+
+#include "array.h"
+#include "heap.h"
+#include "peephole.h"
+#include "vm.h"
 
 struct ParseRule
 {
@@ -65,22 +73,110 @@ static ParseRule *get_rule(TokenType type)
 	return &rules[type];
 }
 
-Compiler::Compiler(const char *src)
-	: scanner(src)
+// applies a binary operator to two constants the way the vm would.
+// returns false when the vm would raise an error, which is left to happen at run time
+static bool fold_binary(TokenType op, Value a, Value b, Value &result)
+{
+	if (op == PLUS && a.is_string() && b.is_string())
+	{
+		result = Value(a.as_string()->str + b.as_string()->str);
+		return true;
+	}
+
+	if (op == EQUAL_EQUAL || op == NOT_EQUAL)
+	{
+		// every evaluation of an array literal makes a new array, and arrays compare by identity
+		if (a.is_array() || b.is_array())
+			return false;
+
+		result = (a == b) == (op == EQUAL_EQUAL);
+		return true;
+	}
+
+	if (!a.is_number() || !b.is_number())
+		return false;
+
+	auto x = a.as_number();
+	auto y = b.as_number();
+
+	switch (op)
+	{
+		case PLUS:          result = x + y; break;
+		case MINUS:         result = x - y; break;
+		case STAR:          result = x * y; break;
+		case SLASH:         result = x / y; break;
+		case GREATER:       result = x > y; break;
+		case GREATER_EQUAL: result = !(x < y); break;
+		case LESS:          result = x < y; break;
+		case LESS_EQUAL:    result = !(x > y); break;
+		case AND:           result = (bool) ((int) x & (int) y); break;
+		case PIPE:          result = (bool) ((int) x | (int) y); break;
+		case AND_AND:       result = (int) x && (int) y; break;
+		case PIPE_PIPE:     result = (int) x || (int) y; break;
+
+		case MOD:
+			if ((int) y == 0)
+				return false;
+
+			result = (double) ((int) x % (int) y);
+			break;
+
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+static bool fold_unary(TokenType op, Value a, Value &result)
+{
+	switch (op)
+	{
+		case MINUS:
+			if (!a.is_number())
+				return false;
+
+			result = -a.as_number();
+			return true;
+
+		case BANG:
+			result = a.is_falsy();
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+Compiler::Compiler(const char *src, Globals &globals, CompilerOptions options)
+	: scanner(src),
+	globals(globals),
+	options(options)
 {
 
 }
 
-Function Compiler::compile()
+Function *Compiler::compile()
 {
-	functions.push(Function {""});
+	functions.push({ allocate<Function>("") });
+	reset_fusion();
 	advance();
 
+	// every expression leaves exactly one value behind, which is discarded at the top level
 	while (!match(TOKEN_EOF))
+	{
 		expression();
+		emit_op(OP_POP);
+	}
+
+	emit_op(OP_NIL);
+	emit_op(OP_RETURN);
+	end_function(*functions.top().function);
+
+	if (options.peephole_stats)
+		std::fprintf(stderr, "peephole: %zu of %zu bytes saved\n", bytes_saved, bytes_emitted);
 
-	emit_byte(OP_RETURN);
-	return functions.top();
+	return functions.top().function;
 }
 
 void Compiler::advance()
@@ -134,6 +230,9 @@ void Compiler::parse_precedence(Precedence precedence)
 
 void Compiler::array(bool can_assign)
 {
+	auto &chunk = current_chunk();
+	ConstantExpression literal = { chunk.size(), chunk.constants.size() };
+	std::vector<Value> elements;
 	auto num_elements = 0;
 
 	if (current.type() != RIGHT_BRACKET)
@@ -141,72 +240,105 @@ void Compiler::array(bool can_assign)
 		do
 		{
 			num_elements += 1;
+			auto start = chunk.size();
 			expression();
+
+			if (is_constant(start))
+				elements.push_back(last_constant.value);
 		} while (match(COMMA));
 	}
 
 	consume(RIGHT_BRACKET, "Expect ']' after array literal");
-	emit_bytes(OP_BUILD_ARRAY, num_elements);
+
+	// an array of constants is built once, and each evaluation of the literal copies it
+	if (num_elements > 0 && elements.size() == (size_t) num_elements)
+	{
+		drop_constant(literal);
+		literal.value = heap.allocate_old<Array>(elements.data(), elements.data() + elements.size());
+
+		emit_instruction(OP_ARRAY_CONSTANT, make_constant(literal.value));
+		last_constant = literal;
+		return;
+	}
+
+	emit_instruction(OP_BUILD_ARRAY, num_elements);
 }
 
 void Compiler::binary(bool can_assign)
 {
 	auto op = previous.type();
 	auto precedence = get_rule(op)->precedence;
+	auto left = last_constant;
+	auto right_start = current_chunk().size();
 	parse_precedence(precedence);
 
+	Value result;
+	if (left.start != NO_INSTRUCTION && is_constant(right_start) && fold_binary(op, left.value, last_constant.value, result))
+	{
+		drop_constant(left);
+		emit_literal(result);
+		return;
+	}
+
 	switch (op)
 	{
 		case PLUS:
-			emit_byte(OP_ADD);
+			emit_op(OP_ADD);
 			break;
 		case MINUS:
-			emit_byte(OP_SUBTRACT);
+			emit_op(OP_SUBTRACT);
 			break;
 		case STAR:
-			emit_byte(OP_MULTIPLY);
+			emit_op(OP_MULTIPLY);
 			break;
 		case SLASH:
-			emit_byte(OP_DIVIDE);
+			emit_op(OP_DIVIDE);
 			break;
 		case MOD:
-			emit_byte(OP_MOD);
+			emit_op(OP_MOD);
 			break;
 		case NOT_EQUAL:
-			emit_bytes(OP_EQUAL, OP_NOT);
+			emit_op(OP_EQUAL);
+			emit_op(OP_NOT);
 			break;
 		case EQUAL_EQUAL:
-			emit_byte(OP_EQUAL);
+			emit_op(OP_EQUAL);
 			break;
 		case GREATER:
-			emit_byte(OP_GREATER);
+			emit_op(OP_GREATER);
 			break;
 		case GREATER_EQUAL:
-			emit_bytes(OP_LESS, OP_NOT);
+			emit_op(OP_LESS);
+			emit_op(OP_NOT);
 			break;
 		case LESS:
-			emit_byte(OP_LESS);
+			emit_op(OP_LESS);
 			break;
 		case LESS_EQUAL:
-			emit_bytes(OP_GREATER, OP_NOT);
+			emit_op(OP_GREATER);
+			emit_op(OP_NOT);
 			break;
 		case AND:
-			emit_byte(OP_BITWISE_AND);
+			emit_op(OP_BITWISE_AND);
 			break;
 		case PIPE:
-			emit_byte(OP_BITWISE_OR);
+			emit_op(OP_BITWISE_OR);
 			break;
 		case AND_AND:
-			emit_byte(OP_LOGICAL_AND);
+			emit_op(OP_LOGICAL_AND);
 			break;
 		case PIPE_PIPE:
-			emit_byte(OP_LOGICAL_OR);
+			emit_op(OP_LOGICAL_OR);
+			break;
+		default:
 			break;
 	}
 }
 
 void Compiler::call(bool can_assign)
 {
+	auto callee = global_callee;
+	global_callee = -1;
 	auto num_arguments = 0;
 
 	if (current.type() != RIGHT_PAREN)
@@ -219,24 +351,28 @@ void Compiler::call(bool can_assign)
 	}
 
 	consume(RIGHT_PAREN, "Expect ')' after arguments");
-	emit_bytes(OP_CALL, num_arguments);
+
+	// the callee's global wasn't read by variable(), the call looks it up itself
+	if (callee != -1)
+		emit_instruction(OP_CALL_GLOBAL, callee, num_arguments);
+	else
+		emit_instruction(OP_CALL, num_arguments);
 }
 
 void Compiler::dot(bool can_assign)
 {
 	consume(IDENTIFIER, "Expect identifier after '.'");
 	auto constant = make_constant(Value(previous.value()));
+	auto op = OP_GET_PROPERTY;
 
 	if (can_assign && match(EQUAL))
 	{
 		expression();
-		emit_bytes(OP_SET_PROPERTY, constant);
-	}
-	
-	else
-	{
-		emit_bytes(OP_GET_PROPERTY, constant);
+		op = OP_SET_PROPERTY;
 	}
+
+	auto cache = current_chunk().add_cache();
+	emit_instruction(op, constant, cache);
 }
 
 void Compiler::grouping(bool can_assign)
@@ -250,27 +386,32 @@ void Compiler::literal(bool can_assign)
 	switch (previous.type())
 	{
 		case KEY_FALSE:
-			emit_byte(OP_FALSE);
+			emit_literal(false);
 			break;
 		case KEY_NIL:
-			emit_byte(OP_NIL);
+			emit_literal(nullptr);
 			break;
 		case KEY_TRUE:
-			emit_byte(OP_TRUE);
+			emit_literal(true);
+			break;
+		default:
 			break;
 	}
 }
 
 void Compiler::number(bool can_assign)
 {
-	auto d = std::stod(previous.value());
-	emit_constant(Value(d));
+	// the scanner only produces numbers from_chars can parse
+	auto text = previous.value();
+	double d;
+	std::from_chars(text.data(), text.data() + text.size(), d);
+	emit_literal(d);
 }
 
 void Compiler::string(bool can_assign)
 {
 	auto str = previous.value();
-	emit_constant(Value(str.substr(1, str.size() - 2)));
+	emit_literal(Value(str.substr(1, str.size() - 2)));
 }
 
 void Compiler::subscript(bool can_assign)
@@ -281,27 +422,38 @@ void Compiler::subscript(bool can_assign)
 	if (can_assign && match(EQUAL))
 	{
 		expression();
-		emit_byte(OP_SET_SUBSCRIPT);
+		emit_op(OP_SET_SUBSCRIPT);
 	}
 	
 	else
 	{
-		emit_byte(OP_GET_SUBSCRIPT);
+		emit_op(OP_GET_SUBSCRIPT);
 	}
 }
 
 void Compiler::unary(bool can_assign)
 {
 	auto op = previous.type();
+	auto operand_start = current_chunk().size();
 	parse_precedence(PREC_UNARY);
 
+	Value result;
+	if (is_constant(operand_start) && fold_unary(op, last_constant.value, result))
+	{
+		drop_constant(last_constant);
+		emit_literal(result);
+		return;
+	}
+
 	switch (op)
 	{
 		case MINUS:
-			emit_byte(OP_NEGATE);
+			emit_op(OP_NEGATE);
 			break;
 		case BANG:
-			emit_byte(OP_NOT);
+			emit_op(OP_NOT);
+			break;
+		default:
 			break;
 	}
 }
@@ -309,34 +461,28 @@ void Compiler::unary(bool can_assign)
 void Compiler::variable(bool can_assign)
 {
 	auto identifier = previous;
+	int slot = resolve_local(identifier);
+	auto assign = can_assign && match(EQUAL);
 
-	Opcode get_op, set_op;
-	int value = resolve_local(identifier);
-
-	if (value == -1)
-	{
-		get_op = OP_GET_GLOBAL;
-		set_op = OP_SET_GLOBAL;
-		value = make_constant(identifier.value());
-	}
+	if (assign)
+		expression();
 
-	else
+	if (slot != -1)
 	{
-		get_op = OP_GET_LOCAL;
-		set_op = OP_SET_LOCAL;
+		emit_instruction(assign ? OP_SET_LOCAL : OP_GET_LOCAL, slot);
+		return;
 	}
 
-
-	if (can_assign && match(EQUAL))
+	#ifndef NO_SUPERINSTRUCTIONS
+	// a global that is called right away is left for call() to fetch with OP_CALL_GLOBAL
+	if (!assign && current.type() == LEFT_PAREN)
 	{
-		expression();
-		emit_bytes(set_op, value);
+		global_callee = global_slot(identifier.value());
+		return;
 	}
+	#endif
 
-	else
-	{
-		emit_bytes(get_op, value);
-	}
+	emit_global(assign ? OP_SET_GLOBAL_SLOT : OP_GET_GLOBAL_SLOT, identifier.value());
 }
 
 
@@ -383,8 +529,16 @@ void Compiler::expression()
 
 void Compiler::block()
 {
-	while (current.type() != RIGHT_BRACE)
+	// a block evaluates to its last expression, or nil when it is empty
+	if (current.type() == RIGHT_BRACE)
+		emit_op(OP_NIL);
+
+	while (current.type() != RIGHT_BRACE && current.type() != TOKEN_EOF)
+	{
 		expression();
+		if (current.type() != RIGHT_BRACE)
+			emit_op(OP_POP);
+	}
 	
 	consume(RIGHT_BRACE, "Expect '}' after block");
 }
@@ -392,99 +546,108 @@ void Compiler::block()
 void Compiler::print_expression()
 {
 	expression();
-	emit_byte(OP_PRINT);
+	emit_op(OP_PRINT);
 }
 
 void Compiler::if_expression()
 {
 	expression();
-	auto then_offset = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
+	bool popped;
+	auto then_offset = emit_branch(popped);
+	if (!popped)
+		emit_op(OP_POP);
 
 	consume(LEFT_BRACE, "Expect '{' before if block");
 	block();
 
 	auto else_offset = emit_jump(OP_JUMP);
-	emit_byte(OP_POP);
 	patch_jump(then_offset);
+	if (!popped)
+		emit_op(OP_POP);
 
 	if (match(KEY_ELSE))
 	{
 		if (match(KEY_IF))
-		{
 			if_expression();
-			return;
-		}
 
-		consume(LEFT_BRACE, "Expect '{' before else block");
-		block();
+		else
+		{
+			consume(LEFT_BRACE, "Expect '{' before else block");
+			block();
+		}
 	}
 
 	// insert nil when there is an if without else
 	else
-		emit_byte(OP_NIL);
+		emit_op(OP_NIL);
 	
 	patch_jump(else_offset);
 }
 
 void Compiler::while_expression()
 {
-	auto loop_start = functions.top().chunk.size();
+	auto loop_start = current_chunk().size();
+	fusion_barrier = loop_start;
+
 	expression();
-	auto exit_offset = emit_jump(OP_JUMP_IF_FALSE);
-	emit_byte(OP_POP);
+	bool popped;
+	auto exit_offset = emit_branch(popped);
+	if (!popped)
+		emit_op(OP_POP);
 	
 	consume(LEFT_BRACE, "Expect '{' before while block");
 	block();
+	emit_op(OP_POP);
 	emit_loop(loop_start);
 
 	patch_jump(exit_offset);
-	emit_byte(OP_POP);
+	if (!popped)
+		emit_op(OP_POP);
+
+	// while loops evaluate to nil
+	emit_op(OP_NIL);
 }
 
 void Compiler::return_expression()
 {
 	// TODO: don't parse expression if return is followed immediately by \n
 	expression();
-	emit_byte(OP_RETURN);
+	emit_op(OP_RETURN);
 }
 
 void Compiler::function_declaration()
 {
-	auto name = current.value();
-
-	auto fn = Function { name };
-	functions.push(fn);
+	// functions are built in place, so the heap object is the one being compiled into
+	auto fn = allocate<Function>(std::string(current.value()));
+	functions.push({ fn });
+	reset_fusion();
 	advance();
 
 	begin_scope();
 	consume(LEFT_PAREN, "Expect '(' after function name");
 
-	int num_params = 0;
 	while (!match(RIGHT_PAREN))
 	{
-		num_params += 1;
+		fn->num_params += 1;
 		add_local(current);
 		consume(IDENTIFIER, "Expect identifier");
 	}
 
-	functions.top().num_params = num_params;
 	consume(LEFT_BRACE, "Expect '{' before function body");
 	block();
-
-	if (functions.top().chunk.code.empty())
-		emit_constant(Value(nullptr));
-	
-	emit_byte(OP_RETURN);
-	fn = functions.top();
+	emit_op(OP_RETURN);
+	end_function(*fn);
 
 	#ifdef DEBUG
-	fn.chunk.disassemble(fn.name.c_str());
+	fn->chunk.disassemble(fn->name.c_str());
+	if (options.registers)
+		fn->registers.disassemble(fn->name.c_str());
 	#endif
 
 	functions.pop();
-	auto global = make_constant(Value(std::make_shared<Function>(fn)));
-	emit_bytes(OP_SET_GLOBAL, global);
+	reset_fusion();
+	emit_constant(Value(fn));
+	emit_global(OP_SET_GLOBAL_SLOT, fn->name);
 }
 
 void Compiler::class_declaration()
@@ -492,17 +655,39 @@ void Compiler::class_declaration()
 	consume(IDENTIFIER, "Expect class name");
 	auto klass = make_constant(Value(previous.value()));
 
-	emit_bytes(OP_CLASS, klass);
-	emit_bytes(OP_SET_GLOBAL, klass);
+	emit_instruction(OP_CLASS, klass);
+	emit_global(OP_SET_GLOBAL_SLOT, previous.value());
 
 	consume(LEFT_BRACE, "Expect '{' before class body");
 	consume(RIGHT_BRACE, "Expect '}' after class body");
 }
 
+// runs once a function's bytecode is complete
+void Compiler::end_function(Function &fn)
+{
+	auto saved = finish_chunk(fn.chunk, options.peephole, fn.max_stack);
+	bytes_saved += saved;
+	bytes_emitted += fn.chunk.size() + saved;
+
+	// like an array literal with more elements than the stack holds
+	if (fn.num_params + 1 + fn.max_stack > STACK_MAX)
+		error("Function needs more stack than there is");
+
+	// a function that doesn't fit runs on the stack tier, see Vm::call_registers
+	if (options.registers)
+		compile_registers(fn);
+}
+
 size_t Compiler::make_constant(Value value)
 {
-	auto constant = functions.top().chunk.add_constant(value);
-	if (constant > 0xff)
+	// a constant that is already in the pool is used again rather than added twice
+	auto &slots = functions.top().constant_slots;
+	auto [slot, added] = slots.try_emplace(value.bit_pattern(), current_chunk().constants.size());
+	if (!added)
+		return slot->second;
+
+	auto constant = current_chunk().add_constant(value);
+	if (constant > WIDE_OPERAND_MAX)
 	{
 		error("Too many constants in this chunk");
 		return 0;
@@ -511,9 +696,177 @@ size_t Compiler::make_constant(Value value)
 	return constant;
 }
 
+void Compiler::emit_op(Opcode op)
+{
+	last_constant.start = NO_INSTRUCTION;
+
+	#ifndef NO_SUPERINSTRUCTIONS
+	if (fuse(op))
+		return;
+	#endif
+
+	previous_instruction = last_instruction;
+	last_instruction = current_chunk().size();
+	emit_byte(op);
+}
+
+// folds op into the instructions just before it when together they make up a superinstruction.
+// only straight line code is rewritten, so the result behaves exactly like the original sequence
+bool Compiler::fuse(Opcode op)
+{
+	if (!fusable(last_instruction))
+		return false;
+
+	auto &code = current_chunk().code;
+	auto last = static_cast<Opcode>(code[last_instruction]);
+
+	switch (op)
+	{
+		case OP_NOT:
+		{
+			// comparisons without an opcode of their own are compiled as the opposite one negated
+			auto negated = last == OP_EQUAL ? OP_NOT_EQUAL
+				: last == OP_LESS ? OP_GREATER_EQUAL
+				: last == OP_GREATER ? OP_LESS_EQUAL
+				: op;
+
+			if (negated == op)
+				return false;
+
+			code[last_instruction] = negated;
+			return true;
+		}
+
+		case OP_ADD:
+		case OP_SUBTRACT:
+		{
+			if (last == OP_CONSTANT)
+			{
+				code[last_instruction] = op == OP_ADD ? OP_ADD_CONSTANT : OP_SUBTRACT_CONSTANT;
+				return true;
+			}
+
+			if (last == OP_GET_LOCAL && fusable(previous_instruction) && code[previous_instruction] == OP_GET_LOCAL)
+			{
+				auto a = code[previous_instruction + 1];
+				auto b = code[last_instruction + 1];
+				rewind(previous_instruction);
+
+				emit_op(op == OP_ADD ? OP_ADD_LOCALS : OP_SUBTRACT_LOCALS);
+				emit_bytes(a, b);
+				return true;
+			}
+
+			return false;
+		}
+
+		case OP_POP:
+		{
+			// assignments whose value is thrown away
+			if (last == OP_SET_GLOBAL_SLOT)
+				code[last_instruction] = OP_SET_GLOBAL_POP;
+			else if (last == OP_SET_LOCAL)
+				code[last_instruction] = OP_SET_LOCAL_POP;
+			else
+				return false;
+
+			return true;
+		}
+
+		default:
+			return false;
+	}
+}
+
+bool Compiler::fusable(size_t offset)
+{
+	return offset != NO_INSTRUCTION && offset >= fusion_barrier;
+}
+
+// drops everything emitted from offset on
+void Compiler::rewind(size_t offset)
+{
+	auto &chunk = current_chunk();
+	chunk.code.resize(offset);
+	chunk.lines.truncate(offset);
+
+	last_instruction = previous_instruction < offset ? previous_instruction : NO_INSTRUCTION;
+	previous_instruction = NO_INSTRUCTION;
+}
+
+// called whenever the function being emitted into changes
+void Compiler::reset_fusion()
+{
+	last_instruction = NO_INSTRUCTION;
+	previous_instruction = NO_INSTRUCTION;
+	fusion_barrier = current_chunk().size();
+	last_constant.start = NO_INSTRUCTION;
+}
+
+// emits a jump over the code that follows, taken when the condition on the stack is false.
+// popped is set when the jump consumes the condition, so neither path has to pop it.
+// a comparison right before the jump is folded into it
+size_t Compiler::emit_branch(bool &popped)
+{
+	#ifdef NO_SUPERINSTRUCTIONS
+	popped = false;
+	return emit_jump(OP_JUMP_IF_FALSE);
+	#else
+	popped = true;
+	auto op = OP_POP_JUMP_IF_FALSE;
+
+	if (fusable(last_instruction))
+	{
+		switch (current_chunk().code[last_instruction])
+		{
+			case OP_LESS:          op = OP_JUMP_IF_NOT_LESS; break;
+			case OP_GREATER:       op = OP_JUMP_IF_NOT_GREATER; break;
+			case OP_EQUAL:         op = OP_JUMP_IF_NOT_EQUAL; break;
+			case OP_GREATER_EQUAL: op = OP_JUMP_IF_LESS; break;
+			case OP_LESS_EQUAL:    op = OP_JUMP_IF_GREATER; break;
+			case OP_NOT_EQUAL:     op = OP_JUMP_IF_EQUAL; break;
+		}
+
+		if (op != OP_POP_JUMP_IF_FALSE)
+			rewind(last_instruction);
+	}
+
+	return emit_jump(op);
+	#endif
+}
+
+// emits op with the given operands, behind an OP_WIDE prefix when one doesn't fit its usual width
+void Compiler::emit_instruction(Opcode op, size_t a, size_t b)
+{
+	size_t operands[] = { a, b };
+	bool wide = false;
+
+	for (int i = 0; i < operand_count(op); i++)
+		wide = wide || operands[i] >> (8 * operand_width(op, i)) != 0;
+
+	if (wide)
+	{
+		emit_op(OP_WIDE);
+		emit_byte(op);
+	}
+
+	else
+		emit_op(op);
+
+	for (int i = 0; i < operand_count(op); i++)
+	{
+		auto width = wide ? WIDE_OPERAND_WIDTH : operand_width(op, i);
+		if (operands[i] > WIDE_OPERAND_MAX)
+			error("Operand is too large");
+
+		for (auto shift = 8 * width; shift > 0; shift -= 8)
+			emit_byte((operands[i] >> (shift - 8)) & 0xff);
+	}
+}
+
 void Compiler::emit_byte(u8 byte)
 {
-	functions.top().chunk.write(byte, previous.line());
+	current_chunk().write(byte, previous.line());
 }
 
 void Compiler::emit_bytes(u8 a, u8 b)
@@ -524,36 +877,98 @@ void Compiler::emit_bytes(u8 a, u8 b)
 
 void Compiler::emit_constant(Value value)
 {
-	auto constant = make_constant(value);
-	emit_bytes(OP_CONSTANT, constant);
+	emit_instruction(OP_CONSTANT, make_constant(value));
+}
+
+// emits a value known at compile time and remembers it, so the expression using it can be folded
+void Compiler::emit_literal(Value value)
+{
+	auto &chunk = current_chunk();
+	ConstantExpression literal = { chunk.size(), chunk.constants.size(), value };
+
+	if (value.is_nil())
+		emit_op(OP_NIL);
+	else if (value.is_bool())
+		emit_op(value.as_bool() ? OP_TRUE : OP_FALSE);
+	else
+		emit_constant(value);
+
+	last_constant = literal;
+}
+
+// whether everything emitted from start on is a single constant expression
+bool Compiler::is_constant(size_t start)
+{
+	return last_constant.start == start;
 }
 
+// takes back a constant expression and the constants it added, to emit its folded value instead
+void Compiler::drop_constant(ConstantExpression const &constant)
+{
+	rewind(constant.start);
+
+	auto &constants = current_chunk().constants;
+	for (auto i = constant.constants; i < constants.size(); i++)
+		functions.top().constant_slots.erase(constants[i].bit_pattern());
+
+	constants.resize(constant.constants);
+}
+
+// how far a forward jump goes isn't known yet, so it is emitted wide.
+// finish_chunk narrows it once the function is done if it turns out to fit
 size_t Compiler::emit_jump(Opcode op)
 {
+	emit_op(OP_WIDE);
 	emit_byte(op);
 	emit_bytes(0xff, 0xff);
-	return functions.top().chunk.size() - 2;
+	emit_byte(0xff);
+	return current_chunk().size() - WIDE_OPERAND_WIDTH;
 }
 
 void Compiler::patch_jump(size_t offset)
 {
-	auto jump = functions.top().chunk.size() - offset - 2;
-	if (jump > 0xffff)
+	auto &code = current_chunk().code;
+	auto jump = code.size() - offset - WIDE_OPERAND_WIDTH;
+	if (jump > WIDE_OPERAND_MAX)
 		error("Jump is out of bounds");
-	
-	functions.top().chunk.code[offset] = (jump >> 8) & 0xff;
-	functions.top().chunk.code[offset + 1] = jump & 0xff;
+
+	code[offset] = (jump >> 16) & 0xff;
+	code[offset + 1] = (jump >> 8) & 0xff;
+	code[offset + 2] = jump & 0xff;
+
+	// the jump lands on whatever is emitted next, and ends the expression that was being emitted
+	fusion_barrier = current_chunk().size();
+	last_constant.start = NO_INSTRUCTION;
 }
 
 void Compiler::emit_loop(size_t loop_start)
 {
-	emit_byte(OP_LOOP);
-	auto offset = functions.top().chunk.size() - loop_start + 2;
+	// the offset is counted from the end of the loop instruction, which is longer when wide
+	auto offset = current_chunk().size() - loop_start + instruction_size(OP_LOOP);
 	if (offset > 0xffff)
+		offset += 1 + WIDE_OPERAND_WIDTH - operand_width(OP_LOOP, 0);
+
+	if (offset > WIDE_OPERAND_MAX)
 		error("Loop offset is out of bounds");
 
-	emit_byte((offset >> 8) & 0xff);
-	emit_byte(offset & 0xff);
+	emit_instruction(OP_LOOP, offset);
+}
+
+void Compiler::emit_global(Opcode op, std::string_view name)
+{
+	emit_instruction(op, global_slot(name));
+}
+
+int Compiler::global_slot(std::string_view name)
+{
+	auto slot = globals.resolve(intern(name));
+	if (slot > WIDE_OPERAND_MAX)
+	{
+		error("Too many global variables");
+		return 0;
+	}
+
+	return slot;
 }
 
 void Compiler::error(const char *msg)
@@ -568,26 +983,24 @@ void Compiler::error_at_current(const char *msg)
 
 void Compiler::error_at(Token t, const char *msg)
 {
+	had_error = true;
 	std::cout << "[line " << t.line() << " ] Error: " << msg << "\n";
 }
 
 void Compiler::add_local(Token t)
 {
-	auto local = Local { t, -1 };
-	functions.top().locals.push_back(local);
+	auto &scope = functions.top();
+
+	// a later local shadows an earlier one with the same name
+	scope.locals.push_back({ t, -1 });
+	scope.local_slots[t.value()] = scope.locals.size();
 }
 
 int Compiler::resolve_local(Token t)
 {
-	auto local_count = functions.top().locals.size();
-	for (int i = local_count - 1; i >= 0; i--)
-	{
-		auto local = functions.top().locals[i];
-		if (t.value() == local.name.value())
-			return i + 1;
-	}
-
-	return -1;
+	auto &slots = functions.top().local_slots;
+	auto slot = slots.find(t.value());
+	return slot == slots.end() ? -1 : slot->second;
 }
 
 void Compiler::begin_scope()
@@ -602,7 +1015,7 @@ void Compiler::end_scope()
 
 	while (local_count > 0 && functions.top().locals[local_count - 1].depth > functions.top().scope_depth)
 	{
-		emit_byte(OP_POP);
+		emit_op(OP_POP);
 		local_count -= 1;
 	}
 }
@@ -3,6 +3,7 @@
 #include "value.h"
 
 Function::Function(std::string const &name) :
+	Obj(ObjType::Function),
 	name(name)
 {
 	num_params = 0;
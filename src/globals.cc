@@ -0,0 +1,14 @@
+#include "globals.h"
+
+u32 Globals::resolve(String *name)
+{
+	auto slot = slots.find(name);
+	if (slot != slots.end())
+		return slot->second;
+
+	auto index = static_cast<u32>(values.size());
+	slots[name] = index;
+	names.push_back(name);
+	values.push_back(Value::undefined());
+	return index;
+}
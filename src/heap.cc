@@ -0,0 +1,335 @@
+#include "heap.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "array.h"
+#include "function.h"
+#include "klass.h"
+#include "shape.h"
+
+Heap heap;
+
+static size_t object_size(Obj *obj)
+{
+	switch (obj->type)
+	{
+		case ObjType::String:
+			return sizeof(String) + static_cast<String *>(obj)->str.size();
+		case ObjType::Function:
+			return sizeof(Function);
+		case ObjType::Array:
+			return sizeof(Array);
+		case ObjType::Klass:
+			return sizeof(Klass);
+		case ObjType::Instance:
+			return sizeof(Instance);
+	}
+
+	return 0;
+}
+
+static double elapsed_us(std::chrono::steady_clock::time_point start)
+{
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::micro>(elapsed).count();
+}
+
+Heap::Heap() :
+	nursery(new u8[NURSERY_SIZE])
+{
+	nursery_top = nursery.get();
+	nursery_end = nursery.get() + NURSERY_SIZE;
+}
+
+void Heap::begin_region(Region *r)
+{
+	region = r;
+}
+
+void Heap::end_region(bool reuse_blocks)
+{
+	// otherwise the buffers would stay shared, and be copied on every later write
+	for (auto array : borrowed_buffers)
+	{
+		// unless a write already gave the array a buffer in the region
+		if (array->buffer->elements.get_allocator().resource() != region)
+			array->release();
+	}
+
+	borrowed_buffers.clear();
+
+	if (reuse_blocks)
+		region->reset();
+	else
+		region->release();
+
+	region = nullptr;
+}
+
+void Heap::collect(std::function<void(Heap &)> mark_roots)
+{
+	collect_minor(mark_roots);
+
+	if (major_requested)
+		collect_major(mark_roots);
+}
+
+void Heap::visit(Value &value)
+{
+	if (!value.is_obj())
+		return;
+
+	auto obj = value.as_obj();
+	visit(obj);
+	value = Value(obj);
+}
+
+void Heap::visit(Obj *&obj)
+{
+	if (!obj)
+		return;
+
+	if (marking)
+	{
+		if (!obj->marked)
+		{
+			obj->marked = true;
+			gray.push_back(obj);
+		}
+	}
+
+	else if (in_nursery(obj))
+		obj = promote(obj);
+}
+
+void Heap::track_old(Obj *obj)
+{
+	obj->next = old_objects;
+	old_objects = obj;
+
+	old_bytes += object_size(obj);
+	if (old_bytes > next_major)
+		major_requested = true;
+}
+
+void Heap::remember(Obj *obj)
+{
+	obj->remembered = true;
+	remembered_set.push_back(obj);
+}
+
+// moves a surviving nursery object into the old generation, leaving a forwarding pointer behind
+Obj *Heap::promote(Obj *obj)
+{
+	if (obj->forwarded)
+		return obj->next;
+
+	Obj *copy = nullptr;
+	switch (obj->type)
+	{
+		case ObjType::Array:
+			copy = new Array(std::move(*static_cast<Array *>(obj)));
+			break;
+		case ObjType::Klass:
+			copy = new Klass(std::move(*static_cast<Klass *>(obj)));
+			break;
+		case ObjType::Instance:
+			copy = new Instance(std::move(*static_cast<Instance *>(obj)));
+			break;
+		default:
+			// tenured types are never allocated in the nursery
+			return obj;
+	}
+
+	obj->forwarded = true;
+	obj->next = copy;
+
+	track_old(copy);
+	stats.bytes_promoted += object_size(copy);
+	gray.push_back(copy);
+	return copy;
+}
+
+// visits every object directly reachable from obj
+void Heap::trace(Obj *obj)
+{
+	switch (obj->type)
+	{
+		case ObjType::String:
+			break;
+
+		case ObjType::Klass:
+			visit(static_cast<Klass *>(obj)->name);
+			break;
+
+		case ObjType::Function:
+			for (auto &constant : static_cast<Function *>(obj)->chunk.constants)
+				visit(constant);
+			break;
+
+		case ObjType::Array:
+			for (auto &element : static_cast<Array *>(obj)->buffer->elements)
+				visit(element);
+			break;
+
+		case ObjType::Instance:
+		{
+			auto instance = static_cast<Instance *>(obj);
+			visit(instance->klass);
+			for (auto &field : instance->fields)
+				visit(field);
+			break;
+		}
+	}
+}
+
+void Heap::collect_minor(std::function<void(Heap &)> &mark_roots)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	mark_roots(*this);
+
+	for (auto obj : remembered_set)
+	{
+		obj->remembered = false;
+		trace(obj);
+	}
+
+	remembered_set.clear();
+
+	while (!gray.empty())
+	{
+		auto obj = gray.back();
+		gray.pop_back();
+		trace(obj);
+	}
+
+	sweep_nursery();
+	minor_requested = false;
+
+	auto pause = elapsed_us(start);
+	stats.minor_collections += 1;
+	stats.minor_pause_total += pause;
+	stats.minor_pause_max = std::max(stats.minor_pause_max, pause);
+}
+
+// destroys every nursery object in place and empties the nursery.
+// promoted objects have been moved out of, so destroying them frees nothing
+void Heap::sweep_nursery()
+{
+	auto p = nursery.get();
+	while (p < nursery_top)
+	{
+		auto obj = reinterpret_cast<Obj *>(p);
+		auto size = object_size(obj);
+
+		if (!obj->forwarded)
+			stats.bytes_freed += size;
+
+		obj->~Obj();
+		p += align_object(size);
+	}
+
+	nursery_top = nursery.get();
+}
+
+void Heap::collect_major(std::function<void(Heap &)> &mark_roots)
+{
+	auto start = std::chrono::steady_clock::now();
+	marking = true;
+
+	mark_roots(*this);
+
+	// shapes are keyed by field name, so those names must outlive every instance
+	std::vector<Shape *> shapes { Shape::root() };
+	while (!shapes.empty())
+	{
+		auto shape = shapes.back();
+		shapes.pop_back();
+
+		for (auto &[name, next] : shape->transitions)
+		{
+			auto obj = static_cast<Obj *>(name);
+			visit(obj);
+			shapes.push_back(next.get());
+		}
+	}
+
+	while (!gray.empty())
+	{
+		auto obj = gray.back();
+		gray.pop_back();
+		trace(obj);
+	}
+
+	marking = false;
+	sweep_old();
+
+	next_major = std::max(old_bytes * OLD_GROWTH_FACTOR, OLD_THRESHOLD);
+	major_requested = false;
+
+	auto pause = elapsed_us(start);
+	stats.major_collections += 1;
+	stats.major_pause_total += pause;
+	stats.major_pause_max = std::max(stats.major_pause_max, pause);
+}
+
+void Heap::sweep_old()
+{
+	auto link = &old_objects;
+	while (*link)
+	{
+		auto obj = *link;
+		if (obj->marked)
+		{
+			obj->marked = false;
+			link = &obj->next;
+			continue;
+		}
+
+		*link = obj->next;
+
+		auto size = object_size(obj);
+		old_bytes -= size;
+		stats.bytes_freed += size;
+
+		if (obj->type == ObjType::String)
+			unintern(static_cast<String *>(obj));
+
+		delete obj;
+	}
+}
+
+void Heap::free_all()
+{
+	sweep_nursery();
+	remembered_set.clear();
+
+	while (old_objects)
+	{
+		auto next = old_objects->next;
+		if (old_objects->type == ObjType::String)
+			unintern(static_cast<String *>(old_objects));
+
+		delete old_objects;
+		old_objects = next;
+	}
+
+	old_bytes = 0;
+}
+
+void Heap::print_stats(std::FILE *out)
+{
+	std::fprintf(out, "gc: %zu minor collections, %.1fus total, %.1fus max pause\n",
+		stats.minor_collections, stats.minor_pause_total, stats.minor_pause_max);
+	std::fprintf(out, "gc: %zu major collections, %.1fus total, %.1fus max pause\n",
+		stats.major_collections, stats.major_pause_total, stats.major_pause_max);
+	std::fprintf(out, "gc: %zu bytes promoted, %zu bytes freed, %zu bytes in old generation\n",
+		stats.bytes_promoted, stats.bytes_freed, old_bytes);
+}
+
+void free_objects()
+{
+	heap.free_all();
+}
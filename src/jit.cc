@@ -0,0 +1,1274 @@
+#include "jit.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "heap.h"
+#include "klass.h"
+#include "opcode.h"
+#include "vm.h"
+
+JitCode::~JitCode()
+{
+	#ifdef HAVE_JIT
+	munmap(code, size);
+	#endif
+}
+
+Jit::~Jit()
+{
+	if (perf_map)
+		std::fclose(perf_map);
+}
+
+#ifdef HAVE_JIT
+// what machine code is called as: the vm, the frame's first slot, the top of
+// the stack, where in the code to start, and the values of the globals
+using JitEntry = Value (*)(Vm *, Value *, Value *, void const *, Value *);
+
+// a call in tail position either jumps to entry, with the frame reused, or has
+// already been made normally when entry is null. sp is the new top of the stack
+struct TailCall
+{
+	Value *sp;
+	void const *entry;
+};
+
+// Where machine code calls back into the vm, for everything it doesn't do inline.
+// Each is given the top of the stack, and those that change the stack return
+// its new top. ip is where the interpreter's would be, for errors and samples
+struct JitRuntime
+{
+	static void sync(Vm *vm, Value *sp, u8 const *ip)
+	{
+		vm->stack_top = sp;
+		vm->frame->ip = ip;
+	}
+
+	[[noreturn]] static void error(Vm *vm, std::string const &msg)
+	{
+		vm->runtime_error(msg);
+		exit(1);
+	}
+
+	// the safepoint and sample the interpreter takes at loops and calls
+	static void poll(Vm *vm, Value *sp, u8 const *ip)
+	{
+		vm->stack_top = sp;
+		if (heap.wants_collection())
+			vm->collect_garbage();
+
+		if (Sampler::due() && vm->sampler)
+			vm->sampler->sample(vm->frames.get(), vm->frame_count, ip);
+	}
+
+	static Value *binary(Vm *vm, Value *sp, u64 op, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		auto b = vm->pop();
+		auto a = vm->pop();
+
+		if (op == OP_ADD && a.is_string() && b.is_string())
+		{
+			vm->push(intern(a.as_string()->str + b.as_string()->str));
+			return vm->stack_top;
+		}
+
+		if (!a.is_number() || !b.is_number())
+			error(vm, "Operands must be numbers");
+
+		auto x = a.as_number();
+		auto y = b.as_number();
+		switch (op)
+		{
+			case OP_ADD:          vm->push(x + y); break;
+			case OP_SUBTRACT:     vm->push(x - y); break;
+			case OP_MULTIPLY:     vm->push(x * y); break;
+			case OP_DIVIDE:       vm->push(x / y); break;
+			case OP_MOD:          vm->push(double((int) x % (int) y)); break;
+			case OP_LOGICAL_AND:  vm->push(bool((int) x && (int) y)); break;
+			case OP_LOGICAL_OR:   vm->push(bool((int) x || (int) y)); break;
+			case OP_BITWISE_AND:  vm->push(bool((int) x & (int) y)); break;
+			case OP_BITWISE_OR:   vm->push(bool((int) x | (int) y)); break;
+		}
+
+		return vm->stack_top;
+	}
+
+	// compares the two values on top of the stack, leaving them there
+	static int compare(Vm *vm, Value *sp, u64 op, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		auto a = sp[-2];
+		auto b = sp[-1];
+
+		if (op == OP_EQUAL)
+			return a == b;
+
+		if (op == OP_NOT_EQUAL)
+			return !(a == b);
+
+		if (!a.is_number() || !b.is_number())
+			error(vm, "Operands must be numbers");
+
+		auto x = a.as_number();
+		auto y = b.as_number();
+		switch (op)
+		{
+			case OP_GREATER:        return x > y;
+			case OP_LESS:           return x < y;
+			case OP_GREATER_EQUAL:  return !(x < y);
+			case OP_LESS_EQUAL:     return !(x > y);
+		}
+
+		return 0;
+	}
+
+	static Value *unary(Vm *vm, Value *sp, u64 op, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		auto value = vm->pop();
+
+		if (op == OP_NOT)
+			vm->push(value.is_falsy());
+
+		else if (!value.is_number())
+			error(vm, "Operand must be a number");
+
+		else
+			vm->push(-value.as_number());
+
+		return vm->stack_top;
+	}
+
+	[[noreturn]] static void undefined_global(Vm *vm, Value *sp, u64 slot, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		error(vm, "Undefined variable '" + vm->globals.names[slot]->str + "'");
+	}
+
+	// every helper is passed the vm, even those that don't need it
+	static Value *print(Vm *, Value *sp)
+	{
+		std::cout << sp[-1].to_string() << "\n";
+		return sp;
+	}
+
+	static Value *build_array(Vm *vm, Value *sp, u64 count)
+	{
+		vm->stack_top = sp - count;
+		auto array = allocate<Array>(sp - count, sp);
+
+		// nested arrays are stored by value
+		for (auto &element : array->buffer->elements)
+		{
+			if (element.is_array())
+				element = element.as_array()->copy();
+		}
+
+		vm->push(array);
+		return vm->stack_top;
+	}
+
+	static Value *get_subscript(Vm *vm, Value *sp, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		auto index = vm->pop();
+		auto array = vm->pop();
+
+		if (!array.is_array())
+			error(vm, "Only arrays can be subscripted");
+
+		if (!index.is_number())
+			error(vm, "Index must be a number");
+
+		auto i = (size_t) index.as_number();
+		if (index.as_number() < 0 || i >= array.as_array()->size())
+			error(vm, "Index out of bounds");
+
+		auto element = array.as_array()->get(i);
+		if (element.is_array())
+			element = element.as_array()->copy();
+
+		vm->push(element);
+		return vm->stack_top;
+	}
+
+	static Value *set_subscript(Vm *vm, Value *sp, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		auto element = vm->pop();
+		auto index = vm->pop();
+		auto array = vm->pop();
+
+		if (!array.is_array())
+			error(vm, "Only arrays can be subscripted");
+
+		if (!index.is_number())
+			error(vm, "Index must be a number");
+
+		// storing one past the end appends
+		auto i = (size_t) index.as_number();
+		if (index.as_number() < 0 || i > array.as_array()->size())
+			error(vm, "Index out of bounds");
+
+		if (element.is_array())
+			element = element.as_array()->copy();
+
+		array.as_array()->set(i, element);
+		vm->push(element);
+		return vm->stack_top;
+	}
+
+	static Value *klass(Vm *vm, Value *sp, u64 constant)
+	{
+		vm->stack_top = sp;
+		auto name = vm->frame->function->chunk.constants[constant];
+		vm->push(allocate<Klass>(name.as_string()));
+		return vm->stack_top;
+	}
+
+	static Value *get_property(Vm *vm, Value *sp, u64 constant, u64 cache, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		if (!sp[-1].is_instance())
+			error(vm, "Only instances have properties");
+
+		auto &chunk = vm->frame->function->chunk;
+		auto instance = sp[-1].as_instance();
+		sp[-1] = instance->get(chunk.constants[constant].as_string(), chunk.caches[cache]);
+		return sp;
+	}
+
+	static Value *set_property(Vm *vm, Value *sp, u64 constant, u64 cache, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		if (!sp[-2].is_instance())
+			error(vm, "Only instances have properties");
+
+		auto &chunk = vm->frame->function->chunk;
+		auto property = sp[-1];
+		auto instance = sp[-2].as_instance();
+		instance->set(chunk.constants[constant].as_string(), property, chunk.caches[cache]);
+		sp[-2] = property;
+		return sp - 1;
+	}
+
+	// the copy shares the constant's elements until it is written to
+	static Value *array_constant(Vm *vm, Value *sp, u64 constant)
+	{
+		vm->stack_top = sp;
+		vm->push(vm->frame->function->chunk.constants[constant].as_array()->copy());
+		return vm->stack_top;
+	}
+
+	// a function without machine code gets a frame pushed for it by the call,
+	// and is interpreted here until that frame returns
+	static void finish_call(Vm *vm, int depth)
+	{
+		if (vm->frame_count > depth)
+		{
+			auto result = vm->interpret(depth);
+			vm->frame = &vm->frames[depth - 1];
+			vm->push(result);
+		}
+	}
+
+	// makes a call from machine code. a callee with machine code of its own is
+	// called directly by the caller's code: its frame is pushed, and where to
+	// enter it is handed back. entry is null when the call has been made already
+	static TailCall call(Vm *vm, u64 num_args)
+	{
+		auto callable = vm->peek(num_args);
+		if (!callable.is_fn())
+		{
+			vm->call_value(num_args);
+			return { vm->stack_top, nullptr };
+		}
+
+		auto fn = callable.as_fn();
+		auto depth = vm->frame_count;
+		vm->push_frame(fn, num_args);
+
+		if (vm->jit->hot_call(fn))
+			return { vm->stack_top, fn->jit_code->tail_entry };
+
+		finish_call(vm, depth);
+		return { vm->stack_top, nullptr };
+	}
+
+	static TailCall call(Vm *vm, Value *sp, u64 num_args, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		poll(vm, sp, ip - 1);
+		return call(vm, num_args);
+	}
+
+	// the arguments of a call of a global are already pushed, so the callee is slipped in underneath them
+	static void insert_global_callee(Vm *vm, u64 slot, u64 num_args)
+	{
+		auto callable = vm->globals.values[slot];
+		if (callable.is_undefined())
+			error(vm, "Undefined variable '" + vm->globals.names[slot]->str + "'");
+
+		auto args = vm->stack_top - num_args;
+		std::copy_backward(args, vm->stack_top, vm->stack_top + 1);
+		*args = callable;
+		vm->stack_top += 1;
+	}
+
+	static TailCall call_global(Vm *vm, Value *sp, u64 slot, u64 num_args, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		poll(vm, sp, ip - 1);
+		insert_global_callee(vm, slot, num_args);
+		return call(vm, num_args);
+	}
+
+	// pops the frame of a function called directly, its result replacing it and its arguments
+	static Value *returned(Vm *vm, Value *callee, Value result)
+	{
+		vm->frame_count -= 1;
+		vm->frame = &vm->frames[vm->frame_count - 1];
+		*callee = result;
+		return callee + 1;
+	}
+
+	// a callee with machine code is jumped to, so recursion through calls in
+	// tail position stays in constant space in machine code as well
+	static TailCall tail_call(Vm *vm, Value *sp, u64 num_args, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		poll(vm, sp, ip - 1);
+		return tail_call(vm, num_args);
+	}
+
+	static TailCall tail_call_global(Vm *vm, Value *sp, u64 slot, u64 num_args, u8 const *ip)
+	{
+		sync(vm, sp, ip);
+		poll(vm, sp, ip - 1);
+		insert_global_callee(vm, slot, num_args);
+		return tail_call(vm, num_args);
+	}
+
+	// whether fn has machine code, or has been called often enough to be given it.
+	// a cold callee is called normally, which counts the call
+	static bool jit_ready(Vm *vm, Function *fn)
+	{
+		return fn->jit_code || (fn->calls >= JIT_CALL_THRESHOLD && vm->jit->compile(fn));
+	}
+
+	static TailCall tail_call(Vm *vm, u64 num_args)
+	{
+		auto callable = vm->peek(num_args);
+		if (callable.is_fn() && callable.as_fn()->num_params == num_args && jit_ready(vm, callable.as_fn()))
+		{
+			auto fn = callable.as_fn();
+			auto base = vm->frame->base;
+
+			// the callee takes over the caller's frame, but may need more stack than the caller did
+			if (base + num_args + 1 + fn->max_stack > vm->stack.get() + STACK_MAX)
+				vm->call_error(fn, num_args);
+
+			std::copy(vm->stack_top - num_args - 1, vm->stack_top, base);
+			vm->stack_top = base + num_args + 1;
+			*vm->frame = CallFrame { fn, fn->chunk.bytecode(), base };
+			return { vm->stack_top, fn->jit_code->tail_entry };
+		}
+
+		// anything else is called normally, and the return that follows returns its result
+		auto depth = vm->frame_count;
+		vm->call_value(num_args);
+		finish_call(vm, depth);
+		return { vm->stack_top, nullptr };
+	}
+};
+
+enum Reg : u8
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// what machine code keeps in the callee saved registers while it runs
+constexpr Reg VM = RBX;
+constexpr Reg SP = R12;
+constexpr Reg BASE = R13;
+constexpr Reg CONSTANTS = R14;
+constexpr Reg GLOBALS = R15;
+
+// counts down the jumps back in loops until the next poll of the vm
+constexpr Reg POLL = RBP;
+constexpr u32 POLL_INTERVAL = 64;
+
+// condition codes, and JMP for a jump that is always taken
+enum Condition : int
+{
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_A = 0x7,
+	CC_NP = 0xb,
+	JMP = -1,
+};
+
+// opcodes of the 64 bit register to register forms used
+enum Alu : u8
+{
+	ALU_OR = 0x09,
+	ALU_AND = 0x21,
+	ALU_CMP = 0x39,
+	ALU_TEST = 0x85,
+	ALU_MOV = 0x89,
+};
+
+// opcodes of the scalar double instructions used
+enum Sse : u8
+{
+	SSE_ADD = 0x58,
+	SSE_MUL = 0x59,
+	SSE_SUB = 0x5c,
+	SSE_DIV = 0x5e,
+};
+
+// just enough of an x86-64 assembler for the templates below
+class Assembler
+{
+public:
+	std::vector<u8> code;
+
+	size_t here() const { return code.size(); }
+
+	void emit(u8 byte) { code.push_back(byte); }
+
+	void emit32(u32 n)
+	{
+		for (int i = 0; i < 4; i++)
+			emit(n >> (8 * i));
+	}
+
+	void emit64(u64 n)
+	{
+		for (int i = 0; i < 8; i++)
+			emit(n >> (8 * i));
+	}
+
+	void mov(Reg dst, u64 imm)
+	{
+		emit(0x48 | (dst >> 3));
+		emit(0xb8 | (dst & 7));
+		emit64(imm);
+	}
+
+	void mov(Reg dst, Reg src) { alu(ALU_MOV, dst, src); }
+
+	void load(Reg dst, Reg base, int disp)
+	{
+		rex_w(dst, base);
+		emit(0x8b);
+		memory(dst, base, disp);
+	}
+
+	void store(Reg base, int disp, Reg src)
+	{
+		rex_w(src, base);
+		emit(0x89);
+		memory(src, base, disp);
+	}
+
+	void lea(Reg dst, Reg base, int disp)
+	{
+		rex_w(dst, base);
+		emit(0x8d);
+		memory(dst, base, disp);
+	}
+
+	void alu(Alu op, Reg dst, Reg src)
+	{
+		rex_w(src, dst);
+		emit(op);
+		direct(src, dst);
+	}
+
+	void add(Reg dst, int imm) { immediate(0, dst, imm); }
+	void sub(Reg dst, int imm) { immediate(5, dst, imm); }
+
+	void movq_to_xmm(int xmm, Reg src)
+	{
+		emit(0x66);
+		rex_w(xmm, src);
+		emit(0x0f);
+		emit(0x6e);
+		direct(xmm, src);
+	}
+
+	void movq_from_xmm(Reg dst, int xmm)
+	{
+		emit(0x66);
+		rex_w(xmm, dst);
+		emit(0x0f);
+		emit(0x7e);
+		direct(xmm, dst);
+	}
+
+	void sd(Sse op, int dst, int src)
+	{
+		emit(0xf2);
+		emit(0x0f);
+		emit(op);
+		direct(dst, src);
+	}
+
+	// sets the flags from comparing xmm a with xmm b
+	void ucomisd(int a, int b)
+	{
+		emit(0x66);
+		emit(0x0f);
+		emit(0x2e);
+		direct(a, b);
+	}
+
+	// al or cl
+	void setcc(Condition cc, Reg reg)
+	{
+		emit(0x0f);
+		emit(0x90 | cc);
+		direct(0, reg);
+	}
+
+	void and_al_cl() { emit(0x20); emit(0xc8); }
+	void xor_al(u8 imm) { emit(0x34); emit(imm); }
+	void movzx_eax_al() { emit(0x0f); emit(0xb6); emit(0xc0); }
+	void test_eax() { emit(0x85); emit(0xc0); }
+
+	// flips the sign of the double in rax
+	void negate_rax() { emit(0x48); emit(0x0f); emit(0xba); emit(0xf8); emit(63); }
+
+	void dec_poll() { emit(0xff); emit(0xc8 | POLL); }
+	void reset_poll() { emit(0xb8 | POLL); emit32(POLL_INTERVAL); }
+
+	void push(Reg reg)
+	{
+		if (reg >= R8)
+			emit(0x41);
+
+		emit(0x50 | (reg & 7));
+	}
+
+	void pop(Reg reg)
+	{
+		if (reg >= R8)
+			emit(0x41);
+
+		emit(0x58 | (reg & 7));
+	}
+
+	void call(Reg reg) { emit(0xff); emit(0xd0 | reg); }
+
+	// emits a call and returns where its offset goes, for bind
+	size_t call()
+	{
+		emit(0xe8);
+		emit32(0);
+		return here() - 4;
+	}
+	void jump(Reg reg) { emit(0xff); emit(0xe0 | reg); }
+	void ret() { emit(0xc3); }
+
+	// emits a jump and returns where its offset goes, for bind
+	size_t jump(Condition cc)
+	{
+		if (cc == JMP)
+			emit(0xe9);
+		else
+		{
+			emit(0x0f);
+			emit(0x80 | cc);
+		}
+
+		emit32(0);
+		return here() - 4;
+	}
+
+	// points the jump whose offset is at patch to target
+	void bind(size_t patch, size_t target)
+	{
+		u32 offset = target - (patch + 4);
+		std::memcpy(&code[patch], &offset, sizeof(offset));
+	}
+
+private:
+	void rex_w(int reg, int rm) { emit(0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3)); }
+	void direct(int reg, int rm) { emit(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+
+	// [base + disp32]. rsp and r12 as a base need a SIB byte
+	void memory(int reg, Reg base, int disp)
+	{
+		emit(0x80 | ((reg & 7) << 3) | (base & 7));
+		if ((base & 7) == RSP)
+			emit(0x24);
+
+		emit32(disp);
+	}
+
+	void immediate(int ext, Reg dst, int imm)
+	{
+		rex_w(0, dst);
+		emit(0x81);
+		direct(ext, dst);
+		emit32(imm);
+	}
+};
+
+// Translates the bytecode of one function, instruction by instruction
+class JitCompiler
+{
+public:
+	JitCompiler(Function *fn) :
+		chunk(fn->chunk),
+		code(fn->chunk.bytecode())
+	{ }
+
+	void compile();
+
+	Assembler a;
+
+	// where in the code tail calls and the interpreter enter the function
+	size_t tail_entry = 0;
+	std::unordered_map<size_t, size_t> entries;
+
+private:
+	Chunk &chunk;
+	u8 const *code;
+
+	// where the code of each instruction starts, and the jumps still to point at them
+	std::vector<size_t> native;
+	std::vector<std::pair<size_t, size_t>> jumps;
+
+	void instruction(size_t offset);
+
+	void push(Reg reg) { a.store(SP, 0, reg); a.add(SP, 8); }
+	void pop(Reg reg) { a.sub(SP, 8); a.load(reg, SP, 0); }
+	void peek(Reg reg, int distance) { a.load(reg, SP, -8 * (distance + 1)); }
+
+	void jump_to(size_t target, Condition cc = JMP) { jumps.push_back({ a.jump(cc), target }); }
+	void bind_here(size_t patch) { a.bind(patch, a.here()); }
+
+	// calls a JitRuntime function with the vm, the top of the stack and args.
+	// its result is the new top of the stack unless returns_sp is false
+	void call(void const *, std::initializer_list<u64> args, bool returns_sp = true);
+
+	void prologue();
+	void epilogue();
+
+	void check_number(Reg, std::vector<size_t> &slow);
+	void arithmetic(Opcode, u8 const *ip);
+	void comparison(Opcode, u8 const *ip);
+	void jump_if_falsy(Reg, size_t target);
+	void call_function(void const *, std::initializer_list<u64> args, u64 num_args);
+	void tail_call(void const *, std::initializer_list<u64> args);
+};
+
+template <typename F>
+static void const *helper(F f)
+{
+	return reinterpret_cast<void const *>(f);
+}
+
+static u64 address(void const *p)
+{
+	return reinterpret_cast<u64>(p);
+}
+
+// where the jump at offset lands
+static size_t jump_target(u8 const *bytes, size_t offset)
+{
+	auto end = offset + instruction_size(bytes + offset);
+	auto jump = read_operand(bytes + offset, 0);
+	return instruction_opcode(bytes + offset) == OP_LOOP ? end - jump : end + jump;
+}
+
+static bool is_jump(Opcode op)
+{
+	switch (op)
+	{
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL_NUM:
+		case OP_JUMP_IF_LESS:
+		case OP_JUMP_IF_GREATER:
+		case OP_JUMP_IF_EQUAL:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+void JitCompiler::compile()
+{
+	// the interpreter hands a function over at the top of its loops
+	std::vector<bool> loop_start(chunk.size() + 1);
+	for (size_t offset = 0; offset < chunk.size(); offset += instruction_size(code + offset))
+	{
+		if (instruction_opcode(code + offset) == OP_LOOP)
+			loop_start[jump_target(code, offset)] = true;
+	}
+
+	prologue();
+
+	// a tail call keeps the frame, but the function has constants of its own
+	tail_entry = a.here();
+	a.mov(CONSTANTS, address(chunk.constants.data()));
+
+	native.assign(chunk.size() + 1, 0);
+	for (size_t offset = 0; offset < chunk.size(); offset += instruction_size(code + offset))
+	{
+		native[offset] = a.here();
+		if (offset == 0 || loop_start[offset])
+			entries[offset] = a.here();
+
+		instruction(offset);
+	}
+
+	for (auto [patch, target] : jumps)
+		a.bind(patch, native[target]);
+}
+
+// entered as a JitEntry, so the arguments are in rdi, rsi, rdx, rcx and r8
+void JitCompiler::prologue()
+{
+	a.push(RBP);
+	a.push(RBX);
+	a.push(R12);
+	a.push(R13);
+	a.push(R14);
+	a.push(R15);
+
+	// keeps the stack 16 byte aligned for the calls into the runtime
+	a.sub(RSP, 8);
+
+	a.mov(VM, RDI);
+	a.mov(BASE, RSI);
+	a.mov(SP, RDX);
+	a.mov(GLOBALS, R8);
+	a.reset_poll();
+	a.mov(CONSTANTS, address(chunk.constants.data()));
+	a.jump(RCX);
+}
+
+// returns the value in rax
+void JitCompiler::epilogue()
+{
+	a.add(RSP, 8);
+	a.pop(R15);
+	a.pop(R14);
+	a.pop(R13);
+	a.pop(R12);
+	a.pop(RBX);
+	a.pop(RBP);
+	a.ret();
+}
+
+void JitCompiler::call(void const *fn, std::initializer_list<u64> args, bool returns_sp)
+{
+	static constexpr Reg registers[] = { RDX, RCX, R8, R9 };
+	assert(args.size() <= 4);
+
+	a.mov(RDI, VM);
+	a.mov(RSI, SP);
+
+	auto reg = registers;
+	for (auto arg : args)
+		a.mov(*reg++, arg);
+
+	a.mov(RAX, address(fn));
+	a.call(RAX);
+
+	if (returns_sp)
+		a.mov(SP, RAX);
+}
+
+// jumps to slow unless reg holds a number. rdx must hold QNAN
+void JitCompiler::check_number(Reg reg, std::vector<size_t> &slow)
+{
+	a.mov(R8, reg);
+	a.alu(ALU_AND, R8, RDX);
+	a.alu(ALU_CMP, R8, RDX);
+	slow.push_back(a.jump(CC_E));
+}
+
+// replaces the two numbers on top of the stack with the result of op,
+// calling the runtime for strings and errors
+void JitCompiler::arithmetic(Opcode op, u8 const *ip)
+{
+	std::vector<size_t> slow;
+	peek(RAX, 1);
+	peek(RCX, 0);
+	a.mov(RDX, Value::QNAN);
+	check_number(RAX, slow);
+	check_number(RCX, slow);
+
+	a.movq_to_xmm(0, RAX);
+	a.movq_to_xmm(1, RCX);
+	switch (op)
+	{
+		case OP_ADD:       a.sd(SSE_ADD, 0, 1); break;
+		case OP_SUBTRACT:  a.sd(SSE_SUB, 0, 1); break;
+		case OP_MULTIPLY:  a.sd(SSE_MUL, 0, 1); break;
+		case OP_DIVIDE:    a.sd(SSE_DIV, 0, 1); break;
+		default:           assert(!"Not an arithmetic opcode");
+	}
+
+	a.movq_from_xmm(RAX, 0);
+	a.store(SP, -16, RAX);
+	a.sub(SP, 8);
+	auto done = a.jump(JMP);
+
+	for (auto patch : slow)
+		bind_here(patch);
+
+	call(helper(JitRuntime::binary), { op, address(ip) });
+	bind_here(done);
+}
+
+// pops the two values on top of the stack, leaving 1 in eax if comparing them with op holds and 0 if not.
+// the greater and less equal forms are the negation of the opposite comparison, so NaN behaves as in the interpreter
+void JitCompiler::comparison(Opcode op, u8 const *ip)
+{
+	std::vector<size_t> slow;
+	peek(RAX, 1);
+	peek(RCX, 0);
+	a.mov(RDX, Value::QNAN);
+	check_number(RAX, slow);
+	check_number(RCX, slow);
+
+	a.movq_to_xmm(0, RAX);
+	a.movq_to_xmm(1, RCX);
+	switch (op)
+	{
+		case OP_GREATER:        a.ucomisd(0, 1); a.setcc(CC_A, RAX); break;
+		case OP_LESS:           a.ucomisd(1, 0); a.setcc(CC_A, RAX); break;
+		case OP_GREATER_EQUAL:  a.ucomisd(1, 0); a.setcc(CC_A, RAX); a.xor_al(1); break;
+		case OP_LESS_EQUAL:     a.ucomisd(0, 1); a.setcc(CC_A, RAX); a.xor_al(1); break;
+
+		// unordered sets the zero flag too, so parity must be clear for equal
+		case OP_EQUAL:
+		case OP_NOT_EQUAL:
+			a.ucomisd(0, 1);
+			a.setcc(CC_E, RAX);
+			a.setcc(CC_NP, RCX);
+			a.and_al_cl();
+			if (op == OP_NOT_EQUAL)
+				a.xor_al(1);
+
+			break;
+
+		default:
+			assert(!"Not a comparison opcode");
+	}
+
+	a.movzx_eax_al();
+	auto done = a.jump(JMP);
+
+	for (auto patch : slow)
+		bind_here(patch);
+
+	call(helper(JitRuntime::compare), { op, address(ip) }, false);
+	bind_here(done);
+	a.sub(SP, 16);
+}
+
+// only nil and false are falsy
+void JitCompiler::jump_if_falsy(Reg reg, size_t target)
+{
+	a.mov(RCX, Value::NIL_VAL);
+	a.alu(ALU_CMP, reg, RCX);
+	jump_to(target, CC_E);
+	a.mov(RCX, Value::FALSE_VAL);
+	a.alu(ALU_CMP, reg, RCX);
+	jump_to(target, CC_E);
+}
+
+// calls through the runtime, and then the callee's machine code when the runtime hands back an entry
+void JitCompiler::call_function(void const *fn, std::initializer_list<u64> args, u64 num_args)
+{
+	call(fn, args);
+	a.alu(ALU_TEST, RDX, RDX);
+	auto called = a.jump(CC_E);
+
+	// every function's code starts with the same prologue, which jumps on to the entry in rcx
+	a.mov(RCX, RDX);
+	a.mov(RDI, VM);
+	a.lea(RSI, SP, -8 * (num_args + 1));
+	a.mov(RDX, SP);
+	a.mov(R8, GLOBALS);
+	a.bind(a.call(), 0);
+
+	a.mov(RDI, VM);
+	a.lea(RSI, SP, -8 * (num_args + 1));
+	a.mov(RDX, RAX);
+	a.mov(RAX, address(helper(JitRuntime::returned)));
+	a.call(RAX);
+	a.mov(SP, RAX);
+	bind_here(called);
+}
+
+// jumps to the callee's tail entry when the runtime hands one back
+void JitCompiler::tail_call(void const *fn, std::initializer_list<u64> args)
+{
+	call(fn, args);
+	a.alu(ALU_TEST, RDX, RDX);
+	auto called = a.jump(CC_E);
+	a.jump(RDX);
+	bind_here(called);
+}
+
+void JitCompiler::instruction(size_t offset)
+{
+	auto bytes = code + offset;
+	auto op = instruction_opcode(bytes);
+	auto ip = bytes + instruction_size(bytes);
+	auto operand = operand_count(op) > 0 ? read_operand(bytes, 0) : 0;
+	auto operand2 = operand_count(op) > 1 ? read_operand(bytes, 1) : 0;
+	auto target = is_jump(op) ? jump_target(code, offset) : 0;
+
+	switch (op)
+	{
+		case OP_RETURN:
+			pop(RAX);
+			epilogue();
+			break;
+
+		case OP_CONSTANT:
+			a.load(RAX, CONSTANTS, 8 * operand);
+			push(RAX);
+			break;
+
+		case OP_NEGATE:
+		{
+			std::vector<size_t> slow;
+			peek(RAX, 0);
+			a.mov(RDX, Value::QNAN);
+			check_number(RAX, slow);
+			a.negate_rax();
+			a.store(SP, -8, RAX);
+			auto done = a.jump(JMP);
+
+			bind_here(slow[0]);
+			call(helper(JitRuntime::unary), { op, address(ip) });
+			bind_here(done);
+			break;
+		}
+
+		// the interpreter may have quickened the function before it got hot.
+		// the templates guard on the types anyway, so quickened forms compile like generic ones
+		case OP_ADD:
+		case OP_ADD_NUM:
+			arithmetic(OP_ADD, ip);
+			break;
+
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+			arithmetic(op, ip);
+			break;
+
+		case OP_MOD:
+		case OP_LOGICAL_AND:
+		case OP_LOGICAL_OR:
+		case OP_BITWISE_AND:
+		case OP_BITWISE_OR:
+			call(helper(JitRuntime::binary), { op, address(ip) });
+			break;
+
+		case OP_NIL:
+			a.mov(RAX, Value::NIL_VAL);
+			push(RAX);
+			break;
+
+		case OP_TRUE:
+			a.mov(RAX, Value::TRUE_VAL);
+			push(RAX);
+			break;
+
+		case OP_FALSE:
+			a.mov(RAX, Value::FALSE_VAL);
+			push(RAX);
+			break;
+
+		case OP_NOT:
+			call(helper(JitRuntime::unary), { op, address(ip) });
+			break;
+
+		// true and false differ only in their lowest bit
+		case OP_EQUAL:
+		case OP_EQUAL_NUM:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_NOT_EQUAL:
+		case OP_GREATER_EQUAL:
+		case OP_LESS_EQUAL:
+			comparison(op == OP_EQUAL_NUM ? OP_EQUAL : op, ip);
+			a.mov(RCX, Value::FALSE_VAL);
+			a.alu(ALU_OR, RAX, RCX);
+			push(RAX);
+			break;
+
+		case OP_PRINT:
+			call(helper(JitRuntime::print), {});
+			break;
+
+		case OP_POP:
+			a.sub(SP, 8);
+			break;
+
+		case OP_GET_GLOBAL_SLOT:
+		{
+			a.load(RAX, GLOBALS, 8 * operand);
+			a.mov(RCX, Value::UNDEFINED_VAL);
+			a.alu(ALU_CMP, RAX, RCX);
+			auto defined = a.jump(CC_NE);
+			call(helper(JitRuntime::undefined_global), { operand, address(ip) }, false);
+			bind_here(defined);
+			push(RAX);
+			break;
+		}
+
+		case OP_SET_GLOBAL_SLOT:
+			peek(RAX, 0);
+			a.store(GLOBALS, 8 * operand, RAX);
+			break;
+
+		case OP_SET_GLOBAL_POP:
+			pop(RAX);
+			a.store(GLOBALS, 8 * operand, RAX);
+			break;
+
+		case OP_GET_LOCAL:
+			a.load(RAX, BASE, 8 * operand);
+			push(RAX);
+			break;
+
+		case OP_SET_LOCAL:
+			peek(RAX, 0);
+			a.store(BASE, 8 * operand, RAX);
+			break;
+
+		case OP_SET_LOCAL_POP:
+			pop(RAX);
+			a.store(BASE, 8 * operand, RAX);
+			break;
+
+		case OP_JUMP_IF_FALSE:
+			peek(RAX, 0);
+			jump_if_falsy(RAX, target);
+			break;
+
+		case OP_POP_JUMP_IF_FALSE:
+			pop(RAX);
+			jump_if_falsy(RAX, target);
+			break;
+
+		case OP_JUMP:
+			jump_to(target);
+			break;
+
+		// the vm is only polled every POLL_INTERVAL times around
+		case OP_LOOP:
+			a.dec_poll();
+			jump_to(target, CC_NE);
+			call(helper(JitRuntime::poll), { address(code + target) }, false);
+			a.reset_poll();
+			jump_to(target);
+			break;
+
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_LESS:
+			comparison(OP_LESS, ip);
+			a.test_eax();
+			jump_to(target, op == OP_JUMP_IF_LESS ? CC_NE : CC_E);
+			break;
+
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_GREATER:
+			comparison(OP_GREATER, ip);
+			a.test_eax();
+			jump_to(target, op == OP_JUMP_IF_GREATER ? CC_NE : CC_E);
+			break;
+
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL_NUM:
+		case OP_JUMP_IF_EQUAL:
+			comparison(OP_EQUAL, ip);
+			a.test_eax();
+			jump_to(target, op == OP_JUMP_IF_EQUAL ? CC_NE : CC_E);
+			break;
+
+		case OP_CALL:
+			call_function(helper(static_cast<TailCall (*)(Vm *, Value *, u64, u8 const *)>(JitRuntime::call)), { operand, address(ip) }, operand);
+			break;
+
+		case OP_CALL_GLOBAL:
+			call_function(helper(JitRuntime::call_global), { operand, operand2, address(ip) }, operand2);
+			break;
+
+		case OP_TAIL_CALL:
+			tail_call(helper(static_cast<TailCall (*)(Vm *, Value *, u64, u8 const *)>(JitRuntime::tail_call)), { operand, address(ip) });
+			break;
+
+		case OP_TAIL_CALL_GLOBAL:
+			tail_call(helper(JitRuntime::tail_call_global), { operand, operand2, address(ip) });
+			break;
+
+		case OP_BUILD_ARRAY:
+			call(helper(JitRuntime::build_array), { operand });
+			break;
+
+		case OP_GET_SUBSCRIPT:
+			call(helper(JitRuntime::get_subscript), { address(ip) });
+			break;
+
+		case OP_SET_SUBSCRIPT:
+			call(helper(JitRuntime::set_subscript), { address(ip) });
+			break;
+
+		case OP_CLASS:
+			call(helper(JitRuntime::klass), { operand });
+			break;
+
+		case OP_GET_PROPERTY:
+		case OP_GET_PROPERTY_MONO:
+			call(helper(JitRuntime::get_property), { operand, operand2, address(ip) });
+			break;
+
+		case OP_SET_PROPERTY:
+		case OP_SET_PROPERTY_MONO:
+			call(helper(JitRuntime::set_property), { operand, operand2, address(ip) });
+			break;
+
+		case OP_ARRAY_CONSTANT:
+			call(helper(JitRuntime::array_constant), { operand });
+			break;
+
+		case OP_ADD_CONSTANT:
+		case OP_ADD_CONSTANT_NUM:
+		case OP_SUBTRACT_CONSTANT:
+			a.load(RAX, CONSTANTS, 8 * operand);
+			push(RAX);
+			arithmetic(op == OP_SUBTRACT_CONSTANT ? OP_SUBTRACT : OP_ADD, ip);
+			break;
+
+		case OP_ADD_LOCALS:
+		case OP_ADD_LOCALS_NUM:
+		case OP_SUBTRACT_LOCALS:
+			a.load(RAX, BASE, 8 * operand);
+			push(RAX);
+			a.load(RAX, BASE, 8 * operand2);
+			push(RAX);
+			arithmetic(op == OP_SUBTRACT_LOCALS ? OP_SUBTRACT : OP_ADD, ip);
+			break;
+
+		// instruction_opcode already looked through the prefix
+		case OP_WIDE:
+			assert(!"OP_WIDE is never decoded on its own");
+			break;
+	}
+}
+#endif
+
+bool Jit::compile(Function *fn)
+{
+	if (fn->jit_code)
+		return true;
+
+	#ifdef HAVE_JIT
+	if (fn->jit_failed)
+		return false;
+
+	JitCompiler compiler(fn);
+	compiler.compile();
+
+	auto size = compiler.a.code.size();
+	auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		fn->jit_failed = true;
+		return false;
+	}
+
+	// the code is never writable and executable at once
+	std::memcpy(memory, compiler.a.code.data(), size);
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, size);
+		fn->jit_failed = true;
+		return false;
+	}
+
+	auto code = std::make_unique<JitCode>(static_cast<u8 *>(memory), size);
+	code->entry = code->code + compiler.entries[0];
+	code->tail_entry = code->code + compiler.tail_entry;
+	code->entries = std::move(compiler.entries);
+	if (perf_map_wanted)
+		write_perf_map(fn, *code);
+
+	fn->jit_code = code.get();
+	functions.push_back(std::move(code));
+	return true;
+	#else
+	fn->jit_failed = true;
+	return false;
+	#endif
+}
+
+Value Jit::run(Vm *vm, Function *fn, Value *base, Value *sp, u8 const *at)
+{
+	#ifdef HAVE_JIT
+	auto jit = fn->jit_code;
+	auto target = jit->entry;
+
+	// anywhere but the start is the top of a loop the interpreter was running
+	if (at != fn->chunk.bytecode())
+	{
+		auto entry = jit->entries.find(at - fn->chunk.bytecode());
+		assert(entry != jit->entries.end());
+		target = jit->code + entry->second;
+	}
+
+	auto code = reinterpret_cast<JitEntry>(jit->code);
+	return code(vm, base, sp, target, vm->globals.values.data());
+	#else
+	assert(!"No machine code to run");
+	return Value();
+	#endif
+}
+
+// one "start size name" line per function, in the format perf reads for code it can't find in a binary
+void Jit::write_perf_map(Function *fn, JitCode const &code)
+{
+	if (!perf_map)
+	{
+		auto path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+		perf_map = std::fopen(path.c_str(), "w");
+		if (!perf_map)
+			return;
+	}
+
+	auto name = fn->name.empty() ? std::string("script") : fn->name;
+	std::fprintf(perf_map, "%llx %zx topaz:%s\n", (unsigned long long) code.code, code.size, name.c_str());
+	std::fflush(perf_map);
+}
@@ -1,11 +1,15 @@
 #include "klass.h"
 
-#include "value.h"
+#include "heap.h"
 
-Klass::Klass(std::string const &name) :
+Klass::Klass(String *name) :
+	Obj(ObjType::Klass),
 	name(name)
 { }
 
-Instance::Instance(std::shared_ptr<Klass> klass) :
-	klass(klass)
+Instance::Instance(Klass *klass) :
+	Obj(ObjType::Instance),
+	klass(klass),
+	shape(Shape::root()),
+	fields(heap.resource())
 { }
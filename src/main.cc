@@ -1,14 +1,24 @@
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <vector>
 
+#include "bytecode_file.h"
 #include "compiler.h"
+#include "heap.h"
+#include "jit.h"
+#include "profiler.h"
+#include "sampler.h"
 #include "vm.h"
 
-void repl()
+// never in a region: ending one after every line would reset the globals the line set
+void repl(CompilerOptions options)
 {
 	auto vm = Vm {};
-	auto line_num = 0;
+	if (options.registers)
+		vm.use_registers();
+
 	std::string line;
 
 	while (1)
@@ -19,46 +29,219 @@ void repl()
 		if (line == "exit")
 			break;
 		
-		auto fn = Compiler(line.data()).compile();
+		auto fn = Compiler(line.data(), vm.globals, options).compile();
 		vm.run(fn);
 	}
 }
 
-void run_file(const char *fname)
+std::vector<char> read_source(const char *fname)
 {
 	std::ifstream file(fname, std::ios::binary | std::ios::ate);
 	auto size = file.tellg();
 	file.seekg(0, std::ios::beg);
 
-	std::vector<char> buffer(size);
+	// zero initialized with room for the terminating null the scanner expects
+	std::vector<char> buffer(static_cast<size_t>(size) + 1);
 	file.read(buffer.data(), size);
+	return buffer;
+}
+
+// writes the .tzc file that later runs of the script load instead of compiling it
+bool compile_file(const char *fname, CompilerOptions options)
+{
+	auto buffer = read_source(fname);
+	auto globals = Globals {};
 
-	Compiler compiler(buffer.data());
+	Compiler compiler(buffer.data(), globals, options);
 	auto fn = compiler.compile();
+	if (compiler.failed())
+		return false;
+
+	auto path = bytecode_path(fname);
+	if (!write_bytecode_file(path.c_str(), fn, globals, options, hash_source(buffer.data(), buffer.size() - 1)))
+	{
+		std::cerr << "Could not write " << path << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+// returns false if the script doesn't compile
+bool run_file(const char *fname, bool region, CompilerOptions options, Profiler *profiler, Sampler *sampler, Jit *jit)
+{
+	auto buffer = read_source(fname);
+
+	auto vm = Vm {};
+	if (region)
+		vm.use_region(false);
+
+	if (options.registers)
+		vm.use_registers();
+
+	if (profiler)
+		vm.use_profiler(profiler);
+
+	if (sampler)
+		vm.use_sampler(sampler);
+
+	if (jit)
+		vm.use_jit(jit);
+
+	// a script that has been compiled with --compile runs from its .tzc file,
+	// which is rebuilt whenever the script changes
+	auto path = bytecode_path(fname);
+	auto source_hash = hash_source(buffer.data(), buffer.size() - 1);
+	auto bytecode = BytecodeFile {};
+	auto stale = false;
+	auto fn = bytecode.load(path.c_str(), vm.globals, options, source_hash, stale);
+
+	if (!fn)
+	{
+		Compiler compiler(buffer.data(), vm.globals, options);
+		fn = compiler.compile();
+
+		if (compiler.failed())
+			return false;
+
+		if (stale)
+			write_bytecode_file(path.c_str(), fn, vm.globals, options, source_hash);
+	}
 
 	#ifdef DEBUG
 	std::string chunk_name = "script " + std::string(fname);
-	fn.chunk.disassemble(chunk_name.c_str());
+	fn->chunk.disassemble(chunk_name.c_str());
+	if (options.registers)
+		fn->registers.disassemble(chunk_name.c_str());
 	#endif
 
-	auto vm = Vm {};
+	if (sampler)
+		sampler->start();
+
 	vm.run(fn);
+
+	if (sampler)
+		sampler->stop();
+
+	return true;
 }
 
 
 int main(int argc, char **argv)
 {
-	switch (argc)
+	const char *path = nullptr;
+	bool gc_stats = false;
+	bool region = false;
+	bool compile = false;
+	bool profile = false;
+	bool no_jit = false;
+	bool perf_map = false;
+	const char *sample_path = nullptr;
+	int sample_rate = Sampler::DEFAULT_RATE;
+	CompilerOptions options;
+
+	for (int i = 1; i < argc; i++)
 	{
-		case 1:
-			repl();
-			break;
-		case 2:
-			run_file(argv[1]);
-			break;
-		default:
-			std::cout << "usage: topaz [path]\n";
+		if (std::strcmp(argv[i], "--gc-stats") == 0)
+			gc_stats = true;
+
+		else if (std::strcmp(argv[i], "--region") == 0)
+			region = true;
+
+		else if (std::strcmp(argv[i], "--compile") == 0)
+			compile = true;
+
+		else if (std::strcmp(argv[i], "--profile") == 0)
+			profile = true;
+
+		// folded stacks go to the file named after --sample
+		else if (std::strcmp(argv[i], "--sample") == 0 && i + 1 < argc)
+			sample_path = argv[++i];
+
+		else if (std::strcmp(argv[i], "--sample-rate") == 0 && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+			sample_rate = std::atoi(argv[++i]);
+
+		else if (std::strcmp(argv[i], "--registers") == 0)
+			options.registers = true;
+
+		else if (std::strcmp(argv[i], "--no-jit") == 0)
+			no_jit = true;
+
+		else if (std::strcmp(argv[i], "--perf-map") == 0)
+			perf_map = true;
+
+		else if (std::strcmp(argv[i], "--no-peephole") == 0)
+			options.peephole = false;
+
+		else if (std::strcmp(argv[i], "--peephole-stats") == 0)
+			options.peephole_stats = true;
+
+		else if (!path)
+			path = argv[i];
+
+		else
+		{
+			std::cout << "usage: topaz [--compile] [--profile] [--sample file] [--sample-rate hz] [--gc-stats] [--region] [--registers] [--no-jit] [--perf-map] [--no-peephole] [--peephole-stats] [path]\n";
+			return 1;
+		}
+	}
+
+	if (compile)
+	{
+		if (!path)
+		{
+			std::cout << "usage: topaz --compile path\n";
+			return 1;
+		}
+
+		return compile_file(path, options) ? 0 : 1;
 	}
 
+	// the profilers only know the stack tier's bytecode
+	if ((profile || sample_path) && (!path || options.registers))
+	{
+		std::cout << "usage: topaz --profile|--sample file path, without --registers\n";
+		return 1;
+	}
+
+	auto profiler = Profiler {};
+	auto sampler = Sampler { sample_rate };
+
+	// the profiler counts instructions as the interpreter runs them, and the register tier has no machine code
+	auto jit = Jit { perf_map };
+	auto use_jit = !no_jit && !profile && !options.registers;
+
+	if (path)
+	{
+		if (!run_file(path, region, options, profile ? &profiler : nullptr, sample_path ? &sampler : nullptr, use_jit ? &jit : nullptr))
+			return 1;
+	}
+	else
+		repl(options);
+
+	if (profile)
+		profiler.report(stderr);
+
+	if (sample_path)
+	{
+		auto out = std::fopen(sample_path, "w");
+		if (!out)
+		{
+			std::cerr << "Could not write " << sample_path << "\n";
+			return 1;
+		}
+
+		sampler.write_folded(out);
+		std::fclose(out);
+	}
+
+	if (gc_stats)
+		heap.print_stats(stderr);
+
+	#ifdef OPCODE_HISTOGRAM
+	print_opcode_pairs(stderr);
+	#endif
+
+	free_objects();
 	return 0;
 }
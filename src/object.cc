@@ -0,0 +1,54 @@
+#include "object.h"
+
+#include <unordered_set>
+
+#include "heap.h"
+
+// lets the intern table be probed with characters that aren't a String yet
+struct StringKey
+{
+	std::string_view str;
+	size_t hash;
+};
+
+struct InternHash
+{
+	using is_transparent = void;
+
+	size_t operator()(String *s) const { return s->hash; }
+	size_t operator()(StringKey const &key) const { return key.hash; }
+};
+
+struct InternEqual
+{
+	using is_transparent = void;
+
+	bool operator()(String *a, String *b) const { return a == b; }
+	bool operator()(StringKey const &key, String *s) const { return key.str == s->str; }
+	bool operator()(String *s, StringKey const &key) const { return key.str == s->str; }
+};
+
+static std::unordered_set<String *, InternHash, InternEqual> strings;
+
+String::String(std::string_view str, size_t hash) :
+	Obj(ObjType::String),
+	str(str),
+	hash(hash)
+{ }
+
+String *intern(std::string_view str)
+{
+	auto key = StringKey { str, std::hash<std::string_view>{}(str) };
+	auto interned = strings.find(key);
+	if (interned != strings.end())
+		return *interned;
+
+	auto s = allocate<String>(str, key.hash);
+	strings.insert(s);
+	return s;
+}
+
+void unintern(String *s)
+{
+	strings.erase(s);
+}
@@ -0,0 +1,187 @@
+#include "opcode.h"
+
+static const char *names[] = {
+	[OP_RETURN]               = "OP_RETURN",
+	[OP_CONSTANT]             = "OP_CONSTANT",
+	[OP_NEGATE]               = "OP_NEGATE",
+	[OP_ADD]                  = "OP_ADD",
+	[OP_SUBTRACT]             = "OP_SUBTRACT",
+	[OP_MULTIPLY]             = "OP_MULTIPLY",
+	[OP_DIVIDE]               = "OP_DIVIDE",
+	[OP_MOD]                  = "OP_MOD",
+	[OP_NIL]                  = "OP_NIL",
+	[OP_TRUE]                 = "OP_TRUE",
+	[OP_FALSE]                = "OP_FALSE",
+	[OP_NOT]                  = "OP_NOT",
+	[OP_EQUAL]                = "OP_EQUAL",
+	[OP_GREATER]              = "OP_GREATER",
+	[OP_LESS]                 = "OP_LESS",
+	[OP_LOGICAL_AND]          = "OP_LOGICAL_AND",
+	[OP_LOGICAL_OR]           = "OP_LOGICAL_OR",
+	[OP_BITWISE_AND]          = "OP_BITWISE_AND",
+	[OP_BITWISE_OR]           = "OP_BITWISE_OR",
+	[OP_PRINT]                = "OP_PRINT",
+	[OP_POP]                  = "OP_POP",
+	[OP_GET_GLOBAL_SLOT]      = "OP_GET_GLOBAL_SLOT",
+	[OP_SET_GLOBAL_SLOT]      = "OP_SET_GLOBAL_SLOT",
+	[OP_GET_LOCAL]            = "OP_GET_LOCAL",
+	[OP_SET_LOCAL]            = "OP_SET_LOCAL",
+	[OP_JUMP_IF_FALSE]        = "OP_JUMP_IF_FALSE",
+	[OP_JUMP]                 = "OP_JUMP",
+	[OP_LOOP]                 = "OP_LOOP",
+	[OP_CALL]                 = "OP_CALL",
+	[OP_BUILD_ARRAY]          = "OP_BUILD_ARRAY",
+	[OP_GET_SUBSCRIPT]        = "OP_GET_SUBSCRIPT",
+	[OP_SET_SUBSCRIPT]        = "OP_SET_SUBSCRIPT",
+	[OP_CLASS]                = "OP_CLASS",
+	[OP_GET_PROPERTY]         = "OP_GET_PROPERTY",
+	[OP_SET_PROPERTY]         = "OP_SET_PROPERTY",
+	[OP_NOT_EQUAL]            = "OP_NOT_EQUAL",
+	[OP_GREATER_EQUAL]        = "OP_GREATER_EQUAL",
+	[OP_LESS_EQUAL]           = "OP_LESS_EQUAL",
+	[OP_ADD_CONSTANT]         = "OP_ADD_CONSTANT",
+	[OP_SUBTRACT_CONSTANT]    = "OP_SUBTRACT_CONSTANT",
+	[OP_ADD_LOCALS]           = "OP_ADD_LOCALS",
+	[OP_SUBTRACT_LOCALS]      = "OP_SUBTRACT_LOCALS",
+	[OP_SET_GLOBAL_POP]       = "OP_SET_GLOBAL_POP",
+	[OP_SET_LOCAL_POP]        = "OP_SET_LOCAL_POP",
+	[OP_POP_JUMP_IF_FALSE]    = "OP_POP_JUMP_IF_FALSE",
+	[OP_JUMP_IF_NOT_LESS]     = "OP_JUMP_IF_NOT_LESS",
+	[OP_JUMP_IF_NOT_GREATER]  = "OP_JUMP_IF_NOT_GREATER",
+	[OP_JUMP_IF_NOT_EQUAL]    = "OP_JUMP_IF_NOT_EQUAL",
+	[OP_JUMP_IF_LESS]         = "OP_JUMP_IF_LESS",
+	[OP_JUMP_IF_GREATER]      = "OP_JUMP_IF_GREATER",
+	[OP_JUMP_IF_EQUAL]        = "OP_JUMP_IF_EQUAL",
+	[OP_CALL_GLOBAL]          = "OP_CALL_GLOBAL",
+	[OP_ARRAY_CONSTANT]       = "OP_ARRAY_CONSTANT",
+	[OP_WIDE]                 = "OP_WIDE",
+	[OP_TAIL_CALL]            = "OP_TAIL_CALL",
+	[OP_TAIL_CALL_GLOBAL]     = "OP_TAIL_CALL_GLOBAL",
+	[OP_ADD_NUM]              = "OP_ADD_NUM",
+	[OP_ADD_CONSTANT_NUM]     = "OP_ADD_CONSTANT_NUM",
+	[OP_ADD_LOCALS_NUM]       = "OP_ADD_LOCALS_NUM",
+	[OP_EQUAL_NUM]            = "OP_EQUAL_NUM",
+	[OP_JUMP_IF_NOT_EQUAL_NUM] = "OP_JUMP_IF_NOT_EQUAL_NUM",
+	[OP_GET_PROPERTY_MONO]    = "OP_GET_PROPERTY_MONO",
+	[OP_SET_PROPERTY_MONO]    = "OP_SET_PROPERTY_MONO",
+};
+
+// bytes taken by each operand of an instruction without an OP_WIDE prefix
+static const u8 widths[][2] = {
+	[OP_RETURN]               = { },
+	[OP_CONSTANT]             = { 1 },
+	[OP_NEGATE]               = { },
+	[OP_ADD]                  = { },
+	[OP_SUBTRACT]             = { },
+	[OP_MULTIPLY]             = { },
+	[OP_DIVIDE]               = { },
+	[OP_MOD]                  = { },
+	[OP_NIL]                  = { },
+	[OP_TRUE]                 = { },
+	[OP_FALSE]                = { },
+	[OP_NOT]                  = { },
+	[OP_EQUAL]                = { },
+	[OP_GREATER]              = { },
+	[OP_LESS]                 = { },
+	[OP_LOGICAL_AND]          = { },
+	[OP_LOGICAL_OR]           = { },
+	[OP_BITWISE_AND]          = { },
+	[OP_BITWISE_OR]           = { },
+	[OP_PRINT]                = { },
+	[OP_POP]                  = { },
+	[OP_GET_GLOBAL_SLOT]      = { 2 },
+	[OP_SET_GLOBAL_SLOT]      = { 2 },
+	[OP_GET_LOCAL]            = { 1 },
+	[OP_SET_LOCAL]            = { 1 },
+	[OP_JUMP_IF_FALSE]        = { 2 },
+	[OP_JUMP]                 = { 2 },
+	[OP_LOOP]                 = { 2 },
+	[OP_CALL]                 = { 1 },
+	[OP_BUILD_ARRAY]          = { 1 },
+	[OP_GET_SUBSCRIPT]        = { },
+	[OP_SET_SUBSCRIPT]        = { },
+	[OP_CLASS]                = { 1 },
+	[OP_GET_PROPERTY]         = { 1, 2 },
+	[OP_SET_PROPERTY]         = { 1, 2 },
+	[OP_NOT_EQUAL]            = { },
+	[OP_GREATER_EQUAL]        = { },
+	[OP_LESS_EQUAL]           = { },
+	[OP_ADD_CONSTANT]         = { 1 },
+	[OP_SUBTRACT_CONSTANT]    = { 1 },
+	[OP_ADD_LOCALS]           = { 1, 1 },
+	[OP_SUBTRACT_LOCALS]      = { 1, 1 },
+	[OP_SET_GLOBAL_POP]       = { 2 },
+	[OP_SET_LOCAL_POP]        = { 1 },
+	[OP_POP_JUMP_IF_FALSE]    = { 2 },
+	[OP_JUMP_IF_NOT_LESS]     = { 2 },
+	[OP_JUMP_IF_NOT_GREATER]  = { 2 },
+	[OP_JUMP_IF_NOT_EQUAL]    = { 2 },
+	[OP_JUMP_IF_LESS]         = { 2 },
+	[OP_JUMP_IF_GREATER]      = { 2 },
+	[OP_JUMP_IF_EQUAL]        = { 2 },
+	[OP_CALL_GLOBAL]          = { 2, 1 },
+	[OP_ARRAY_CONSTANT]       = { 1 },
+	[OP_WIDE]                 = { },
+	[OP_TAIL_CALL]            = { 1 },
+	[OP_TAIL_CALL_GLOBAL]     = { 2, 1 },
+	[OP_ADD_NUM]              = { },
+	[OP_ADD_CONSTANT_NUM]     = { 1 },
+	[OP_ADD_LOCALS_NUM]       = { 1, 1 },
+	[OP_EQUAL_NUM]            = { },
+	[OP_JUMP_IF_NOT_EQUAL_NUM] = { 2 },
+	[OP_GET_PROPERTY_MONO]    = { 1, 2 },
+	[OP_SET_PROPERTY_MONO]    = { 1, 2 },
+};
+
+const char *opcode_name(u8 op)
+{
+	if (op >= sizeof(names) / sizeof(names[0]) || !names[op])
+		return "OP_UNKNOWN";
+
+	return names[op];
+}
+
+int operand_count(u8 op)
+{
+	return (widths[op][0] != 0) + (widths[op][1] != 0);
+}
+
+size_t operand_width(u8 op, int n)
+{
+	return widths[op][n];
+}
+
+size_t instruction_size(u8 op)
+{
+	return 1 + widths[op][0] + widths[op][1];
+}
+
+size_t instruction_size(u8 const *code)
+{
+	if (code[0] == OP_WIDE)
+		return 2 + WIDE_OPERAND_WIDTH * operand_count(code[1]);
+
+	return instruction_size(code[0]);
+}
+
+Opcode instruction_opcode(u8 const *code)
+{
+	return static_cast<Opcode>(code[0] == OP_WIDE ? code[1] : code[0]);
+}
+
+size_t read_operand(u8 const *code, int n)
+{
+	auto wide = code[0] == OP_WIDE;
+	auto op = instruction_opcode(code);
+	code += wide ? 2 : 1;
+
+	for (int i = 0; i < n; i++)
+		code += wide ? WIDE_OPERAND_WIDTH : widths[op][i];
+
+	size_t width = wide ? WIDE_OPERAND_WIDTH : widths[op][n];
+	size_t value = 0;
+	for (size_t i = 0; i < width; i++)
+		value = (value << 8) | code[i];
+
+	return value;
+}
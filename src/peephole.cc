@@ -0,0 +1,652 @@
+#include "peephole.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "opcode.h"
+
+// Works on a decoded copy of the code in which a jump names the instruction it
+// lands on rather than a byte offset, so instructions can be dropped or added
+// without fixing up offsets by hand. The passes run until none of them finds
+// anything left to do, then the code is encoded again with fresh offsets.
+class Peephole
+{
+public:
+	Peephole(Chunk &chunk) :
+		chunk(chunk)
+	{ }
+
+	size_t finish(bool, size_t &);
+
+private:
+	struct Instruction
+	{
+		Opcode op;
+		u32 operands[2];
+		int line;
+
+		// index of the instruction a jump lands on
+		size_t target;
+	};
+
+	Chunk &chunk;
+	std::vector<Instruction> code;
+
+	// from layout(): which instructions take the OP_WIDE prefix, and where each one starts
+	std::vector<bool> wide;
+	std::vector<size_t> offsets;
+
+	void decode();
+	bool layout();
+	void encode();
+
+	void optimize();
+	void tail_calls();
+	bool thread_jumps();
+	bool remove_unreachable();
+	bool combine();
+	std::vector<bool> jump_targets();
+	size_t max_stack();
+};
+
+static bool is_jump(Opcode op)
+{
+	switch (op)
+	{
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_JUMP_IF_FALSE:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_LESS:
+		case OP_JUMP_IF_GREATER:
+		case OP_JUMP_IF_EQUAL:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+static bool is_unconditional(Opcode op)
+{
+	return op == OP_JUMP || op == OP_LOOP;
+}
+
+// nothing after one of these runs unless something jumps to it
+static bool ends_path(Opcode op)
+{
+	return is_unconditional(op) || op == OP_RETURN;
+}
+
+// whether an operand of the instruction is too large for its usual width
+static bool needs_wide(Opcode op, u32 const *operands)
+{
+	for (int i = 0; i < operand_count(op); i++)
+	{
+		if (operands[i] >> (8 * operand_width(op, i)) != 0)
+			return true;
+	}
+
+	return false;
+}
+
+// how many values an instruction leaves on the stack in place of those it started with,
+// and how far above the height it started at the stack gets while it runs
+struct StackEffect
+{
+	int net;
+	int peak;
+};
+
+static StackEffect stack_effect(Opcode op, u32 const *operands)
+{
+	switch (op)
+	{
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_GLOBAL_SLOT:
+		case OP_GET_LOCAL:
+		case OP_CLASS:
+		case OP_ARRAY_CONSTANT:
+			return { 1, 1 };
+
+		case OP_RETURN:
+		case OP_NEGATE:
+		case OP_NOT:
+		case OP_PRINT:
+		case OP_SET_GLOBAL_SLOT:
+		case OP_SET_LOCAL:
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_GET_PROPERTY:
+		case OP_GET_PROPERTY_MONO:
+		case OP_WIDE:
+			return { 0, 0 };
+
+		case OP_ADD:
+		case OP_ADD_NUM:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_MOD:
+		case OP_EQUAL:
+		case OP_EQUAL_NUM:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_LOGICAL_AND:
+		case OP_LOGICAL_OR:
+		case OP_BITWISE_AND:
+		case OP_BITWISE_OR:
+		case OP_POP:
+		case OP_GET_SUBSCRIPT:
+		case OP_SET_PROPERTY:
+		case OP_SET_PROPERTY_MONO:
+		case OP_NOT_EQUAL:
+		case OP_GREATER_EQUAL:
+		case OP_LESS_EQUAL:
+		case OP_SET_GLOBAL_POP:
+		case OP_SET_LOCAL_POP:
+		case OP_POP_JUMP_IF_FALSE:
+			return { -1, 0 };
+
+		case OP_SET_SUBSCRIPT:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_NOT_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL_NUM:
+		case OP_JUMP_IF_LESS:
+		case OP_JUMP_IF_GREATER:
+		case OP_JUMP_IF_EQUAL:
+			return { -2, 0 };
+
+		// the constant is pushed for the add
+		case OP_ADD_CONSTANT:
+		case OP_ADD_CONSTANT_NUM:
+		case OP_SUBTRACT_CONSTANT:
+			return { 0, 1 };
+
+		// as are both locals
+		case OP_ADD_LOCALS:
+		case OP_ADD_LOCALS_NUM:
+		case OP_SUBTRACT_LOCALS:
+			return { 1, 2 };
+
+		// the result replaces the callee and its arguments
+		case OP_CALL:
+		case OP_TAIL_CALL:
+			return { -(int) operands[0], 0 };
+
+		// the callee is inserted under the arguments first
+		case OP_CALL_GLOBAL:
+		case OP_TAIL_CALL_GLOBAL:
+			return { 1 - (int) operands[1], 1 };
+
+		case OP_BUILD_ARRAY:
+			return { 1 - (int) operands[0], operands[0] == 0 };
+	}
+
+	return { 0, 0 };
+}
+
+// pushes a value and does nothing else
+static bool is_pure_push(Opcode op)
+{
+	switch (op)
+	{
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_CONSTANT:
+		case OP_ARRAY_CONSTANT:
+		case OP_GET_LOCAL:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+// returns how many bytes optimizing saved
+size_t Peephole::finish(bool optimize, size_t &stack)
+{
+	decode();
+	size_t saved = 0;
+
+	// worked out before optimizing, which never makes the stack deeper
+	stack = max_stack();
+
+	if (optimize)
+	{
+		// measured against the same code laid out without optimizing it
+		auto before = layout() ? offsets.back() : chunk.code.size();
+		this->optimize();
+
+		if (layout() && offsets.back() < before)
+			saved = before - offsets.back();
+	}
+
+	tail_calls();
+
+	// a jump too long to encode leaves the code the compiler emitted
+	if (!layout())
+		return 0;
+
+	encode();
+	return saved;
+}
+
+void Peephole::optimize()
+{
+	// every pass makes the code smaller or moves a jump forward, the limit only guards against jumps in a circle
+	bool changed = true;
+	for (int pass = 0; changed && pass < 32; pass++)
+	{
+		changed = thread_jumps();
+		changed = remove_unreachable() || changed;
+		changed = combine() || changed;
+	}
+}
+
+// turns calls whose result is returned straight away, or after unconditional jumps
+// such as the ones at the end of an if's branches, into tail calls.
+// the return stays behind them, for callees that aren't functions
+void Peephole::tail_calls()
+{
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		auto &instruction = code[i];
+		if (instruction.op != OP_CALL && instruction.op != OP_CALL_GLOBAL)
+			continue;
+
+		auto next = i + 1;
+		for (int hops = 0; hops < 16 && next < code.size() && is_unconditional(code[next].op); hops++)
+			next = code[next].target;
+
+		if (next < code.size() && code[next].op == OP_RETURN)
+			instruction.op = instruction.op == OP_CALL ? OP_TAIL_CALL : OP_TAIL_CALL_GLOBAL;
+	}
+}
+
+void Peephole::decode()
+{
+	std::vector<size_t> index_at(chunk.code.size() + 1);
+	size_t offset = 0;
+
+	// most instructions take two bytes
+	code.reserve(chunk.code.size() / 2);
+
+	// the line runs are walked alongside the code
+	auto &runs = chunk.lines.runs;
+	size_t run = 0;
+
+	while (offset < chunk.code.size())
+	{
+		while (run + 1 < runs.size() && runs[run + 1].start <= offset)
+			run += 1;
+
+		auto bytes = &chunk.code[offset];
+		auto op = instruction_opcode(bytes);
+		auto size = instruction_size(bytes);
+		Instruction instruction { op, {}, runs[run].line, 0 };
+
+		for (int i = 0; i < operand_count(op); i++)
+			instruction.operands[i] = read_operand(bytes, i);
+
+		// byte offset of the target for now, made an index below
+		if (is_jump(op))
+		{
+			auto jump = instruction.operands[0];
+			instruction.target = op == OP_LOOP ? offset + size - jump : offset + size + jump;
+		}
+
+		index_at[offset] = code.size();
+		code.push_back(instruction);
+		offset += size;
+	}
+
+	index_at[offset] = code.size();
+	for (auto &instruction : code)
+	{
+		if (is_jump(instruction.op))
+			instruction.target = index_at[instruction.target];
+	}
+}
+
+// works out whether each instruction needs OP_WIDE and where it starts.
+// returns false if a jump is too long to encode.
+// unconditional jumps get their direction from where they land,
+// since threading may have turned a forward jump into a backward one
+bool Peephole::layout()
+{
+	wide.assign(code.size(), false);
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		auto &instruction = code[i];
+		if (is_unconditional(instruction.op))
+			instruction.op = instruction.target > i ? OP_JUMP : OP_LOOP;
+
+		assert((!is_jump(instruction.op) || instruction.op == OP_LOOP || instruction.target > i) && "Conditional jumps only go forward");
+		wide[i] = !is_jump(instruction.op) && needs_wide(instruction.op, instruction.operands);
+	}
+
+	// jumps start out narrow, and any that doesn't fit is widened. that moves the
+	// code after it, so the layout is worked out again until every jump fits
+	offsets.assign(code.size() + 1, 0);
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			auto op = code[i].op;
+			offsets[i + 1] = offsets[i] + (wide[i] ? 2 + WIDE_OPERAND_WIDTH * operand_count(op) : instruction_size(op));
+		}
+
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			auto &instruction = code[i];
+			if (!is_jump(instruction.op))
+				continue;
+
+			auto target = offsets[instruction.target];
+			instruction.operands[0] = instruction.op == OP_LOOP ? offsets[i + 1] - target : target - offsets[i + 1];
+
+			if (instruction.operands[0] > WIDE_OPERAND_MAX)
+				return false;
+
+			if (!wide[i] && needs_wide(instruction.op, instruction.operands))
+			{
+				wide[i] = true;
+				changed = true;
+			}
+		}
+	}
+
+	return true;
+}
+
+// writes the code back as layout() laid it out
+void Peephole::encode()
+{
+	std::vector<u8> bytes;
+	LineTable lines;
+	bytes.reserve(offsets.back());
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		auto &instruction = code[i];
+		if (wide[i])
+			bytes.push_back(OP_WIDE);
+
+		bytes.push_back(instruction.op);
+		for (int j = 0; j < operand_count(instruction.op); j++)
+		{
+			auto width = wide[i] ? WIDE_OPERAND_WIDTH : operand_width(instruction.op, j);
+			for (auto shift = 8 * width; shift > 0; shift -= 8)
+				bytes.push_back((instruction.operands[j] >> (shift - 8)) & 0xff);
+		}
+
+		lines.add(instruction.line, bytes.size() - lines.size());
+	}
+
+	chunk.code = std::move(bytes);
+	chunk.lines = std::move(lines);
+}
+
+// points jumps that land on an unconditional jump at wherever that one goes,
+// and turns jumps that land on a return into the return
+bool Peephole::thread_jumps()
+{
+	bool changed = false;
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		auto &instruction = code[i];
+		if (!is_jump(instruction.op))
+			continue;
+
+		// the hop limit guards against jumps that only go round in a circle
+		auto target = instruction.target;
+		for (int hops = 0; hops < 16 && target < code.size() && is_unconditional(code[target].op); hops++)
+		{
+			// only unconditional jumps can go backwards
+			if (!is_unconditional(instruction.op) && code[target].target <= i)
+				break;
+
+			target = code[target].target;
+		}
+
+		if (target != instruction.target)
+		{
+			instruction.target = target;
+			changed = true;
+		}
+
+		if (is_unconditional(instruction.op) && target < code.size() && code[target].op == OP_RETURN)
+		{
+			instruction.op = OP_RETURN;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+bool Peephole::remove_unreachable()
+{
+	std::vector<bool> reached(code.size(), false);
+	std::vector<size_t> paths { 0 };
+
+	while (!paths.empty())
+	{
+		auto i = paths.back();
+		paths.pop_back();
+
+		for (; i < code.size() && !reached[i]; i++)
+		{
+			reached[i] = true;
+			if (is_jump(code[i].op))
+				paths.push_back(code[i].target);
+
+			if (ends_path(code[i].op))
+				break;
+		}
+	}
+
+	std::vector<size_t> new_index(code.size() + 1);
+	std::vector<Instruction> kept;
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		new_index[i] = kept.size();
+		if (reached[i])
+			kept.push_back(code[i]);
+	}
+
+	new_index[code.size()] = kept.size();
+	if (kept.size() == code.size())
+		return false;
+
+	for (auto &instruction : kept)
+	{
+		if (is_jump(instruction.op))
+			instruction.target = new_index[instruction.target];
+	}
+
+	code = std::move(kept);
+	return true;
+}
+
+// rewrites short sequences of instructions that don't straddle a jump target
+bool Peephole::combine()
+{
+	auto targets = jump_targets();
+	std::vector<size_t> new_index(code.size() + 1);
+	std::vector<Instruction> out;
+	bool changed = false;
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		new_index[i] = out.size();
+		auto instruction = code[i];
+		auto next = i + 1 < code.size() && !targets[i + 1] ? &code[i + 1] : nullptr;
+		auto landing = is_jump(instruction.op) && instruction.target < code.size() ? &code[instruction.target] : nullptr;
+
+		// a value that is popped as soon as it is pushed
+		if (next && is_pure_push(instruction.op) && next->op == OP_POP)
+		{
+			new_index[++i] = out.size();
+			changed = true;
+			continue;
+		}
+
+		// a jump to the instruction right after it
+		if (is_unconditional(instruction.op) && instruction.target == i + 1)
+		{
+			changed = true;
+			continue;
+		}
+
+		if (instruction.op == OP_POP_JUMP_IF_FALSE && instruction.target == i + 1)
+		{
+			out.push_back({ OP_POP, {}, instruction.line, 0 });
+			changed = true;
+			continue;
+		}
+
+		// a jump to a pop that a pushed value falls into, as the end of an if without an else does.
+		// popping before the jump instead lets that value and its pop cancel out
+		if (instruction.op == OP_JUMP && landing && landing->op == OP_POP
+			&& instruction.target > 0 && is_pure_push(code[instruction.target - 1].op))
+		{
+			out.push_back({ OP_POP, {}, instruction.line, 0 });
+			instruction.target += 1;
+			out.push_back(instruction);
+			changed = true;
+			continue;
+		}
+
+		// a condition that both paths pop is popped by the jump
+		if (instruction.op == OP_JUMP_IF_FALSE && next && next->op == OP_POP && landing && landing->op == OP_POP)
+		{
+			instruction.op = OP_POP_JUMP_IF_FALSE;
+			instruction.target += 1;
+			out.push_back(instruction);
+			new_index[++i] = out.size();
+			changed = true;
+			continue;
+		}
+
+		#ifndef NO_SUPERINSTRUCTIONS
+		// assignments whose value is thrown away, which jump targets kept the compiler from fusing
+		if (next && next->op == OP_POP && (instruction.op == OP_SET_LOCAL || instruction.op == OP_SET_GLOBAL_SLOT))
+		{
+			instruction.op = instruction.op == OP_SET_LOCAL ? OP_SET_LOCAL_POP : OP_SET_GLOBAL_POP;
+			out.push_back(instruction);
+			new_index[++i] = out.size();
+			changed = true;
+			continue;
+		}
+		#endif
+
+		// an assignment whose value is read straight back
+		if (next && instruction.op == OP_SET_LOCAL_POP && next->op == OP_GET_LOCAL
+			&& next->operands[0] == instruction.operands[0])
+		{
+			instruction.op = OP_SET_LOCAL;
+			out.push_back(instruction);
+			new_index[++i] = out.size();
+			changed = true;
+			continue;
+		}
+
+		if (next && instruction.op == OP_SET_GLOBAL_POP && next->op == OP_GET_GLOBAL_SLOT
+			&& next->operands[0] == instruction.operands[0])
+		{
+			instruction.op = OP_SET_GLOBAL_SLOT;
+			out.push_back(instruction);
+			new_index[++i] = out.size();
+			changed = true;
+			continue;
+		}
+
+		out.push_back(instruction);
+	}
+
+	new_index[code.size()] = out.size();
+	if (!changed)
+		return false;
+
+	for (auto &instruction : out)
+	{
+		if (is_jump(instruction.op))
+			instruction.target = new_index[instruction.target];
+	}
+
+	code = std::move(out);
+	return true;
+}
+
+// whether something jumps to each instruction, with one more entry for the end of the code
+std::vector<bool> Peephole::jump_targets()
+{
+	std::vector<bool> targets(code.size() + 1, false);
+	for (auto &instruction : code)
+	{
+		if (is_jump(instruction.op))
+			targets[instruction.target] = true;
+	}
+
+	return targets;
+}
+
+// the most values the code has on the stack at once, on top of those it starts with.
+// every path into an instruction reaches it at the same height, so each is visited once
+size_t Peephole::max_stack()
+{
+	if (code.empty())
+		return 0;
+
+	std::vector<int> height(code.size(), -1);
+	std::vector<size_t> pending { 0 };
+	height[0] = 0;
+	int max = 0;
+
+	while (!pending.empty())
+	{
+		auto i = pending.back();
+		pending.pop_back();
+
+		auto &instruction = code[i];
+		auto effect = stack_effect(instruction.op, instruction.operands);
+		auto after = height[i] + effect.net;
+		max = std::max({ max, height[i] + effect.peak, after });
+
+		auto reach = [&](size_t next) {
+			if (next < code.size() && height[next] < 0)
+			{
+				height[next] = after;
+				pending.push_back(next);
+			}
+		};
+
+		if (is_jump(instruction.op))
+			reach(instruction.target);
+
+		if (!ends_path(instruction.op))
+			reach(i + 1);
+	}
+
+	return max;
+}
+
+size_t finish_chunk(Chunk &chunk, bool optimize, size_t &max_stack)
+{
+	return Peephole(chunk).finish(optimize, max_stack);
+}
@@ -0,0 +1,100 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <string>
+
+#include "opcode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+static constexpr const char *TICKS = "cycles";
+#else
+static constexpr const char *TICKS = "ns";
+#endif
+
+void Profiler::stop()
+{
+	if (last)
+		last->ticks += ticks() - last_tick;
+
+	last = nullptr;
+	current_function = nullptr;
+}
+
+void Profiler::report(std::FILE *out)
+{
+	struct Total
+	{
+		u64 count = 0;
+		u64 ticks = 0;
+	};
+
+	// an instruction behind an OP_WIDE prefix counts towards its own opcode
+	Total opcodes[256] = {};
+	Total all;
+	std::vector<std::pair<Function *, Total>> functions;
+
+	for (auto &[function, counts] : samples)
+	{
+		Total total;
+		auto code = function->chunk.bytecode();
+		for (size_t offset = 0; offset < counts.size(); offset++)
+		{
+			auto &sample = counts[offset];
+			if (!sample.count)
+				continue;
+
+			auto &opcode = opcodes[instruction_opcode(code + offset)];
+			opcode.count += sample.count;
+			opcode.ticks += sample.ticks;
+			total.count += sample.count;
+			total.ticks += sample.ticks;
+		}
+
+		all.count += total.count;
+		all.ticks += total.ticks;
+		functions.push_back({ function, total });
+	}
+
+	auto percent = [&](u64 ticks) { return all.ticks ? 100.0 * ticks / all.ticks : 0.0; };
+
+	std::fprintf(out, "profile: %llu instructions, %llu %s\n\n", (unsigned long long) all.count, (unsigned long long) all.ticks, TICKS);
+	std::fprintf(out, "%-24s %12s %14s %7s %10s\n", "opcode", "count", TICKS, "%", "per op");
+
+	std::vector<int> order;
+	for (int op = 0; op < 256; op++)
+	{
+		if (opcodes[op].count)
+			order.push_back(op);
+	}
+
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return opcodes[a].ticks > opcodes[b].ticks; });
+	for (auto op : order)
+	{
+		auto &opcode = opcodes[op];
+		std::fprintf(out, "%-24s %12llu %14llu %6.2f%% %10.1f\n", opcode_name(op),
+			(unsigned long long) opcode.count, (unsigned long long) opcode.ticks,
+			percent(opcode.ticks), (double) opcode.ticks / opcode.count);
+	}
+
+	// the hottest function first, each instruction prefixed with its count and share of all the time
+	std::sort(functions.begin(), functions.end(), [](auto &a, auto &b) { return a.second.ticks > b.second.ticks; });
+	for (auto &[function, total] : functions)
+	{
+		auto name = function->name.empty() ? std::string("script") : function->name;
+		std::fprintf(out, "\n== %s == %.2f%%\n", name.c_str(), percent(total.ticks));
+
+		auto &counts = samples[function];
+		auto &chunk = function->chunk;
+		size_t offset = 0;
+		while (offset < chunk.size())
+		{
+			auto &sample = counts[offset];
+			if (sample.count)
+				std::fprintf(out, "%12llu %6.2f%%  ", (unsigned long long) sample.count, percent(sample.ticks));
+			else
+				std::fprintf(out, "%12s %7s  ", "", "");
+
+			offset = chunk.disassemble_instruction(offset, out);
+		}
+	}
+}
@@ -0,0 +1,76 @@
+#include "region.h"
+
+#include <algorithm>
+#include <cstdint>
+
+static u8 *align_up(u8 *p, size_t alignment)
+{
+	auto addr = reinterpret_cast<std::uintptr_t>(p);
+	return reinterpret_cast<u8 *>((addr + alignment - 1) & ~(alignment - 1));
+}
+
+Region::~Region()
+{
+	release();
+}
+
+void Region::reset()
+{
+	// oversized blocks were sized for one allocation, so they are unlikely to be reused
+	auto oversized = std::remove_if(chunks.begin(), chunks.end(), [](Block const &block) {
+		if (block.size == REGION_BLOCK_SIZE)
+			return false;
+
+		delete[] block.data;
+		return true;
+	});
+
+	chunks.erase(oversized, chunks.end());
+
+	current = 0;
+	top = chunks.empty() ? nullptr : chunks[0].data;
+	end = chunks.empty() ? nullptr : chunks[0].data + chunks[0].size;
+	allocated = 0;
+}
+
+void Region::release()
+{
+	for (auto &block : chunks)
+		delete[] block.data;
+
+	chunks.clear();
+	current = 0;
+	top = end = nullptr;
+	allocated = 0;
+}
+
+// moves on to a block with room for size bytes, reusing a kept block when one is big enough
+void Region::next_block(size_t size)
+{
+	if (top)
+		current += 1;
+
+	if (current >= chunks.size() || chunks[current].size < size)
+	{
+		auto block_size = std::max(size, REGION_BLOCK_SIZE);
+		auto block = Block { new u8[block_size], block_size };
+		chunks.insert(chunks.begin() + std::min(current, chunks.size()), block);
+	}
+
+	top = chunks[current].data;
+	end = top + chunks[current].size;
+}
+
+void *Region::do_allocate(size_t size, size_t alignment)
+{
+	auto p = align_up(top, alignment);
+	if (!top || p + size > end)
+	{
+		next_block(size + alignment);
+		p = align_up(top, alignment);
+	}
+
+	top = p + size;
+	allocated += size;
+	return p;
+}
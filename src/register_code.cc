@@ -0,0 +1,663 @@
+#include "register_code.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <span>
+
+#include "function.h"
+#include "opcode.h"
+#include "value.h"
+#include "vm.h"
+
+// Walks a function's stack bytecode keeping track of the operand that each
+// stack slot would hold. Stack slot n becomes register n, but reading a local
+// or a constant only records where the value lives, so the instruction that
+// consumes it can address it directly instead of copying it to the stack first.
+// Those pending operands are written out to their registers whenever the real
+// layout matters: at jumps and jump targets, for calls and array literals
+// which take their operands in consecutive registers, and before the local
+// they refer to is overwritten. Only the first 256 constants fit the c operand,
+// so any other constant is loaded into its register before it is used.
+class RegisterCompiler
+{
+public:
+	RegisterCompiler(Function &fn) :
+		fn(fn),
+		code(fn.chunk.bytecode(), fn.chunk.size()),
+		out(fn.registers)
+	{ }
+
+	bool compile();
+
+private:
+	Function &fn;
+	std::span<u8 const> code;
+	RegisterChunk &out;
+
+	// operand of every slot of the simulated stack, indexed by register.
+	// a register number, or CONSTANT plus the index of a constant
+	std::vector<u32> stack;
+	static constexpr u32 CONSTANT = 256;
+
+	// registers below this hold the callee and its parameters, and always hold their own value
+	size_t locals_end;
+
+	// stack depth on arrival at each jump target, -1 when unknown
+	std::vector<int> target_depth;
+
+	// index of the first register instruction emitted for each stack code offset
+	std::vector<int> instruction_at;
+
+	// jump instructions whose target is a stack code offset, resolved at the end
+	std::vector<std::pair<size_t, size_t>> fixups;
+
+	size_t offset = 0;
+	bool reachable = true;
+	bool overflow = false;
+
+	void emit(RegisterOpcode, u8 a = 0, u8 b = 0, u8 c = 0, u32 d = 0);
+	void emit_jump(RegisterOpcode, size_t, u8 b = 0, u8 c = 0);
+	RegisterOpcode constant_form(RegisterOpcode, u32 &);
+	void arrive(int);
+
+	u32 push(u32);
+	u8 push_register();
+	u32 pop();
+	u32 top() { return stack.back(); }
+	u8 in_register(size_t);
+	u8 pop_register();
+	void fit_operand();
+	void materialize(size_t);
+	void flush(size_t);
+	void protect(u32);
+
+	size_t operand(int n) { return read_operand(&code[offset], n); }
+	size_t jump_target(int sign) { return offset + instruction_size(&code[offset]) + sign * operand(0); }
+};
+
+// the register opcode doing the same as a stack opcode that has a direct counterpart
+static RegisterOpcode translate(Opcode op)
+{
+	switch (op)
+	{
+		case OP_ADD:                 return R_ADD;
+		case OP_SUBTRACT:            return R_SUBTRACT;
+		case OP_MULTIPLY:            return R_MULTIPLY;
+		case OP_DIVIDE:              return R_DIVIDE;
+		case OP_MOD:                 return R_MOD;
+		case OP_EQUAL:               return R_EQUAL;
+		case OP_NOT_EQUAL:           return R_NOT_EQUAL;
+		case OP_GREATER:             return R_GREATER;
+		case OP_LESS:                return R_LESS;
+		case OP_GREATER_EQUAL:       return R_GREATER_EQUAL;
+		case OP_LESS_EQUAL:          return R_LESS_EQUAL;
+		case OP_LOGICAL_AND:         return R_LOGICAL_AND;
+		case OP_LOGICAL_OR:          return R_LOGICAL_OR;
+		case OP_BITWISE_AND:         return R_BITWISE_AND;
+		case OP_BITWISE_OR:          return R_BITWISE_OR;
+		case OP_JUMP_IF_NOT_LESS:    return R_JUMP_IF_NOT_LESS;
+		case OP_JUMP_IF_NOT_GREATER: return R_JUMP_IF_NOT_GREATER;
+		case OP_JUMP_IF_NOT_EQUAL:   return R_JUMP_IF_NOT_EQUAL;
+		case OP_JUMP_IF_LESS:        return R_JUMP_IF_LESS;
+		case OP_JUMP_IF_GREATER:     return R_JUMP_IF_GREATER;
+		case OP_JUMP_IF_EQUAL:       return R_JUMP_IF_EQUAL;
+		default:
+			assert(!"Stack opcode has no register counterpart");
+			return R_MOVE;
+	}
+}
+
+bool RegisterCompiler::compile()
+{
+	out = RegisterChunk {};
+	locals_end = 1 + fn.num_params;
+	for (size_t i = 0; i < locals_end; i++)
+		push(i);
+
+	out.num_registers = locals_end;
+	target_depth.assign(code.size() + 1, -1);
+	instruction_at.assign(code.size() + 1, -1);
+
+	// backwards jumps land on offsets that are reached by falling through first, so only forward targets need finding
+	std::vector<bool> targets(code.size() + 1, false);
+	for (size_t i = 0; i < code.size(); i += instruction_size(&code[i]))
+	{
+		offset = i;
+		switch (instruction_opcode(&code[i]))
+		{
+			case OP_JUMP:
+			case OP_JUMP_IF_FALSE:
+			case OP_POP_JUMP_IF_FALSE:
+			case OP_JUMP_IF_NOT_LESS:
+			case OP_JUMP_IF_NOT_GREATER:
+			case OP_JUMP_IF_NOT_EQUAL:
+			case OP_JUMP_IF_LESS:
+			case OP_JUMP_IF_GREATER:
+			case OP_JUMP_IF_EQUAL:
+				targets[jump_target(1)] = true;
+				break;
+
+			case OP_LOOP:
+				targets[jump_target(-1)] = true;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	for (offset = 0; offset < code.size(); offset += instruction_size(&code[offset]))
+	{
+		if (targets[offset])
+			arrive(target_depth[offset]);
+
+		// code after a return or an unconditional jump that nothing jumps to never runs
+		if (!reachable)
+			continue;
+
+		instruction_at[offset] = out.code.size();
+		auto op = instruction_opcode(&code[offset]);
+
+		switch (op)
+		{
+			case OP_CONSTANT:
+				push(CONSTANT + operand(0));
+				break;
+
+			case OP_GET_LOCAL:
+				push(operand(0));
+				break;
+
+			case OP_NIL:
+				emit(R_NIL, push_register());
+				break;
+
+			case OP_TRUE:
+				emit(R_TRUE, push_register());
+				break;
+
+			case OP_FALSE:
+				emit(R_FALSE, push_register());
+				break;
+
+			case OP_SET_LOCAL:
+			case OP_SET_LOCAL_POP:
+			{
+				auto slot = operand(0);
+				protect(slot);
+
+				if (top() >= CONSTANT)
+					emit(R_LOAD_CONSTANT, slot, 0, 0, top() - CONSTANT);
+				else if (top() != slot)
+					emit(R_MOVE, slot, top());
+
+				if (op == OP_SET_LOCAL_POP)
+					pop();
+
+				break;
+			}
+
+			case OP_GET_GLOBAL_SLOT:
+			{
+				auto a = push_register();
+				emit(R_GET_GLOBAL, a, 0, 0, operand(0));
+				break;
+			}
+
+			case OP_SET_GLOBAL_SLOT:
+			case OP_SET_GLOBAL_POP:
+			{
+				fit_operand();
+				auto b = op == OP_SET_GLOBAL_POP ? pop() : top();
+				auto set = b >= CONSTANT ? R_SET_GLOBAL_CONSTANT : R_SET_GLOBAL;
+				emit(set, 0, b >= CONSTANT ? b - CONSTANT : b, 0, operand(0));
+				break;
+			}
+
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_MOD:
+			case OP_EQUAL:
+			case OP_NOT_EQUAL:
+			case OP_GREATER:
+			case OP_LESS:
+			case OP_GREATER_EQUAL:
+			case OP_LESS_EQUAL:
+			{
+				auto b = in_register(stack.size() - 2);
+				fit_operand();
+				auto c = pop();
+				pop();
+				auto r = constant_form(translate(op), c);
+				emit(r, push_register(), b, c);
+				break;
+			}
+
+			case OP_LOGICAL_AND:
+			case OP_LOGICAL_OR:
+			case OP_BITWISE_AND:
+			case OP_BITWISE_OR:
+			{
+				auto b = in_register(stack.size() - 2);
+				auto c = pop_register();
+				pop();
+				emit(translate(op), push_register(), b, c);
+				break;
+			}
+
+			case OP_ADD_CONSTANT:
+			case OP_SUBTRACT_CONSTANT:
+			{
+				auto b = pop_register();
+				emit(op == OP_ADD_CONSTANT ? R_ADD_CONSTANT : R_SUBTRACT_CONSTANT, push_register(), b, operand(0));
+				break;
+			}
+
+			case OP_ADD_LOCALS:
+			case OP_SUBTRACT_LOCALS:
+				emit(op == OP_ADD_LOCALS ? R_ADD : R_SUBTRACT, push_register(), operand(0), operand(1));
+				break;
+
+			case OP_NEGATE:
+			case OP_NOT:
+			{
+				auto b = pop_register();
+				emit(op == OP_NEGATE ? R_NEGATE : R_NOT, push_register(), b);
+				break;
+			}
+
+			case OP_PRINT:
+				emit(R_PRINT, 0, in_register(stack.size() - 1));
+				break;
+
+			case OP_POP:
+				pop();
+				break;
+
+			case OP_JUMP:
+				flush(0);
+				emit_jump(R_JUMP, jump_target(1));
+				reachable = false;
+				break;
+
+			case OP_LOOP:
+				flush(0);
+				emit_jump(R_LOOP, jump_target(-1));
+				reachable = false;
+				break;
+
+			// the condition stays on the stack for both paths
+			case OP_JUMP_IF_FALSE:
+				flush(0);
+				emit_jump(R_JUMP_IF_FALSE, jump_target(1), top());
+				break;
+
+			case OP_POP_JUMP_IF_FALSE:
+			{
+				auto b = pop_register();
+				flush(0);
+				emit_jump(R_JUMP_IF_FALSE, jump_target(1), b);
+				break;
+			}
+
+			case OP_JUMP_IF_NOT_LESS:
+			case OP_JUMP_IF_NOT_GREATER:
+			case OP_JUMP_IF_NOT_EQUAL:
+			case OP_JUMP_IF_LESS:
+			case OP_JUMP_IF_GREATER:
+			case OP_JUMP_IF_EQUAL:
+			{
+				auto b = in_register(stack.size() - 2);
+				fit_operand();
+				auto c = pop();
+				pop();
+				flush(0);
+				auto r = constant_form(translate(op), c);
+				emit_jump(r, jump_target(1), b, c);
+				break;
+			}
+
+			case OP_CALL:
+			case OP_TAIL_CALL:
+			{
+				auto num_args = operand(0);
+				auto callee = stack.size() - num_args - 1;
+				flush(callee);
+				emit(op == OP_CALL ? R_CALL : R_TAIL_CALL, callee, num_args);
+
+				stack.resize(callee);
+				push_register();
+				break;
+			}
+
+			case OP_CALL_GLOBAL:
+			case OP_TAIL_CALL_GLOBAL:
+			{
+				// the vm moves the arguments up a slot to make room for the callee
+				auto num_args = operand(1);
+				auto first = stack.size() - num_args;
+				flush(first);
+				emit(op == OP_CALL_GLOBAL ? R_CALL_GLOBAL : R_TAIL_CALL_GLOBAL, first, num_args, 0, operand(0));
+
+				push_register();
+				stack.resize(first);
+				push_register();
+				break;
+			}
+
+			case OP_RETURN:
+				emit(R_RETURN, 0, pop_register());
+				reachable = false;
+				break;
+
+			case OP_BUILD_ARRAY:
+			{
+				auto num_elements = operand(0);
+				auto first = stack.size() - num_elements;
+				flush(first);
+
+				stack.resize(first);
+				emit(R_BUILD_ARRAY, push_register(), num_elements);
+				break;
+			}
+
+			case OP_GET_SUBSCRIPT:
+			{
+				auto b = in_register(stack.size() - 2);
+				auto c = pop_register();
+				pop();
+				emit(R_GET_SUBSCRIPT, push_register(), b, c);
+				break;
+			}
+
+			case OP_SET_SUBSCRIPT:
+			{
+				auto b = in_register(stack.size() - 3);
+				auto c = in_register(stack.size() - 2);
+				auto d = pop_register();
+				pop();
+				pop();
+				emit(R_SET_SUBSCRIPT, push_register(), b, c, d);
+				break;
+			}
+
+			case OP_CLASS:
+				emit(R_CLASS, push_register(), 0, 0, operand(0));
+				break;
+
+			case OP_ARRAY_CONSTANT:
+				emit(R_ARRAY_CONSTANT, push_register(), 0, 0, operand(0));
+				break;
+
+			// the property name has to fit in c
+			case OP_GET_PROPERTY:
+			{
+				if (operand(0) > 0xff)
+					overflow = true;
+
+				auto b = pop_register();
+				emit(R_GET_PROPERTY, push_register(), b, operand(0), operand(1));
+				break;
+			}
+
+			case OP_SET_PROPERTY:
+			{
+				if (operand(0) > 0xff)
+					overflow = true;
+
+				auto instance = stack.size() - 2;
+				flush(instance);
+				emit(R_SET_PROPERTY, instance, 0, operand(0), operand(1));
+
+				stack.resize(instance);
+				push_register();
+				break;
+			}
+
+			// instruction_opcode reads through the prefix, and the quickened forms only
+			// ever appear once the stack tier has run the code, which is after this
+			case OP_WIDE:
+			case OP_ADD_NUM:
+			case OP_ADD_CONSTANT_NUM:
+			case OP_ADD_LOCALS_NUM:
+			case OP_EQUAL_NUM:
+			case OP_JUMP_IF_NOT_EQUAL_NUM:
+			case OP_GET_PROPERTY_MONO:
+			case OP_SET_PROPERTY_MONO:
+				assert(!"Not an opcode the compiler emits");
+				break;
+		}
+
+		if (overflow)
+			break;
+	}
+
+	// an offset past the end is where jumps over the last instructions land
+	instruction_at[code.size()] = out.code.size();
+
+	for (auto [index, target] : fixups)
+		out.code[index].d = instruction_at[target];
+
+	if (overflow)
+	{
+		out = RegisterChunk {};
+		return false;
+	}
+
+	return true;
+}
+
+void RegisterCompiler::emit(RegisterOpcode op, u8 a, u8 b, u8 c, u32 d)
+{
+	out.code.push_back({ op, a, b, c, d });
+	out.lines.push_back(fn.chunk.line(offset));
+}
+
+void RegisterCompiler::emit_jump(RegisterOpcode op, size_t target, u8 b, u8 c)
+{
+	// every path into a target must agree on how deep the stack is
+	if (target_depth[target] == -1)
+		target_depth[target] = stack.size();
+
+	fixups.push_back({ out.code.size(), target });
+	emit(op, 0, b, c);
+}
+
+// picks the form of op whose right operand c is a constant when c is one,
+// turning c into the constant's index. those forms come right after the register ones
+RegisterOpcode RegisterCompiler::constant_form(RegisterOpcode op, u32 &c)
+{
+	if (c < CONSTANT)
+		return op;
+
+	c -= CONSTANT;
+	return static_cast<RegisterOpcode>(op + 1);
+}
+
+// starts a jump target. whatever falls through into it writes out its pending operands first,
+// since the paths that jump there have done the same
+void RegisterCompiler::arrive(int depth)
+{
+	if (reachable)
+	{
+		flush(0);
+		if (target_depth[offset] == -1)
+			target_depth[offset] = stack.size();
+	}
+
+	else if (depth != -1)
+	{
+		stack.resize(depth);
+		for (size_t i = locals_end; i < stack.size(); i++)
+			stack[i] = i;
+
+		reachable = true;
+	}
+}
+
+u32 RegisterCompiler::push(u32 operand)
+{
+	stack.push_back(operand);
+	if (stack.size() > 256)
+		overflow = true;
+
+	if ((int) stack.size() > out.num_registers)
+		out.num_registers = stack.size();
+
+	return operand;
+}
+
+// pushes a slot that an instruction is about to write to
+u8 RegisterCompiler::push_register()
+{
+	return push(stack.size());
+}
+
+u32 RegisterCompiler::pop()
+{
+	auto operand = stack.back();
+	stack.pop_back();
+	return operand;
+}
+
+// the register holding a slot's value, loading it first if it is a constant
+u8 RegisterCompiler::in_register(size_t slot)
+{
+	if (stack[slot] >= CONSTANT)
+		materialize(slot);
+
+	return stack[slot];
+}
+
+u8 RegisterCompiler::pop_register()
+{
+	auto r = in_register(stack.size() - 1);
+	pop();
+	return r;
+}
+
+// loads the top slot into its register if it is a constant that doesn't fit an instruction's c operand
+void RegisterCompiler::fit_operand()
+{
+	if (top() > CONSTANT + 0xff)
+		materialize(stack.size() - 1);
+}
+
+void RegisterCompiler::materialize(size_t slot)
+{
+	if (stack[slot] == slot)
+		return;
+
+	if (stack[slot] >= CONSTANT)
+		emit(R_LOAD_CONSTANT, slot, 0, 0, stack[slot] - CONSTANT);
+	else
+		emit(R_MOVE, slot, stack[slot]);
+
+	stack[slot] = slot;
+}
+
+// writes out every pending operand from slot up
+void RegisterCompiler::flush(size_t slot)
+{
+	for (auto i = std::max(slot, locals_end); i < stack.size(); i++)
+		materialize(i);
+}
+
+// copies the old value of a local out to any slot still reading it, before the local is assigned.
+// the value being assigned is on top and ends up in the local anyway
+void RegisterCompiler::protect(u32 local)
+{
+	for (auto i = locals_end; i + 1 < stack.size(); i++)
+	{
+		if (stack[i] == local)
+			materialize(i);
+	}
+}
+
+bool compile_registers(Function &fn)
+{
+	return RegisterCompiler(fn).compile();
+}
+
+void RegisterChunk::disassemble(const char *name) const
+{
+	static const char *names[] = {
+		[R_MOVE]                          = "R_MOVE",
+		[R_LOAD_CONSTANT]                 = "R_LOAD_CONSTANT",
+		[R_NIL]                           = "R_NIL",
+		[R_TRUE]                          = "R_TRUE",
+		[R_FALSE]                         = "R_FALSE",
+		[R_GET_GLOBAL]                    = "R_GET_GLOBAL",
+		[R_SET_GLOBAL]                    = "R_SET_GLOBAL",
+		[R_SET_GLOBAL_CONSTANT]           = "R_SET_GLOBAL_CONSTANT",
+		[R_ADD]                           = "R_ADD",
+		[R_ADD_CONSTANT]                  = "R_ADD_CONSTANT",
+		[R_SUBTRACT]                      = "R_SUBTRACT",
+		[R_SUBTRACT_CONSTANT]             = "R_SUBTRACT_CONSTANT",
+		[R_MULTIPLY]                      = "R_MULTIPLY",
+		[R_MULTIPLY_CONSTANT]             = "R_MULTIPLY_CONSTANT",
+		[R_DIVIDE]                        = "R_DIVIDE",
+		[R_DIVIDE_CONSTANT]               = "R_DIVIDE_CONSTANT",
+		[R_MOD]                           = "R_MOD",
+		[R_MOD_CONSTANT]                  = "R_MOD_CONSTANT",
+		[R_EQUAL]                         = "R_EQUAL",
+		[R_EQUAL_CONSTANT]                = "R_EQUAL_CONSTANT",
+		[R_NOT_EQUAL]                     = "R_NOT_EQUAL",
+		[R_NOT_EQUAL_CONSTANT]            = "R_NOT_EQUAL_CONSTANT",
+		[R_GREATER]                       = "R_GREATER",
+		[R_GREATER_CONSTANT]              = "R_GREATER_CONSTANT",
+		[R_LESS]                          = "R_LESS",
+		[R_LESS_CONSTANT]                 = "R_LESS_CONSTANT",
+		[R_GREATER_EQUAL]                 = "R_GREATER_EQUAL",
+		[R_GREATER_EQUAL_CONSTANT]        = "R_GREATER_EQUAL_CONSTANT",
+		[R_LESS_EQUAL]                    = "R_LESS_EQUAL",
+		[R_LESS_EQUAL_CONSTANT]           = "R_LESS_EQUAL_CONSTANT",
+		[R_LOGICAL_AND]                   = "R_LOGICAL_AND",
+		[R_LOGICAL_OR]                    = "R_LOGICAL_OR",
+		[R_BITWISE_AND]                   = "R_BITWISE_AND",
+		[R_BITWISE_OR]                    = "R_BITWISE_OR",
+		[R_NEGATE]                        = "R_NEGATE",
+		[R_NOT]                           = "R_NOT",
+		[R_PRINT]                         = "R_PRINT",
+		[R_JUMP]                          = "R_JUMP",
+		[R_LOOP]                          = "R_LOOP",
+		[R_JUMP_IF_FALSE]                 = "R_JUMP_IF_FALSE",
+		[R_JUMP_IF_NOT_LESS]              = "R_JUMP_IF_NOT_LESS",
+		[R_JUMP_IF_NOT_LESS_CONSTANT]     = "R_JUMP_IF_NOT_LESS_CONSTANT",
+		[R_JUMP_IF_NOT_GREATER]           = "R_JUMP_IF_NOT_GREATER",
+		[R_JUMP_IF_NOT_GREATER_CONSTANT]  = "R_JUMP_IF_NOT_GREATER_CONSTANT",
+		[R_JUMP_IF_NOT_EQUAL]             = "R_JUMP_IF_NOT_EQUAL",
+		[R_JUMP_IF_NOT_EQUAL_CONSTANT]    = "R_JUMP_IF_NOT_EQUAL_CONSTANT",
+		[R_JUMP_IF_LESS]                  = "R_JUMP_IF_LESS",
+		[R_JUMP_IF_LESS_CONSTANT]         = "R_JUMP_IF_LESS_CONSTANT",
+		[R_JUMP_IF_GREATER]               = "R_JUMP_IF_GREATER",
+		[R_JUMP_IF_GREATER_CONSTANT]      = "R_JUMP_IF_GREATER_CONSTANT",
+		[R_JUMP_IF_EQUAL]                 = "R_JUMP_IF_EQUAL",
+		[R_JUMP_IF_EQUAL_CONSTANT]        = "R_JUMP_IF_EQUAL_CONSTANT",
+		[R_CALL]                          = "R_CALL",
+		[R_CALL_GLOBAL]                   = "R_CALL_GLOBAL",
+		[R_RETURN]                        = "R_RETURN",
+		[R_BUILD_ARRAY]                   = "R_BUILD_ARRAY",
+		[R_GET_SUBSCRIPT]                 = "R_GET_SUBSCRIPT",
+		[R_SET_SUBSCRIPT]                 = "R_SET_SUBSCRIPT",
+		[R_CLASS]                         = "R_CLASS",
+		[R_GET_PROPERTY]                  = "R_GET_PROPERTY",
+		[R_SET_PROPERTY]                  = "R_SET_PROPERTY",
+		[R_ARRAY_CONSTANT]                = "R_ARRAY_CONSTANT",
+		[R_TAIL_CALL]                     = "R_TAIL_CALL",
+		[R_TAIL_CALL_GLOBAL]              = "R_TAIL_CALL_GLOBAL",
+	};
+
+	std::printf("== %s (registers: %d) ==\n", name, num_registers);
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		auto &instruction = code[i];
+		std::printf("%04zu %4d %-30s %3d %3d %3d %4u\n", i, lines[i], names[instruction.op],
+			instruction.a, instruction.b, instruction.c, instruction.d);
+	}
+
+	std::printf("\n");
+}
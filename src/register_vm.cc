@@ -0,0 +1,694 @@
+#include "vm.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+#include "array.h"
+#include "heap.h"
+#include "klass.h"
+
+// The register tier's interpreter loop. It shares the vm's stack, frames and
+// globals with the stack tier, but instructions address frame slots directly.
+// stack_top doesn't follow the values in use here. It marks the highest slot any
+// frame has used this run, so the collector scans every slot that may still hold
+// an object, and slots that are reused never hold a pointer to a freed object.
+// A function too large for the tier has no register code, and runs on the stack
+// tier when it is called, see call_stack_tier.
+Value Vm::run_registers(Function *f)
+{
+	assert(f->registers.num_registers > 0);
+
+	auto first = stack_top;
+	frame = &frames[frame_count++];
+	*frame = CallFrame { f, nullptr, first, f->registers.code.data() };
+	cover_registers(first + f->registers.num_registers);
+	first[0] = f;
+
+	RegisterInstruction *code;
+	RegisterInstruction *pc;
+	RegisterInstruction instruction;
+	Value *constants;
+	Value *base;
+	Value *global_values = globals.values.data();
+
+	#define LOAD_FRAME() \
+		do { \
+			code = frame->function->registers.code.data(); \
+			pc = frame->pc; \
+			constants = frame->function->chunk.constants.data(); \
+			base = frame->base; \
+		} while (0)
+
+	#define SAVE_FRAME() (frame->pc = pc)
+
+	#define SAFEPOINT() \
+		do { \
+			if (heap.wants_collection()) \
+				collect_garbage(); \
+		} while (0)
+
+	#define A (instruction.a)
+	#define RB (base[instruction.b])
+	#define RC (base[instruction.c])
+	#define KB (constants[instruction.b])
+	#define KC (constants[instruction.c])
+	#define KD (constants[instruction.d])
+
+	#define RUNTIME_ERROR(msg) \
+		do { \
+			SAVE_FRAME(); \
+			runtime_error(msg); \
+			exit(1); \
+		} while (0)
+
+	#define BINARY_OP(type, op, right) \
+		do { \
+			auto b = RB; \
+			auto c = right; \
+			if (!b.is_number() || !c.is_number()) \
+				RUNTIME_ERROR("Operands must be numbers"); \
+			base[A] = type(b.as_number() op c.as_number()); \
+		} while (0)
+
+	#define INTEGER_OP(type, op, right) \
+		do { \
+			auto b = RB; \
+			auto c = right; \
+			if (!b.is_number() || !c.is_number()) \
+				RUNTIME_ERROR("Operands must be numbers"); \
+			base[A] = type((int) b.as_number() op (int) c.as_number()); \
+		} while (0)
+
+	#define BRANCH_OP(op, expected, right) \
+		do { \
+			auto b = RB; \
+			auto c = right; \
+			if (!b.is_number() || !c.is_number()) \
+				RUNTIME_ERROR("Operands must be numbers"); \
+			if ((b.as_number() op c.as_number()) != expected) \
+				JUMP(); \
+		} while (0)
+
+	#define BRANCH_EQUAL(expected, right) \
+		do { \
+			if ((RB == right) != expected) \
+				JUMP(); \
+		} while (0)
+
+	#define JUMP() (pc = code + instruction.d)
+
+	// the arguments of a call of global d start at a, so they are moved up a slot to make room for the callee
+	#define INSERT_GLOBAL_CALLEE() \
+		do { \
+			auto callable = global_values[instruction.d]; \
+			if (callable.is_undefined()) \
+				RUNTIME_ERROR("Undefined variable '" + globals.names[instruction.d]->str + "'"); \
+			auto callee = base + A; \
+			std::copy_backward(callee, callee + instruction.b, callee + instruction.b + 1); \
+			*callee = callable; \
+		} while (0)
+
+	#ifdef COMPUTED_GOTO
+	static void *dispatch_table[] = {
+		[R_MOVE]                          = &&do_R_MOVE,
+		[R_LOAD_CONSTANT]                 = &&do_R_LOAD_CONSTANT,
+		[R_NIL]                           = &&do_R_NIL,
+		[R_TRUE]                          = &&do_R_TRUE,
+		[R_FALSE]                         = &&do_R_FALSE,
+		[R_GET_GLOBAL]                    = &&do_R_GET_GLOBAL,
+		[R_SET_GLOBAL]                    = &&do_R_SET_GLOBAL,
+		[R_SET_GLOBAL_CONSTANT]           = &&do_R_SET_GLOBAL_CONSTANT,
+		[R_ADD]                           = &&do_R_ADD,
+		[R_ADD_CONSTANT]                  = &&do_R_ADD_CONSTANT,
+		[R_SUBTRACT]                      = &&do_R_SUBTRACT,
+		[R_SUBTRACT_CONSTANT]             = &&do_R_SUBTRACT_CONSTANT,
+		[R_MULTIPLY]                      = &&do_R_MULTIPLY,
+		[R_MULTIPLY_CONSTANT]             = &&do_R_MULTIPLY_CONSTANT,
+		[R_DIVIDE]                        = &&do_R_DIVIDE,
+		[R_DIVIDE_CONSTANT]               = &&do_R_DIVIDE_CONSTANT,
+		[R_MOD]                           = &&do_R_MOD,
+		[R_MOD_CONSTANT]                  = &&do_R_MOD_CONSTANT,
+		[R_EQUAL]                         = &&do_R_EQUAL,
+		[R_EQUAL_CONSTANT]                = &&do_R_EQUAL_CONSTANT,
+		[R_NOT_EQUAL]                     = &&do_R_NOT_EQUAL,
+		[R_NOT_EQUAL_CONSTANT]            = &&do_R_NOT_EQUAL_CONSTANT,
+		[R_GREATER]                       = &&do_R_GREATER,
+		[R_GREATER_CONSTANT]              = &&do_R_GREATER_CONSTANT,
+		[R_LESS]                          = &&do_R_LESS,
+		[R_LESS_CONSTANT]                 = &&do_R_LESS_CONSTANT,
+		[R_GREATER_EQUAL]                 = &&do_R_GREATER_EQUAL,
+		[R_GREATER_EQUAL_CONSTANT]        = &&do_R_GREATER_EQUAL_CONSTANT,
+		[R_LESS_EQUAL]                    = &&do_R_LESS_EQUAL,
+		[R_LESS_EQUAL_CONSTANT]           = &&do_R_LESS_EQUAL_CONSTANT,
+		[R_LOGICAL_AND]                   = &&do_R_LOGICAL_AND,
+		[R_LOGICAL_OR]                    = &&do_R_LOGICAL_OR,
+		[R_BITWISE_AND]                   = &&do_R_BITWISE_AND,
+		[R_BITWISE_OR]                    = &&do_R_BITWISE_OR,
+		[R_NEGATE]                        = &&do_R_NEGATE,
+		[R_NOT]                           = &&do_R_NOT,
+		[R_PRINT]                         = &&do_R_PRINT,
+		[R_JUMP]                          = &&do_R_JUMP,
+		[R_LOOP]                          = &&do_R_LOOP,
+		[R_JUMP_IF_FALSE]                 = &&do_R_JUMP_IF_FALSE,
+		[R_JUMP_IF_NOT_LESS]              = &&do_R_JUMP_IF_NOT_LESS,
+		[R_JUMP_IF_NOT_LESS_CONSTANT]     = &&do_R_JUMP_IF_NOT_LESS_CONSTANT,
+		[R_JUMP_IF_NOT_GREATER]           = &&do_R_JUMP_IF_NOT_GREATER,
+		[R_JUMP_IF_NOT_GREATER_CONSTANT]  = &&do_R_JUMP_IF_NOT_GREATER_CONSTANT,
+		[R_JUMP_IF_NOT_EQUAL]             = &&do_R_JUMP_IF_NOT_EQUAL,
+		[R_JUMP_IF_NOT_EQUAL_CONSTANT]    = &&do_R_JUMP_IF_NOT_EQUAL_CONSTANT,
+		[R_JUMP_IF_LESS]                  = &&do_R_JUMP_IF_LESS,
+		[R_JUMP_IF_LESS_CONSTANT]         = &&do_R_JUMP_IF_LESS_CONSTANT,
+		[R_JUMP_IF_GREATER]               = &&do_R_JUMP_IF_GREATER,
+		[R_JUMP_IF_GREATER_CONSTANT]      = &&do_R_JUMP_IF_GREATER_CONSTANT,
+		[R_JUMP_IF_EQUAL]                 = &&do_R_JUMP_IF_EQUAL,
+		[R_JUMP_IF_EQUAL_CONSTANT]        = &&do_R_JUMP_IF_EQUAL_CONSTANT,
+		[R_CALL]                          = &&do_R_CALL,
+		[R_CALL_GLOBAL]                   = &&do_R_CALL_GLOBAL,
+		[R_RETURN]                        = &&do_R_RETURN,
+		[R_BUILD_ARRAY]                   = &&do_R_BUILD_ARRAY,
+		[R_GET_SUBSCRIPT]                 = &&do_R_GET_SUBSCRIPT,
+		[R_SET_SUBSCRIPT]                 = &&do_R_SET_SUBSCRIPT,
+		[R_CLASS]                         = &&do_R_CLASS,
+		[R_GET_PROPERTY]                  = &&do_R_GET_PROPERTY,
+		[R_SET_PROPERTY]                  = &&do_R_SET_PROPERTY,
+		[R_ARRAY_CONSTANT]                = &&do_R_ARRAY_CONSTANT,
+		[R_TAIL_CALL]                     = &&do_R_TAIL_CALL,
+		[R_TAIL_CALL_GLOBAL]              = &&do_R_TAIL_CALL_GLOBAL,
+	};
+
+	// as in the stack tier, nothing that needs destroying may be alive across a DISPATCH()
+	#define DISPATCH() \
+		do { \
+			instruction = *pc++; \
+			goto *dispatch_table[instruction.op]; \
+		} while (0)
+
+	#define TARGET(op) do_##op
+	#else
+	#define DISPATCH() continue
+	#define TARGET(op) case op
+	#endif
+
+	LOAD_FRAME();
+
+	#ifdef COMPUTED_GOTO
+	DISPATCH();
+	#else
+	while (1)
+	{
+		instruction = *pc++;
+		switch (instruction.op)
+		{
+	#endif
+			TARGET(R_MOVE):
+				base[A] = RB;
+				DISPATCH();
+
+			TARGET(R_LOAD_CONSTANT):
+				base[A] = KD;
+				DISPATCH();
+
+			TARGET(R_NIL):
+				base[A] = nullptr;
+				DISPATCH();
+
+			TARGET(R_TRUE):
+				base[A] = true;
+				DISPATCH();
+
+			TARGET(R_FALSE):
+				base[A] = false;
+				DISPATCH();
+
+			TARGET(R_GET_GLOBAL):
+			{
+				auto value = global_values[instruction.d];
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable '" + globals.names[instruction.d]->str + "'");
+
+				base[A] = value;
+				DISPATCH();
+			}
+
+			TARGET(R_SET_GLOBAL):
+				global_values[instruction.d] = RB;
+				DISPATCH();
+
+			TARGET(R_SET_GLOBAL_CONSTANT):
+				global_values[instruction.d] = KB;
+				DISPATCH();
+
+			TARGET(R_ADD):
+			{
+				if (RB.is_string() && RC.is_string())
+					base[A] = intern(RB.as_string()->str + RC.as_string()->str);
+				else
+					BINARY_OP(Value, +, RC);
+
+				DISPATCH();
+			}
+
+			TARGET(R_ADD_CONSTANT):
+			{
+				if (RB.is_string() && KC.is_string())
+					base[A] = intern(RB.as_string()->str + KC.as_string()->str);
+				else
+					BINARY_OP(Value, +, KC);
+
+				DISPATCH();
+			}
+
+			TARGET(R_SUBTRACT):
+				BINARY_OP(Value, -, RC);
+				DISPATCH();
+
+			TARGET(R_SUBTRACT_CONSTANT):
+				BINARY_OP(Value, -, KC);
+				DISPATCH();
+
+			TARGET(R_MULTIPLY):
+				BINARY_OP(Value, *, RC);
+				DISPATCH();
+
+			TARGET(R_MULTIPLY_CONSTANT):
+				BINARY_OP(Value, *, KC);
+				DISPATCH();
+
+			TARGET(R_DIVIDE):
+				BINARY_OP(Value, /, RC);
+				DISPATCH();
+
+			TARGET(R_DIVIDE_CONSTANT):
+				BINARY_OP(Value, /, KC);
+				DISPATCH();
+
+			TARGET(R_MOD):
+				INTEGER_OP(double, %, RC);
+				DISPATCH();
+
+			TARGET(R_MOD_CONSTANT):
+				INTEGER_OP(double, %, KC);
+				DISPATCH();
+
+			TARGET(R_EQUAL):
+				base[A] = RB == RC;
+				DISPATCH();
+
+			TARGET(R_EQUAL_CONSTANT):
+				base[A] = RB == KC;
+				DISPATCH();
+
+			TARGET(R_NOT_EQUAL):
+				base[A] = !(RB == RC);
+				DISPATCH();
+
+			TARGET(R_NOT_EQUAL_CONSTANT):
+				base[A] = !(RB == KC);
+				DISPATCH();
+
+			TARGET(R_GREATER):
+				BINARY_OP(bool, >, RC);
+				DISPATCH();
+
+			TARGET(R_GREATER_CONSTANT):
+				BINARY_OP(bool, >, KC);
+				DISPATCH();
+
+			TARGET(R_LESS):
+				BINARY_OP(bool, <, RC);
+				DISPATCH();
+
+			TARGET(R_LESS_CONSTANT):
+				BINARY_OP(bool, <, KC);
+				DISPATCH();
+
+			TARGET(R_GREATER_EQUAL):
+				BINARY_OP(!bool, <, RC);
+				DISPATCH();
+
+			TARGET(R_GREATER_EQUAL_CONSTANT):
+				BINARY_OP(!bool, <, KC);
+				DISPATCH();
+
+			TARGET(R_LESS_EQUAL):
+				BINARY_OP(!bool, >, RC);
+				DISPATCH();
+
+			TARGET(R_LESS_EQUAL_CONSTANT):
+				BINARY_OP(!bool, >, KC);
+				DISPATCH();
+
+			TARGET(R_LOGICAL_AND):
+				INTEGER_OP(bool, &&, RC);
+				DISPATCH();
+
+			TARGET(R_LOGICAL_OR):
+				INTEGER_OP(bool, ||, RC);
+				DISPATCH();
+
+			TARGET(R_BITWISE_AND):
+				INTEGER_OP(bool, &, RC);
+				DISPATCH();
+
+			TARGET(R_BITWISE_OR):
+				INTEGER_OP(bool, |, RC);
+				DISPATCH();
+
+			TARGET(R_NEGATE):
+			{
+				auto b = RB;
+				if (!b.is_number())
+					RUNTIME_ERROR("Operand must be a number");
+
+				base[A] = -b.as_number();
+				DISPATCH();
+			}
+
+			TARGET(R_NOT):
+				base[A] = RB.is_falsy();
+				DISPATCH();
+
+			TARGET(R_PRINT):
+				std::cout << RB.to_string() << "\n";
+				DISPATCH();
+
+			TARGET(R_JUMP):
+				JUMP();
+				DISPATCH();
+
+			TARGET(R_LOOP):
+				JUMP();
+				SAFEPOINT();
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_FALSE):
+				if (RB.is_falsy())
+					JUMP();
+
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_NOT_LESS):
+				BRANCH_OP(<, true, RC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_NOT_LESS_CONSTANT):
+				BRANCH_OP(<, true, KC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_NOT_GREATER):
+				BRANCH_OP(>, true, RC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_NOT_GREATER_CONSTANT):
+				BRANCH_OP(>, true, KC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_NOT_EQUAL):
+				BRANCH_EQUAL(true, RC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_NOT_EQUAL_CONSTANT):
+				BRANCH_EQUAL(true, KC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_LESS):
+				BRANCH_OP(<, false, RC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_LESS_CONSTANT):
+				BRANCH_OP(<, false, KC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_GREATER):
+				BRANCH_OP(>, false, RC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_GREATER_CONSTANT):
+				BRANCH_OP(>, false, KC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_EQUAL):
+				BRANCH_EQUAL(false, RC);
+				DISPATCH();
+
+			TARGET(R_JUMP_IF_EQUAL_CONSTANT):
+				BRANCH_EQUAL(false, KC);
+				DISPATCH();
+
+			TARGET(R_CALL):
+				SAFEPOINT();
+				SAVE_FRAME();
+				call_registers(base + A, instruction.b);
+				LOAD_FRAME();
+				DISPATCH();
+
+			TARGET(R_CALL_GLOBAL):
+				SAFEPOINT();
+				INSERT_GLOBAL_CALLEE();
+				SAVE_FRAME();
+				call_registers(base + A, instruction.b);
+				LOAD_FRAME();
+				DISPATCH();
+
+			TARGET(R_RETURN):
+			{
+				// the result replaces the callee in the caller's frame
+				auto result = RB;
+				*frame->base = result;
+				frame_count -= 1;
+
+				if (frame_count == 0)
+				{
+					// nothing in the slots is live once the run is over
+					std::fill(first, stack_top, Value());
+					stack_top = first;
+					return region ? end_region(result) : result;
+				}
+
+				frame = &frames[frame_count - 1];
+				LOAD_FRAME();
+				DISPATCH();
+			}
+
+			TARGET(R_BUILD_ARRAY):
+			{
+				auto array = allocate<Array>(base + A, base + A + instruction.b);
+
+				// nested arrays are stored by value
+				for (auto &element : array->buffer->elements)
+				{
+					if (element.is_array())
+						element = element.as_array()->copy();
+				}
+
+				base[A] = array;
+				DISPATCH();
+			}
+
+			TARGET(R_GET_SUBSCRIPT):
+			{
+				auto array = RB;
+				auto index = RC;
+
+				if (!array.is_array())
+					RUNTIME_ERROR("Only arrays can be subscripted");
+
+				if (!index.is_number())
+					RUNTIME_ERROR("Index must be a number");
+
+				auto i = (size_t) index.as_number();
+				if (index.as_number() < 0 || i >= array.as_array()->size())
+					RUNTIME_ERROR("Index out of bounds");
+
+				auto element = array.as_array()->get(i);
+				if (element.is_array())
+					element = element.as_array()->copy();
+
+				base[A] = element;
+				DISPATCH();
+			}
+
+			TARGET(R_SET_SUBSCRIPT):
+			{
+				auto array = RB;
+				auto index = RC;
+				auto element = base[instruction.d];
+
+				if (!array.is_array())
+					RUNTIME_ERROR("Only arrays can be subscripted");
+
+				if (!index.is_number())
+					RUNTIME_ERROR("Index must be a number");
+
+				// storing one past the end appends
+				auto i = (size_t) index.as_number();
+				if (index.as_number() < 0 || i > array.as_array()->size())
+					RUNTIME_ERROR("Index out of bounds");
+
+				if (element.is_array())
+					element = element.as_array()->copy();
+
+				array.as_array()->set(i, element);
+				base[A] = element;
+				DISPATCH();
+			}
+
+			TARGET(R_CLASS):
+				base[A] = allocate<Klass>(KD.as_string());
+				DISPATCH();
+
+			TARGET(R_GET_PROPERTY):
+			{
+				if (!RB.is_instance())
+					RUNTIME_ERROR("Only instances have properties");
+
+				auto instance = RB.as_instance();
+				auto name = constants[instruction.c].as_string();
+				auto &cache = frame->function->chunk.caches[instruction.d];
+				base[A] = instance->get(name, cache);
+				DISPATCH();
+			}
+
+			TARGET(R_SET_PROPERTY):
+			{
+				if (!base[A].is_instance())
+					RUNTIME_ERROR("Only instances have properties");
+
+				auto instance = base[A].as_instance();
+				auto property = base[A + 1];
+				auto name = constants[instruction.c].as_string();
+				auto &cache = frame->function->chunk.caches[instruction.d];
+				instance->set(name, property, cache);
+				base[A] = property;
+				DISPATCH();
+			}
+
+			TARGET(R_ARRAY_CONSTANT):
+				base[A] = KD.as_array()->copy();
+				DISPATCH();
+
+			// the return after a tail call is only reached when the callee isn't a function
+			TARGET(R_TAIL_CALL):
+				SAFEPOINT();
+				SAVE_FRAME();
+				tail_call_registers(base + A, instruction.b);
+				LOAD_FRAME();
+				DISPATCH();
+
+			TARGET(R_TAIL_CALL_GLOBAL):
+				SAFEPOINT();
+				INSERT_GLOBAL_CALLEE();
+				SAVE_FRAME();
+				tail_call_registers(base + A, instruction.b);
+				LOAD_FRAME();
+				DISPATCH();
+
+	#ifndef COMPUTED_GOTO
+			default:
+				assert(!"Unknown register opcode");
+		}
+	}
+	#endif
+
+	#undef LOAD_FRAME
+	#undef SAVE_FRAME
+	#undef SAFEPOINT
+	#undef A
+	#undef RB
+	#undef RC
+	#undef KB
+	#undef KC
+	#undef KD
+	#undef RUNTIME_ERROR
+	#undef BINARY_OP
+	#undef INTEGER_OP
+	#undef BRANCH_OP
+	#undef BRANCH_EQUAL
+	#undef JUMP
+	#undef INSERT_GLOBAL_CALLEE
+	#undef DISPATCH
+	#undef TARGET
+}
+
+// like call_registers, from a call in tail position. a function takes over the
+// current frame, with the callee and its arguments moved down to the frame's base
+void Vm::tail_call_registers(Value *callee, int num_args)
+{
+	// anything else is called normally, and the return that follows returns its result
+	if (!callee->is_fn() || callee->as_fn()->registers.code.empty())
+	{
+		call_registers(callee, num_args);
+		return;
+	}
+
+	std::copy(callee, callee + num_args + 1, frame->base);
+	frame_count -= 1;
+	call_registers(frame->base, num_args);
+}
+
+// calls the function or class in callee with the num_args slots after it as arguments
+void Vm::call_registers(Value *callee, int num_args)
+{
+	if (callee->is_klass())
+	{
+		*callee = allocate<Instance>(callee->as_klass());
+		return;
+	}
+
+	assert(callee->is_fn() && "Tried to call an uncallable object");
+	auto fn = callee->as_fn();
+
+	// a function too large for the register tier
+	if (fn->registers.code.empty())
+	{
+		call_stack_tier(callee, num_args);
+		return;
+	}
+
+	if ((size_t) num_args != fn->num_params)
+	{
+		runtime_error("Expected " + std::to_string(fn->num_params) + " arguments but got " + std::to_string(num_args));
+		exit(1);
+	}
+
+	if (frame_count == FRAMES_MAX || callee + fn->registers.num_registers > stack.get() + STACK_MAX)
+	{
+		runtime_error("Stack overflow");
+		exit(1);
+	}
+
+	frame = &frames[frame_count++];
+	*frame = CallFrame { fn, nullptr, callee, fn->registers.code.data() };
+	cover_registers(callee + fn->registers.num_registers);
+}
+
+// runs fn on the stack tier, along with everything it calls. the callee and its
+// arguments are already laid out the way a stack tier call expects them, and the
+// result replaces the callee like the result of a register tier call does
+void Vm::call_stack_tier(Value *callee, int num_args)
+{
+	auto mark = stack_top;
+	auto depth = frame_count;
+	stack_top = callee + num_args + 1;
+	push_frame(callee->as_fn(), num_args);
+
+	*callee = interpret(depth);
+	frame = &frames[depth - 1];
+
+	// the collector only scanned up to the stack tier's own top, so anything it left
+	// below the mark may point to an object that has been freed since
+	std::fill(callee + 1, mark, Value());
+	stack_top = mark;
+}
+
+// raises the mark to end. the slots it comes to cover may still hold what the stack
+// tier left in them, so they are cleared before the collector gets to see them
+void Vm::cover_registers(Value *end)
+{
+	if (end > stack_top)
+	{
+		std::fill(stack_top, end, Value());
+		stack_top = end;
+	}
+}
@@ -0,0 +1,71 @@
+#include "sampler.h"
+
+#include <string>
+
+#include <sys/time.h>
+
+#include "vm.h"
+
+volatile std::sig_atomic_t Sampler::pending = 0;
+
+void Sampler::on_timer(int)
+{
+	pending = 1;
+}
+
+void Sampler::start()
+{
+	struct sigaction action = {};
+	action.sa_handler = on_timer;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, nullptr);
+
+	auto interval = 1000000 / rate;
+	struct itimerval timer = {};
+	timer.it_interval.tv_sec = interval / 1000000;
+	timer.it_interval.tv_usec = interval % 1000000;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void Sampler::stop()
+{
+	struct itimerval timer = {};
+	setitimer(ITIMER_PROF, &timer, nullptr);
+	pending = 0;
+}
+
+void Sampler::sample(CallFrame const *frames, int frame_count, u8 const *ip)
+{
+	pending = 0;
+	stack.clear();
+
+	// a caller's ip is past its call, so its line is that of the call's last byte
+	for (int i = 0; i < frame_count; i++)
+	{
+		auto &chunk = frames[i].function->chunk;
+		auto at = i == frame_count - 1 ? ip : frames[i].ip - 1;
+		stack.push_back({ frames[i].function, chunk.line(at - chunk.bytecode()) });
+	}
+
+	stacks[stack] += 1;
+}
+
+void Sampler::write_folded(std::FILE *out)
+{
+	for (auto &[stack, count] : stacks)
+	{
+		std::string line;
+		for (auto &[function, source_line] : stack)
+		{
+			if (!line.empty())
+				line += ';';
+
+			line += function->name.empty() ? "script" : function->name;
+			line += ':' + std::to_string(source_line);
+		}
+
+		std::fprintf(out, "%s %llu\n", line.c_str(), (unsigned long long) count);
+	}
+}
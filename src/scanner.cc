@@ -1,45 +1,287 @@
 #include "scanner.h"
 
-// https://ftp.gnu.org/old-gnu/Manuals/flex-2.5.4/html_node/flex_19.html
-int magic();
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <string_view>
 
-Scanner::Scanner(const char *src) :
-	istream(src)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct Keyword
 {
-	lexer = new yyFlexLexer(&istream);
+	std::string_view name;
+	TokenType type;
+};
+
+// no two keywords share their first and last characters and length, so this indexes them without collisions
+static constexpr size_t keyword_hash(std::string_view s)
+{
+	return (s.front() + 2 * s.back() + s.size()) % 32;
 }
 
-Scanner::~Scanner()
+static constexpr auto keywords = []
 {
-	delete lexer;
+	std::array<Keyword, 32> table {};
+	for (auto keyword : {
+		Keyword { "class", KEY_CLASS },
+		Keyword { "else", KEY_ELSE },
+		Keyword { "false", KEY_FALSE },
+		Keyword { "for", KEY_FOR },
+		Keyword { "fn", KEY_FN },
+		Keyword { "if", KEY_IF },
+		Keyword { "nil", KEY_NIL },
+		Keyword { "print", KEY_PRINT },
+		Keyword { "return", KEY_RETURN },
+		Keyword { "self", KEY_SELF },
+		Keyword { "super", KEY_SUPER },
+		Keyword { "true", KEY_TRUE },
+		Keyword { "while", KEY_WHILE },
+	})
+	{
+		if (!table[keyword_hash(keyword.name)].name.empty())
+			throw "keyword_hash has a collision";
+
+		table[keyword_hash(keyword.name)] = keyword;
+	}
+
+	return table;
+}();
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static bool is_identifier_start(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-void Scanner::scan()
+static bool is_identifier_char(char c)
 {
-	int tok, col = 1;
-	while (tok = lexer->yylex())
+	return is_identifier_start(c) || is_digit(c);
+}
+
+static bool is_whitespace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// numbers are -?([0-9]+|[0-9]*\.[0-9]+), so a minus sign right before a digit is part of the number.
+// returns where the number starting at p ends, or nullptr if no number starts there
+static const char *number_end(const char *p)
+{
+	if (*p == '-')
+		p++;
+
+	auto digits = p;
+	while (is_digit(*p))
+		p++;
+
+	if (*p == '.' && is_digit(p[1]))
 	{
-		tokens.push_back({ lexer->YYText(), static_cast<TokenType>(tok), lexer->lineno(), col });
-		col += lexer->YYLeng();
+		p++;
+		while (is_digit(*p))
+			p++;
+
+		return p;
 	}
+
+	return p > digits ? p : nullptr;
+}
+
+#ifdef __SSE2__
+// each byte of bytes that lies in [lo, hi] set to all ones. bytes past 0x7f are negative, so never in range
+static __m128i in_range(__m128i bytes, char lo, char hi)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8(hi + 1)));
+}
+
+// bit i set for each byte i of bytes that equals c
+static int byte_mask(__m128i bytes, char c)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
 }
+#endif
+
+Scanner::Scanner(const char *src) :
+	current(src),
+	end(src + std::strlen(src)),
+	line_start(src)
+{ }
 
 Token Scanner::next()
 {
-	int tok, col = 1;
-	if ((tok = lexer->yylex()))
-		return Token { lexer->YYText(), static_cast<TokenType>(tok), lexer->lineno(), col };
-	else
-		return Token { "EOF", TOKEN_EOF, lexer->lineno(), col };
+	for (;;)
+	{
+		skip_whitespace();
+
+		auto start = current;
+		auto col = static_cast<int>(start - line_start) + 1;
+		auto token = [&](TokenType type) { return Token { std::string_view(start, current - start), type, line, col }; };
+
+		if (current == end)
+			return Token { "EOF", TOKEN_EOF, line, col };
+
+		auto c = *current++;
+
+		if (is_identifier_start(c))
+		{
+			current = skip_identifier(current);
+
+			auto text = std::string_view(start, current - start);
+			auto &keyword = keywords[keyword_hash(text)];
+			return token(keyword.name == text ? keyword.type : IDENTIFIER);
+		}
+
+		if (is_digit(c) || c == '.' || c == '-')
+		{
+			if (auto number = number_end(start))
+			{
+				current = number;
+				return token(NUMBER);
+			}
+		}
+
+		switch (c)
+		{
+			case '(': return token(LEFT_PAREN);
+			case ')': return token(RIGHT_PAREN);
+			case '{': return token(LEFT_BRACE);
+			case '}': return token(RIGHT_BRACE);
+			case '[': return token(LEFT_BRACKET);
+			case ']': return token(RIGHT_BRACKET);
+			case ',': return token(COMMA);
+			case '.': return token(DOT);
+			case '-': return token(MINUS);
+			case '+': return token(PLUS);
+			case '/': return token(SLASH);
+			case '*': return token(STAR);
+			case '%': return token(MOD);
+			case '!': return token(match('=') ? NOT_EQUAL : NOT);
+			case '=': return token(match('=') ? EQUAL_EQUAL : EQUAL);
+			case '>': return token(match('=') ? GREATER_EQUAL : match('>') ? GREATER_GREATER : GREATER);
+			case '<': return token(match('=') ? LESS_EQUAL : match('<') ? LESS_LESS : LESS);
+			case '&': return token(match('&') ? AND_AND : AND);
+			case '|': return token(match('|') ? PIPE_PIPE : PIPE);
+
+			case '\'':
+			case '"':
+			{
+				// strings may span lines, and \n and \t are the only escapes they may hold
+				auto p = current;
+				auto newlines = 0;
+				auto last_newline = line_start - 1;
+
+				for (; *p != c && *p; p++)
+				{
+					if (*p == '\\' && p[1] != 'n' && p[1] != 't')
+						break;
+
+					if (*p == '\\')
+						p++;
+
+					else if (*p == '\n')
+					{
+						newlines++;
+						last_newline = p;
+					}
+				}
+
+				if (*p != c)
+					break;
+
+				current = p + 1;
+				auto string = token(STRING);
+				line += newlines;
+				line_start = last_newline + 1;
+				return string;
+			}
+		}
+
+		// a character that starts no token, or the quote of an unterminated string, is reported and skipped
+		std::cout << "Unknown token: " << c << "\n";
+	}
+}
+
+void Scanner::skip_whitespace()
+{
+	for (;;)
+	{
+		#ifdef __SSE2__
+		// runs of indentation and blank lines are skipped 16 bytes at a time,
+		// but a single space between two tokens isn't worth loading a block for
+		while (is_whitespace(current[0]) && is_whitespace(current[1]) && end - current >= 16)
+		{
+			auto bytes = _mm_loadu_si128(reinterpret_cast<__m128i const *>(current));
+			auto newlines = byte_mask(bytes, '\n');
+			auto blanks = newlines | byte_mask(bytes, ' ') | byte_mask(bytes, '\t') | byte_mask(bytes, '\r');
+
+			auto others = ~blanks & 0xffff;
+			auto run = others ? __builtin_ctz(others) : 16;
+
+			newlines &= (1 << run) - 1;
+			if (newlines)
+			{
+				line += __builtin_popcount(newlines);
+				line_start = current + (31 - __builtin_clz(newlines)) + 1;
+			}
+
+			current += run;
+			if (run < 16)
+				break;
+		}
+		#endif
+
+		for (; is_whitespace(*current); current++)
+		{
+			if (*current == '\n')
+			{
+				line += 1;
+				line_start = current + 1;
+			}
+		}
+
+		if (*current != '#')
+			return;
+
+		// comments run to the end of the line
+		auto newline = static_cast<const char *>(std::memchr(current, '\n', end - current));
+		current = newline ? newline : end;
+	}
 }
 
-std::string Scanner::to_string()
+// returns the first character from p on that can't be part of an identifier
+const char *Scanner::skip_identifier(const char *p)
 {
-	std::string str = "Scanner: [\n";
-	for (auto &tok : tokens)
+	#ifdef __SSE2__
+	while (end - p >= 16)
 	{
-		str += '\t' + tok.to_string() + "\n";
+		auto bytes = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+		auto letters = _mm_or_si128(in_range(bytes, 'a', 'z'), in_range(bytes, 'A', 'Z'));
+		auto digits = _mm_or_si128(in_range(bytes, '0', '9'), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')));
+
+		auto others = ~_mm_movemask_epi8(_mm_or_si128(letters, digits)) & 0xffff;
+		if (others)
+			return p + __builtin_ctz(others);
+
+		p += 16;
 	}
-	str += "]";
-	return str;
+	#endif
+
+	while (is_identifier_char(*p))
+		p++;
+
+	return p;
+}
+
+bool Scanner::match(char expected)
+{
+	if (*current != expected)
+		return false;
+
+	current++;
+	return true;
 }
@@ -0,0 +1,29 @@
+#include "shape.h"
+
+int Shape::lookup(String *name) const
+{
+	auto slot = slots.find(name);
+	if (slot == slots.end())
+		return -1;
+
+	return slot->second;
+}
+
+Shape *Shape::transition(String *name)
+{
+	auto &next = transitions[name];
+	if (!next)
+	{
+		next = std::make_unique<Shape>();
+		next->slots = slots;
+		next->slots[name] = slots.size();
+	}
+
+	return next.get();
+}
+
+Shape *Shape::root()
+{
+	static Shape root;
+	return &root;
+}
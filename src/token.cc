@@ -2,14 +2,14 @@
 
 #include <sstream>
 
-Token::Token(std::string value, TokenType type, int line, int col) :
+Token::Token(std::string_view value, TokenType type, int line, int col) :
 	m_value(value),
 	m_type(type),
 	m_line(line),
 	m_col(col)
 { }
 
-std::string Token::to_string()
+std::string Token::to_string() const
 {
 	std::stringstream str;
 	str << "{";
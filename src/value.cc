@@ -3,187 +3,69 @@
 #include <sstream>
 #include <iostream>
 
+#include "array.h"
 #include "function.h"
 #include "klass.h"
 #include "chunk.h"
 
-Value::Value(bool b) { value = b; }
-Value::Value(void *p) { value = std::monostate{}; }
-Value::Value(double d) { value = d; }
-Value::Value(std::string s) { value = s; }
-Value::Value(std::shared_ptr<Function> fn) { value = fn; }
-Value::Value(std::vector<Value> vs) { value = vs; }
-Value::Value(std::shared_ptr<Klass> klass) { value = klass; }
-Value::Value(std::shared_ptr<Instance> instance) { value = instance; }
+static_assert(sizeof(Value) == 8, "Value must fit in a single word");
 
-bool Value::operator==(const Value other)
-{
-	if (value.index() != other.value.index())
-		return false;
-	
-	return std::visit([](auto &&val1, auto &&val2) -> bool {
-		using T1 = std::decay_t<decltype(val1)>;
-		using T2 = std::decay_t<decltype(val2)>;
-
-		if constexpr (!std::is_same_v<T1, T2>)
-			return false;
-
-		else if constexpr (std::is_same_v<T1, bool>)
-			return val1 == val2;
-
-		else if constexpr (std::is_same_v<T1, std::monostate>)
-			return true;
-		
-		else if constexpr (std::is_same_v<T1, double>)
-			return val1 == val2;
-		
-		else if constexpr (std::is_same_v<T1, std::string>)
-			return val1 == val2;
-
-		else
-			return false;
-
-	}, value, other.value);
-}
-
-bool Value::as_bool()
-{
-	return std::get<bool>(value);
-}
-
-double Value::as_number()
-{
-	return std::get<double>(value);
-}
+Value::Value(std::string_view s) :
+	Value(intern(s))
+{ }
 
-std::string Value::as_string()
+bool Value::operator==(const Value &other) const
 {
-	return std::get<std::string>(value);
-}
-
-std::shared_ptr<Function> Value::as_fn()
-{
-	return std::get<std::shared_ptr<Function>>(value);
-}
+	if (is_number() && other.is_number())
+		return as_number() == other.as_number();
 
-std::vector<Value> Value::as_array()
-{
-	return std::get<std::vector<Value>>(value);
-}
-
-std::shared_ptr<Klass> Value::as_klass()
-{
-	return std::get<std::shared_ptr<Klass>>(value);
+	// nil, bools and everything on the heap compare by identity, including interned strings
+	return bits == other.bits;
 }
 
-std::shared_ptr<Instance> Value::as_instance()
+std::string Value::to_string() const
 {
-	return std::get<std::shared_ptr<Instance>>(value);
-}
+	if (is_bool())
+		return as_bool() ? "true" : "false";
 
-bool Value::is_falsy() const
-{
-	if (const bool *b = std::get_if<bool>(&value))
-	{
-		return !*b;
-	}
+	if (is_nil())
+		return "nil";
 
-	if (std::get_if<std::monostate>(&value))
+	if (is_number())
 	{
-		return true;
-	}
-
-	return false;
-}
-
-bool Value::is_bool() const
-{
-	return std::holds_alternative<bool>(value);
-}
-
-bool Value::is_nil() const
-{
-	return std::holds_alternative<std::monostate>(value);
-}
-
-bool Value::is_number() const
-{
-	return std::holds_alternative<double>(value);
-}
-
-bool Value::is_string() const
-{
-	return std::holds_alternative<std::string>(value);
-}
-
-bool Value::is_fn() const
-{
-	return std::holds_alternative<std::shared_ptr<Function>>(value);
-}
-
-bool Value::is_array() const
-{
-	return std::holds_alternative<std::vector<Value>>(value);
-}
-
-bool Value::is_klass() const
-{
-	return std::holds_alternative<std::shared_ptr<Klass>>(value);
-}
-
-bool Value::is_instance() const
-{
-	return std::holds_alternative<std::shared_ptr<Instance>>(value);
-}
-
-void Value::store_at(int index, Value v)
-{
-	auto array = as_array();
-	array[index] = v;
-	value = array;
-}
-
-std::string Value::to_string()
-{
-	return std::visit([](auto &&arg) -> std::string {
-		using T = std::decay_t<decltype(arg)>;
-		if constexpr (std::is_same_v<T, bool>)
-			return arg ? "true" : "false";
-
-		else if constexpr (std::is_same_v<T, std::monostate>)
-			return "nil";
-
-		else if constexpr (std::is_same_v<T, double>)
+		auto arg = as_number();
+		if (arg == (int) arg)
+			return std::to_string((int) arg);
+
+		auto str = std::to_string(arg);
+		auto dec_index = str.find('.');
+		int precision = 0;
+		for (auto i = dec_index + 1; i < str.size(); i++)
 		{
-			if (arg == (int) arg)
-				return std::to_string((int) arg);
-
-			auto str = std::to_string(arg);
-			auto dec_index = str.find('.');
-			int precision = 0;
-			for (int i = dec_index + 1; i < str.size(); i++)
-			{
-				precision += 1;
-				if (str.at(i) != '0')
-					break;				
-			}
-
-			return str.substr(0, dec_index + precision + 1);
+			precision += 1;
+			if (str.at(i) != '0')
+				break;				
 		}
 
-		else if constexpr (std::is_same_v<T, std::string>)
-			return arg;
+		return str.substr(0, dec_index + precision + 1);
+	}
+
+	switch (as_obj()->type)
+	{
+		case ObjType::String:
+			return as_string()->str;
 
-		else if constexpr (std::is_same_v<T, std::shared_ptr<Function>>)
+		case ObjType::Function:
 		{
-			std::string res = "<fn " + arg->name + ">";
+			std::string res = "<fn " + as_fn()->name + ">";
 			return res;
 		}
 
-		else if constexpr (std::is_same_v<T, std::vector<Value>>)
+		case ObjType::Array:
 		{
+			auto &arg = as_array()->elements();
 			std::string res = "[";
-			for (int i = 0; i < arg.size(); i++)
+			for (size_t i = 0; i < arg.size(); i++)
 			{
 				res += arg[i].to_string();
 				if (i != arg.size() - 1)
@@ -193,17 +75,15 @@ std::string Value::to_string()
 			return res;
 		}
 
-		else if constexpr (std::is_same_v<T, std::shared_ptr<Klass>>)
-		{
-			return arg->name;
-		}
+		case ObjType::Klass:
+			return as_klass()->name->str;
 
-		else if constexpr (std::is_same_v<T, std::shared_ptr<Instance>>)
+		case ObjType::Instance:
 		{
-			std::string res = "#<" + arg->klass->name + ">";
+			std::string res = "#<" + as_instance()->klass->name->str + ">";
 			return res;
 		}
+	}
 
-		return "Unknown variant!";
-	}, value);
+	return "Unknown value!";
 }
@@ -5,432 +5,1163 @@
 #include <cstdio>
 #include <iostream>
 
+#include "array.h"
+#include "heap.h"
 #include "klass.h"
 #include "opcode.h"
 
-Value Vm::run(Function f)
+#ifdef OPCODE_HISTOGRAM
+// how often each opcode was executed right after another, indexed by [previous][next]
+static std::uint64_t opcode_pairs[256][256];
+static u8 previous_opcode = OP_RETURN;
+
+static u8 count_opcode(u8 op)
 {
-	auto cf = CallFrame { f, 0 };
-	frames.push(cf);
+	opcode_pairs[previous_opcode][op] += 1;
+	previous_opcode = op;
+	return op;
+}
 
-	while (1)
+void print_opcode_pairs(std::FILE *out)
+{
+	for (int a = 0; a < 256; a++)
 	{
-		#ifdef DEBUG
-		std::printf("stack:          ");
-		std::printf("[ ");
-		for (auto &x : stack)
-			std::printf("%s ", x->to_string().c_str());
-		std::printf("]\n");
-		#endif
+		for (int b = 0; b < 256; b++)
+		{
+			if (opcode_pairs[a][b])
+				std::fprintf(out, "%llu %s %s\n", (unsigned long long) opcode_pairs[a][b], opcode_name(a), opcode_name(b));
+		}
+	}
+}
+#endif
+
+Vm::Vm() :
+	stack(new Value[STACK_MAX]),
+	frames(new CallFrame[FRAMES_MAX])
+{
+	stack_top = stack.get();
+}
+
+void Vm::use_region(bool reuse_blocks)
+{
+	region = std::make_unique<Region>();
+	reuse_region_blocks = reuse_blocks;
+}
+
+Value Vm::run(Function *f)
+{
+	if (region)
+		heap.begin_region(region.get());
+
+	// a script too large for the register tier runs on the stack tier, along with everything it calls
+	if (register_tier && !f->registers.code.empty())
+		return run_registers(f);
+
+	// the compiler rejects functions that need more stack than there is, but a script
+	// run from a .tzc file didn't necessarily come from this build's compiler
+	if (stack_top + f->max_stack > stack.get() + STACK_MAX)
+	{
+		std::printf("Stack overflow\n");
+		exit(1);
+	}
+
+	frame = &frames[frame_count++];
+	*frame = CallFrame { f, f->chunk.bytecode(), stack_top };
+
+	auto result = interpret(0);
+	if (profiler)
+		profiler->stop();
+
+	return region ? end_region(result) : result;
+}
+
+// runs the function in the top frame, and whatever it calls, until the frame
+// count is back down to depth. machine code and the register tier call functions
+// they have no code for through here, at the depth of their own frame
+Value Vm::interpret(int depth)
+{
+	// hot frame state is kept in locals, and only spilled to the frame on calls and errors
+	u8 const *ip;
+	Value *constants;
+	Value *base;
+
+	// the value a function returns, on its way to the caller
+	Value returned;
+
+	// operands of the instruction being run, for handlers that an OP_WIDE prefix can also enter
+	size_t operand = 0;
+	size_t operand2 = 0;
+
+	// no new globals can be declared while running, so the table never moves
+	Value *global_values = globals.values.data();
+
+	#define LOAD_FRAME() \
+		do { \
+			ip = frame->ip; \
+			constants = frame->function->chunk.constants.data(); \
+			base = frame->base; \
+		} while (0)
 
-		auto instruction = static_cast<Opcode>(read_byte());
+	#define SAVE_FRAME() (frame->ip = ip)
 
-		switch (instruction)
+	// collections only happen here, where every live object is reachable from the vm's roots
+	#define SAFEPOINT() \
+		do { \
+			if (heap.wants_collection()) \
+				collect_garbage(); \
+		} while (0)
+
+	// takes a sample once one is due, at loops, calls and returns so a sample costs nothing in straight line code.
+	// at points into the instruction being run
+	#define SAMPLE(at) \
+		do { \
+			if (Sampler::due() && sampler) \
+				sampler->sample(frames.get(), frame_count, at); \
+		} while (0)
+
+	// once a loop is hot the rest of its function runs as machine code, entered at the top of the loop
+	#define ENTER_JIT() \
+		do { \
+			if (jit && jit->hot_loop(frame->function)) \
+			{ \
+				SAVE_FRAME(); \
+				returned = run_jit(ip); \
+				goto return_to_caller; \
+			} \
+		} while (0)
+
+	#define READ_BYTE() (*ip++)
+
+	#ifdef OPCODE_HISTOGRAM
+	#define READ_OPCODE() count_opcode(READ_BYTE())
+	#else
+	#define READ_OPCODE() READ_BYTE()
+	#endif
+
+	#define READ_SHORT() (ip += 2, static_cast<u16>((ip[-2] << 8) | ip[-1]))
+	#define READ_WIDE() (ip += 3, static_cast<size_t>((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+	#define READ_CONSTANT() (constants[READ_BYTE()])
+
+	#define RUNTIME_ERROR(msg) \
+		do { \
+			SAVE_FRAME(); \
+			runtime_error(msg); \
+			exit(1); \
+		} while (0)
+
+	#define NUMBERS() (peek(0).is_number() && peek(1).is_number())
+
+	// the two operands on top of the stack are known to be numbers
+	#define NUMBER_OP(type, op) \
+		do { \
+			auto b = pop().as_number(); \
+			auto a = pop().as_number(); \
+			push(type(a op b)); \
+		} while (0)
+
+	#define BINARY_OP(type, op) \
+		do { \
+			if (!NUMBERS()) \
+				RUNTIME_ERROR("Operands must be numbers"); \
+			NUMBER_OP(type, op); \
+		} while (0)
+
+	#define INTEGER_OP(type, op) \
+		do { \
+			if (!peek(0).is_number() || !peek(1).is_number()) \
+				RUNTIME_ERROR("Operands must be numbers"); \
+			auto b = (int) pop().as_number(); \
+			auto a = (int) pop().as_number(); \
+			push(type(a op b)); \
+		} while (0)
+
+	// adds numbers or concatenates strings
+	#define ADD_OP() \
+		do { \
+			if (peek(0).is_string() && peek(1).is_string()) \
+			{ \
+				auto b = pop().as_string(); \
+				auto a = pop().as_string(); \
+				push(intern(a->str + b->str)); \
+			} \
+			else \
+				BINARY_OP(Value, +); \
+		} while (0)
+
+	// pops two numbers and jumps offset bytes when comparing them with op doesn't give expected
+	#define BRANCH_OP(op, expected, offset) \
+		do { \
+			auto jump = offset; \
+			if (!peek(0).is_number() || !peek(1).is_number()) \
+				RUNTIME_ERROR("Operands must be numbers"); \
+			auto b = pop().as_number(); \
+			auto a = pop().as_number(); \
+			if ((a op b) != expected) \
+				ip += jump; \
+		} while (0)
+
+	// rewrites the opcode at at, the start of the instruction being run, to another form of the same size.
+	// the histogram counts the opcodes the compiler emitted, so it runs them as they are, and code
+	// mapped from a .tzc file is read only, so it always runs the generic forms
+	#ifdef OPCODE_HISTOGRAM
+	#define QUICKEN(at, op) ((void) (at))
+	#else
+	#define QUICKEN(at, op) \
+		do { \
+			if (!frame->function->chunk.mapped_code) \
+				*const_cast<u8 *>(at) = (op); \
+		} while (0)
+	#endif
+
+	#define BRANCH_EQUAL(expected, offset) \
+		do { \
+			auto jump = offset; \
+			auto b = pop(); \
+			auto a = pop(); \
+			if ((a == b) != expected) \
+				ip += jump; \
+		} while (0)
+
+	// the arguments of a call of a global are already pushed, so the callee is slipped in underneath them
+	#define INSERT_GLOBAL_CALLEE(slot, num_args) \
+		do { \
+			auto callable = global_values[slot]; \
+			if (callable.is_undefined()) \
+				RUNTIME_ERROR("Undefined variable '" + globals.names[slot]->str + "'"); \
+			for (auto arg = stack_top; arg > stack_top - num_args; arg--) \
+				*arg = arg[-1]; \
+			stack_top[-num_args] = callable; \
+			stack_top += 1; \
+		} while (0)
+
+	#ifdef DEBUG
+	#define TRACE() print_stack()
+	#else
+	#define TRACE()
+	#endif
+
+	#ifdef COMPUTED_GOTO
+	static void *dispatch_table[] = {
+		[OP_RETURN]           = &&do_OP_RETURN,
+		[OP_CONSTANT]         = &&do_OP_CONSTANT,
+		[OP_NEGATE]           = &&do_OP_NEGATE,
+		[OP_ADD]              = &&do_OP_ADD,
+		[OP_SUBTRACT]         = &&do_OP_SUBTRACT,
+		[OP_MULTIPLY]         = &&do_OP_MULTIPLY,
+		[OP_DIVIDE]           = &&do_OP_DIVIDE,
+		[OP_MOD]              = &&do_OP_MOD,
+		[OP_NIL]              = &&do_OP_NIL,
+		[OP_TRUE]             = &&do_OP_TRUE,
+		[OP_FALSE]            = &&do_OP_FALSE,
+		[OP_NOT]              = &&do_OP_NOT,
+		[OP_EQUAL]            = &&do_OP_EQUAL,
+		[OP_GREATER]          = &&do_OP_GREATER,
+		[OP_LESS]             = &&do_OP_LESS,
+		[OP_LOGICAL_AND]      = &&do_OP_LOGICAL_AND,
+		[OP_LOGICAL_OR]       = &&do_OP_LOGICAL_OR,
+		[OP_BITWISE_AND]      = &&do_OP_BITWISE_AND,
+		[OP_BITWISE_OR]       = &&do_OP_BITWISE_OR,
+		[OP_PRINT]            = &&do_OP_PRINT,
+		[OP_POP]              = &&do_OP_POP,
+		[OP_GET_GLOBAL_SLOT]  = &&do_OP_GET_GLOBAL_SLOT,
+		[OP_SET_GLOBAL_SLOT]  = &&do_OP_SET_GLOBAL_SLOT,
+		[OP_GET_LOCAL]        = &&do_OP_GET_LOCAL,
+		[OP_SET_LOCAL]        = &&do_OP_SET_LOCAL,
+		[OP_JUMP_IF_FALSE]    = &&do_OP_JUMP_IF_FALSE,
+		[OP_JUMP]             = &&do_OP_JUMP,
+		[OP_LOOP]             = &&do_OP_LOOP,
+		[OP_CALL]             = &&do_OP_CALL,
+		[OP_BUILD_ARRAY]      = &&do_OP_BUILD_ARRAY,
+		[OP_GET_SUBSCRIPT]    = &&do_OP_GET_SUBSCRIPT,
+		[OP_SET_SUBSCRIPT]    = &&do_OP_SET_SUBSCRIPT,
+		[OP_CLASS]            = &&do_OP_CLASS,
+		[OP_GET_PROPERTY]     = &&do_OP_GET_PROPERTY,
+		[OP_SET_PROPERTY]     = &&do_OP_SET_PROPERTY,
+
+		[OP_NOT_EQUAL]           = &&do_OP_NOT_EQUAL,
+		[OP_GREATER_EQUAL]       = &&do_OP_GREATER_EQUAL,
+		[OP_LESS_EQUAL]          = &&do_OP_LESS_EQUAL,
+		[OP_ADD_CONSTANT]        = &&do_OP_ADD_CONSTANT,
+		[OP_SUBTRACT_CONSTANT]   = &&do_OP_SUBTRACT_CONSTANT,
+		[OP_ADD_LOCALS]          = &&do_OP_ADD_LOCALS,
+		[OP_SUBTRACT_LOCALS]     = &&do_OP_SUBTRACT_LOCALS,
+		[OP_SET_GLOBAL_POP]      = &&do_OP_SET_GLOBAL_POP,
+		[OP_SET_LOCAL_POP]       = &&do_OP_SET_LOCAL_POP,
+		[OP_POP_JUMP_IF_FALSE]   = &&do_OP_POP_JUMP_IF_FALSE,
+		[OP_JUMP_IF_NOT_LESS]    = &&do_OP_JUMP_IF_NOT_LESS,
+		[OP_JUMP_IF_NOT_GREATER] = &&do_OP_JUMP_IF_NOT_GREATER,
+		[OP_JUMP_IF_NOT_EQUAL]   = &&do_OP_JUMP_IF_NOT_EQUAL,
+		[OP_JUMP_IF_LESS]        = &&do_OP_JUMP_IF_LESS,
+		[OP_JUMP_IF_GREATER]     = &&do_OP_JUMP_IF_GREATER,
+		[OP_JUMP_IF_EQUAL]       = &&do_OP_JUMP_IF_EQUAL,
+		[OP_CALL_GLOBAL]         = &&do_OP_CALL_GLOBAL,
+		[OP_ARRAY_CONSTANT]      = &&do_OP_ARRAY_CONSTANT,
+		[OP_WIDE]                = &&do_OP_WIDE,
+		[OP_TAIL_CALL]           = &&do_OP_TAIL_CALL,
+		[OP_TAIL_CALL_GLOBAL]    = &&do_OP_TAIL_CALL_GLOBAL,
+
+		[OP_ADD_NUM]                = &&do_OP_ADD_NUM,
+		[OP_ADD_CONSTANT_NUM]       = &&do_OP_ADD_CONSTANT_NUM,
+		[OP_ADD_LOCALS_NUM]         = &&do_OP_ADD_LOCALS_NUM,
+		[OP_EQUAL_NUM]              = &&do_OP_EQUAL_NUM,
+		[OP_JUMP_IF_NOT_EQUAL_NUM]  = &&do_OP_JUMP_IF_NOT_EQUAL_NUM,
+		[OP_GET_PROPERTY_MONO]      = &&do_OP_GET_PROPERTY_MONO,
+		[OP_SET_PROPERTY_MONO]      = &&do_OP_SET_PROPERTY_MONO,
+	};
+
+	// when profiling, every opcode goes through profile_instruction on its way to its handler
+	static void *profile_table[256];
+	void **table = dispatch_table;
+	if (profiler)
+	{
+		std::fill(std::begin(profile_table), std::end(profile_table), &&profile_instruction);
+		table = profile_table;
+	}
+
+	// computed gotos don't run destructors when they leave a scope,
+	// so nothing that needs destroying may be alive across a DISPATCH()
+	#define DISPATCH() \
+		do { \
+			TRACE(); \
+			goto *table[READ_OPCODE()]; \
+		} while (0)
+
+	#define TARGET(op) do_##op
+	#else
+	#define DISPATCH() continue
+	#define TARGET(op) case op
+	#endif
+
+	// where OP_WIDE enters a handler, once the operands are read
+	#define WIDE_TARGET(op) wide_##op
+
+	LOAD_FRAME();
+
+	#ifdef COMPUTED_GOTO
+	DISPATCH();
+
+	profile_instruction:
+		profiler->enter(frame->function, ip - 1);
+		goto *dispatch_table[ip[-1]];
+	#else
+	while (1)
+	{
+		TRACE();
+		if (profiler)
+			profiler->enter(frame->function, ip);
+
+		switch (static_cast<Opcode>(READ_OPCODE()))
 		{
-			case OP_RETURN:
+	#endif
+			TARGET(OP_RETURN):
 			{
+				// a function with neither loops nor calls is only ever seen here
+				SAMPLE(ip - 1);
+
 				auto result = pop();
-				auto frame = frames.top();
-				frames.pop();
+				stack_top = frame->base;
+				frame_count -= 1;
 
-				if (frames.empty())
-					return *result;
-				
-				auto diff = stack.size() - frame.base;
-				for (int i = 0; i < diff; i++)
-					pop();
+				if (frame_count == depth)
+					return result;
 
+				frame = &frames[frame_count - 1];
+				LOAD_FRAME();
 				push(result);
-				break;
-			}
-			
-			case OP_CONSTANT:
-			{
-				auto constant = read_constant();
-				push(std::make_shared<Value>(constant));
-				break;
+				DISPATCH();
 			}
 
-			case OP_NEGATE:
-				// TODO
-				break;
-
-			case OP_ADD:
-				binary_op(Operator::Plus);
-				break;
-
-			case OP_SUBTRACT:
-				binary_op(Operator::Minus);
-				break;
-			
-			case OP_MULTIPLY:
-				binary_op(Operator::Star);
-				break;
-			
-			case OP_DIVIDE:
-				binary_op(Operator::Slash);
-				break;
-			
-			case OP_MOD:
-				binary_op(Operator::Mod);
-				break;
-			
-			case OP_NIL:
-				push(std::make_shared<Value>(nullptr));
-				break;
-			
-			case OP_TRUE:
-				push(std::make_shared<Value>(true));
-				break;
-			
-			case OP_FALSE:
-				push(std::make_shared<Value>(false));
-				break;
-			
-			case OP_NOT:
+			// where a frame that ran as machine code, or was taken over by a function that did, returns from
+			return_to_caller:
+				if (frame_count == depth)
+					return returned;
+
+				frame = &frames[frame_count - 1];
+				LOAD_FRAME();
+				push(returned);
+				DISPATCH();
+
+			TARGET(OP_CONSTANT):
+				push(READ_CONSTANT());
+				DISPATCH();
+
+			TARGET(OP_NEGATE):
+				if (!peek().is_number())
+					RUNTIME_ERROR("Operand must be a number");
+
+				push(-pop().as_number());
+				DISPATCH();
+
+			// the generic forms of quickened instructions rewrite themselves once they see the operands
+			// their quickened form expects. the quickened forms check those operands still are, and
+			// otherwise rewrite themselves back and do what the generic form would
+			TARGET(OP_ADD):
+				if (NUMBERS())
+					QUICKEN(ip - 1, OP_ADD_NUM);
+
+				ADD_OP();
+				DISPATCH();
+
+			TARGET(OP_ADD_NUM):
+				if (!NUMBERS())
+				{
+					QUICKEN(ip - 1, OP_ADD);
+					ADD_OP();
+					DISPATCH();
+				}
+
+				NUMBER_OP(Value, +);
+				DISPATCH();
+
+			TARGET(OP_SUBTRACT):
+				BINARY_OP(Value, -);
+				DISPATCH();
+
+			TARGET(OP_MULTIPLY):
+				BINARY_OP(Value, *);
+				DISPATCH();
+
+			TARGET(OP_DIVIDE):
+				BINARY_OP(Value, /);
+				DISPATCH();
+
+			TARGET(OP_MOD):
+				INTEGER_OP(double, %);
+				DISPATCH();
+
+			TARGET(OP_NIL):
+				push(nullptr);
+				DISPATCH();
+
+			TARGET(OP_TRUE):
+				push(true);
+				DISPATCH();
+
+			TARGET(OP_FALSE):
+				push(false);
+				DISPATCH();
+
+			TARGET(OP_NOT):
+				push(pop().is_falsy());
+				DISPATCH();
+
+			TARGET(OP_EQUAL):
 			{
-				auto value = pop();
-				push(std::make_shared<Value>(value->is_falsy()));
-				break;
+				if (NUMBERS())
+					QUICKEN(ip - 1, OP_EQUAL_NUM);
+
+				auto b = pop();
+				auto a = pop();
+				push(a == b);
+				DISPATCH();
 			}
-			
-			case OP_EQUAL:
+
+			TARGET(OP_EQUAL_NUM):
 			{
+				if (NUMBERS())
+				{
+					NUMBER_OP(bool, ==);
+					DISPATCH();
+				}
+
+				QUICKEN(ip - 1, OP_EQUAL);
 				auto b = pop();
 				auto a = pop();
-				push(std::make_shared<Value>(*a == *b));
-				break;
+				push(a == b);
+				DISPATCH();
 			}
-			
-			case OP_GREATER:
-				binary_op(Operator::GreaterThan);
-				break;
-			
-			case OP_LESS:
-				binary_op(Operator::LessThan);
-				break;
-			
-			case OP_LOGICAL_AND:
-				binary_op(Operator::AmpAmp);
-				break;
-
-			case OP_LOGICAL_OR:
-				binary_op(Operator::PipePipe);
-				break;
-			
-			case OP_BITWISE_AND:
-				binary_op(Operator::Amp);
-				break;
-
-			case OP_BITWISE_OR:
-				binary_op(Operator::Pipe);
-				break;
-			
-			case OP_PRINT:
-				std::cout << peek()->to_string() << "\n";
-				break;
-			
-			case OP_POP:
+
+			TARGET(OP_GREATER):
+				BINARY_OP(bool, >);
+				DISPATCH();
+
+			TARGET(OP_LESS):
+				BINARY_OP(bool, <);
+				DISPATCH();
+
+			TARGET(OP_LOGICAL_AND):
+				INTEGER_OP(bool, &&);
+				DISPATCH();
+
+			TARGET(OP_LOGICAL_OR):
+				INTEGER_OP(bool, ||);
+				DISPATCH();
+
+			TARGET(OP_BITWISE_AND):
+				INTEGER_OP(bool, &);
+				DISPATCH();
+
+			TARGET(OP_BITWISE_OR):
+				INTEGER_OP(bool, |);
+				DISPATCH();
+
+			TARGET(OP_PRINT):
+				std::cout << peek().to_string() << "\n";
+				DISPATCH();
+
+			TARGET(OP_POP):
 				pop();
-				break;
-			
-			case OP_GET_GLOBAL:
+				DISPATCH();
+
+			TARGET(OP_GET_GLOBAL_SLOT):
+				operand = READ_SHORT();
+			WIDE_TARGET(OP_GET_GLOBAL_SLOT):
 			{
-				auto constant = read_constant();
-				auto variable = globals.find(constant.as_string());
-
-				if (variable != globals.end())
-					push(variable->second);
-				else
-					runtime_error("Undefined variable");
-				break;
+				auto slot = operand;
+				auto value = global_values[slot];
+
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable '" + globals.names[slot]->str + "'");
+
+				push(value);
+				DISPATCH();
 			}
 
-			case OP_SET_GLOBAL:
+			TARGET(OP_SET_GLOBAL_SLOT):
+				global_values[READ_SHORT()] = peek();
+				DISPATCH();
+
+			TARGET(OP_GET_LOCAL):
+				push(base[READ_BYTE()]);
+				DISPATCH();
+
+			TARGET(OP_SET_LOCAL):
+				base[READ_BYTE()] = peek();
+				DISPATCH();
+
+			TARGET(OP_JUMP_IF_FALSE):
 			{
-				auto constant = read_constant();
-				std::string name;
-				std::shared_ptr<Value> value;
-				if (constant.is_string())
-				{
-					name = constant.as_string();
-					value = peek();
-				}
+				auto offset = READ_SHORT();
+				if (peek().is_falsy())
+					ip += offset;
+
+				DISPATCH();
+			}
+
+			TARGET(OP_JUMP):
+			{
+				auto offset = READ_SHORT();
+				ip += offset;
+				DISPATCH();
+			}
 
-				else if (constant.is_fn())
+			TARGET(OP_LOOP):
+			{
+				auto offset = READ_SHORT();
+				ip -= offset;
+				SAFEPOINT();
+				SAMPLE(ip);
+				ENTER_JIT();
+				DISPATCH();
+			}
+
+			TARGET(OP_CALL):
+				operand = READ_BYTE();
+			WIDE_TARGET(OP_CALL):
+				SAFEPOINT();
+				SAMPLE(ip - 1);
+				SAVE_FRAME();
+				call_value(operand);
+				LOAD_FRAME();
+				DISPATCH();
+
+			TARGET(OP_BUILD_ARRAY):
+				operand = READ_BYTE();
+			WIDE_TARGET(OP_BUILD_ARRAY):
+			{
+				auto num_elements = operand;
+				stack_top -= num_elements;
+				auto array = allocate<Array>(stack_top, stack_top + num_elements);
+
+				// nested arrays are stored by value
+				for (auto &element : array->buffer->elements)
 				{
-					name = constant.as_fn()->name;
-					value = std::make_shared<Value>(constant.as_fn());
+					if (element.is_array())
+						element = element.as_array()->copy();
 				}
 
-				else
-					assert(!"Error: got unknown type in OP_SET_GLOBAL");
-
-				globals[name] = value;
-				break;
+				push(array);
+				DISPATCH();
 			}
 
-			case OP_GET_LOCAL:
+			TARGET(OP_GET_SUBSCRIPT):
 			{
-				auto base = frames.top().base;
-				auto slot = read_byte();
-				push(stack[base + slot]);
-				break;
+				auto index = pop();
+				auto array = pop();
+
+				if (!array.is_array())
+					RUNTIME_ERROR("Only arrays can be subscripted");
+
+				if (!index.is_number())
+					RUNTIME_ERROR("Index must be a number");
+
+				auto i = (size_t) index.as_number();
+				if (index.as_number() < 0 || i >= array.as_array()->size())
+					RUNTIME_ERROR("Index out of bounds");
+
+				auto element = array.as_array()->get(i);
+				if (element.is_array())
+					element = element.as_array()->copy();
+
+				push(element);
+				DISPATCH();
 			}
 
-			case OP_SET_LOCAL:
+			TARGET(OP_SET_SUBSCRIPT):
 			{
-				auto base = frames.top().base;
-				auto slot = read_byte();
-				stack[base + slot] = peek();
-				break;
+				auto element = pop();
+				auto index = pop();
+				auto array = pop();
+
+				if (!array.is_array())
+					RUNTIME_ERROR("Only arrays can be subscripted");
+
+				if (!index.is_number())
+					RUNTIME_ERROR("Index must be a number");
+
+				// storing one past the end appends
+				auto i = (size_t) index.as_number();
+				if (index.as_number() < 0 || i > array.as_array()->size())
+					RUNTIME_ERROR("Index out of bounds");
+
+				if (element.is_array())
+					element = element.as_array()->copy();
+
+				array.as_array()->set(i, element);
+				push(element);
+				DISPATCH();
 			}
 
-			case OP_JUMP_IF_FALSE:
+			TARGET(OP_CLASS):
+				operand = READ_BYTE();
+			WIDE_TARGET(OP_CLASS):
 			{
-				auto offset = read_short();
-				if (peek()->is_falsy())
-					frames.top().ip += offset;
-				
-				break;
+				auto name = constants[operand];
+				auto klass = allocate<Klass>(name.as_string());
+				push(klass);
+				DISPATCH();
 			}
 
-			case OP_JUMP:
+			// a site that has only seen one shape holding the field reads it straight out of its slot.
+			// only the narrow form is quickened
+			TARGET(OP_GET_PROPERTY):
 			{
-				auto offset = read_short();
-				frames.top().ip += offset;
-				break;
+				operand = READ_BYTE();
+				operand2 = READ_SHORT();
+
+				auto &cache = frame->function->chunk.caches[operand2];
+				if (cache.count == 1 && cache.entries[0].slot != -1)
+					QUICKEN(ip - 4, OP_GET_PROPERTY_MONO);
+			}
+			WIDE_TARGET(OP_GET_PROPERTY):
+			{
+				if (!peek().is_instance())
+					RUNTIME_ERROR("Only instances have properties");
+
+				auto instance = pop().as_instance();
+				auto name = constants[operand].as_string();
+				auto &cache = frame->function->chunk.caches[operand2];
+				push(instance->get(name, cache));
+				DISPATCH();
 			}
 
-			case OP_LOOP:
+			// likewise for a site that has only stored to a field the instance already had
+			TARGET(OP_SET_PROPERTY):
 			{
-				auto offset = read_short();
-				frames.top().ip -= offset;
-				break;
+				operand = READ_BYTE();
+				operand2 = READ_SHORT();
+
+				auto &cache = frame->function->chunk.caches[operand2];
+				if (cache.count == 1 && !cache.entries[0].next)
+					QUICKEN(ip - 4, OP_SET_PROPERTY_MONO);
 			}
+			WIDE_TARGET(OP_SET_PROPERTY):
+			{
+				if (!peek(1).is_instance())
+					RUNTIME_ERROR("Only instances have properties");
 
-			case OP_CALL:
+				auto property = pop();
+				auto instance = pop().as_instance();
+				auto name = constants[operand].as_string();
+				auto &cache = frame->function->chunk.caches[operand2];
+				instance->set(name, property, cache);
+				push(property);
+				DISPATCH();
+			}
+
+			TARGET(OP_GET_PROPERTY_MONO):
 			{
-				auto num_args = read_byte();
-				auto callable = peek(num_args);
+				operand = READ_BYTE();
+				operand2 = READ_SHORT();
 
-				if (callable->is_fn())
+				// anything but an instance of the cached shape goes the generic way, which raises the errors
+				auto &entry = frame->function->chunk.caches[operand2].entries[0];
+				if (!peek().is_instance() || peek().as_instance()->shape != entry.shape)
 				{
-					auto base = static_cast<uint>(stack.size() - num_args - 1);
-					auto cf = CallFrame { *callable->as_fn(), base };
-					frames.push(cf);
+					QUICKEN(ip - 4, OP_GET_PROPERTY);
+					goto WIDE_TARGET(OP_GET_PROPERTY);
 				}
 
-				else if (callable->is_klass())
-				{
-					auto klass = callable->as_klass();
-					auto instance = std::make_shared<Instance>(klass);
-					push(std::make_shared<Value>(instance));
-				}
+				peek() = peek().as_instance()->fields[entry.slot];
+				DISPATCH();
+			}
+
+			TARGET(OP_SET_PROPERTY_MONO):
+			{
+				operand = READ_BYTE();
+				operand2 = READ_SHORT();
 
-				else
+				auto &entry = frame->function->chunk.caches[operand2].entries[0];
+				if (!peek(1).is_instance() || peek(1).as_instance()->shape != entry.shape)
 				{
-					assert(!"Tried to call an uncallable object");
+					QUICKEN(ip - 4, OP_SET_PROPERTY);
+					goto WIDE_TARGET(OP_SET_PROPERTY);
 				}
-				
-				break;
+
+				auto instance = peek(1).as_instance();
+				auto property = pop();
+				instance->fields[entry.slot] = property;
+				heap.write_barrier(instance, property);
+				peek() = property;
+				DISPATCH();
 			}
 
-			case OP_BUILD_ARRAY:
+			TARGET(OP_NOT_EQUAL):
 			{
-				auto num_elements = read_byte();
-				std::vector<Value> array;
-				while (num_elements--)
-					array.push_back(*pop());
-				
-				std::reverse(array.begin(), array.end());
-				push(std::make_shared<Value>(array));
-				break;
+				auto b = pop();
+				auto a = pop();
+				push(!(a == b));
+				DISPATCH();
 			}
 
-			case OP_GET_SUBSCRIPT:
-			{
-				auto index = pop();
-				auto array_value = pop();
+			// written as the negation of the opposite comparison, so NaN behaves like the unfused sequence
+			TARGET(OP_GREATER_EQUAL):
+				BINARY_OP(!bool, <);
+				DISPATCH();
+
+			TARGET(OP_LESS_EQUAL):
+				BINARY_OP(!bool, >);
+				DISPATCH();
+
+			TARGET(OP_ADD_CONSTANT):
+				push(READ_CONSTANT());
+				if (NUMBERS())
+					QUICKEN(ip - 2, OP_ADD_CONSTANT_NUM);
 
-				auto array = array_value->as_array();
-				push(std::make_shared<Value>(array[(int) index->as_number()]));
+				ADD_OP();
+				DISPATCH();
+
+			TARGET(OP_ADD_CONSTANT_NUM):
+				push(READ_CONSTANT());
+				if (!NUMBERS())
+				{
+					QUICKEN(ip - 2, OP_ADD_CONSTANT);
+					ADD_OP();
+					DISPATCH();
+				}
+
+				NUMBER_OP(Value, +);
+				DISPATCH();
+
+			TARGET(OP_SUBTRACT_CONSTANT):
+				push(READ_CONSTANT());
+				BINARY_OP(Value, -);
+				DISPATCH();
+
+			TARGET(OP_ADD_LOCALS):
+			{
+				auto a = base[READ_BYTE()];
+				auto b = base[READ_BYTE()];
+				push(a);
+				push(b);
+				if (NUMBERS())
+					QUICKEN(ip - 3, OP_ADD_LOCALS_NUM);
 
-				break;
+				ADD_OP();
+				DISPATCH();
 			}
 
-			case OP_SET_SUBSCRIPT:
+			TARGET(OP_ADD_LOCALS_NUM):
 			{
-				auto element = pop();
-				auto index = pop();
-				auto array = pop();
+				auto a = base[READ_BYTE()];
+				auto b = base[READ_BYTE()];
+				push(a);
+				push(b);
+				if (!NUMBERS())
+				{
+					QUICKEN(ip - 3, OP_ADD_LOCALS);
+					ADD_OP();
+					DISPATCH();
+				}
 
-				array->store_at((int) index->as_number(), *element);
-				push(element);
-				break;
+				NUMBER_OP(Value, +);
+				DISPATCH();
 			}
 
-			case OP_CLASS:
+			TARGET(OP_SUBTRACT_LOCALS):
 			{
-				auto name = read_constant();
-				auto klass = std::make_shared<Klass>(name.as_string());
-				push(std::make_shared<Value>(klass));
-				break;
+				auto a = base[READ_BYTE()];
+				auto b = base[READ_BYTE()];
+				push(a);
+				push(b);
+				BINARY_OP(Value, -);
+				DISPATCH();
 			}
 
-			case OP_GET_PROPERTY:
+			TARGET(OP_SET_GLOBAL_POP):
+				global_values[READ_SHORT()] = pop();
+				DISPATCH();
+
+			TARGET(OP_SET_LOCAL_POP):
+				base[READ_BYTE()] = pop();
+				DISPATCH();
+
+			TARGET(OP_POP_JUMP_IF_FALSE):
 			{
-				auto instance = peek()->as_instance();
-				auto name = read_constant().as_string();
+				auto offset = READ_SHORT();
+				if (pop().is_falsy())
+					ip += offset;
 
-				// if an instance's value isn't set, default to nil
-				auto property = std::make_shared<Value>(nullptr);
+				DISPATCH();
+			}
 
-				if (instance->fields.find(name) != instance->fields.end())
-					property = instance->fields[name];
+			TARGET(OP_JUMP_IF_NOT_LESS):
+				BRANCH_OP(<, true, READ_SHORT());
+				DISPATCH();
 
-				push(property);
-				break;
+			TARGET(OP_JUMP_IF_NOT_GREATER):
+				BRANCH_OP(>, true, READ_SHORT());
+				DISPATCH();
+
+			// only the narrow form is quickened
+			TARGET(OP_JUMP_IF_NOT_EQUAL):
+				if (NUMBERS())
+					QUICKEN(ip - 1, OP_JUMP_IF_NOT_EQUAL_NUM);
+
+				BRANCH_EQUAL(true, READ_SHORT());
+				DISPATCH();
+
+			TARGET(OP_JUMP_IF_NOT_EQUAL_NUM):
+			{
+				auto offset = READ_SHORT();
+				if (!NUMBERS())
+				{
+					QUICKEN(ip - 3, OP_JUMP_IF_NOT_EQUAL);
+					BRANCH_EQUAL(true, offset);
+					DISPATCH();
+				}
+
+				auto b = pop().as_number();
+				auto a = pop().as_number();
+				if (a != b)
+					ip += offset;
+
+				DISPATCH();
 			}
 
-			case OP_SET_PROPERTY:
+			TARGET(OP_JUMP_IF_LESS):
+				BRANCH_OP(<, false, READ_SHORT());
+				DISPATCH();
+
+			TARGET(OP_JUMP_IF_GREATER):
+				BRANCH_OP(>, false, READ_SHORT());
+				DISPATCH();
+
+			TARGET(OP_JUMP_IF_EQUAL):
+				BRANCH_EQUAL(false, READ_SHORT());
+				DISPATCH();
+
+			TARGET(OP_CALL_GLOBAL):
+				operand = READ_SHORT();
+				operand2 = READ_BYTE();
+			WIDE_TARGET(OP_CALL_GLOBAL):
+				SAFEPOINT();
+				SAMPLE(ip - 1);
+				INSERT_GLOBAL_CALLEE(operand, operand2);
+				SAVE_FRAME();
+				call_value(operand2);
+				LOAD_FRAME();
+				DISPATCH();
+
+			// the copy shares the constant's elements until it is written to
+			TARGET(OP_ARRAY_CONSTANT):
+				push(READ_CONSTANT().as_array()->copy());
+				DISPATCH();
+
+			TARGET(OP_TAIL_CALL):
+				operand = READ_BYTE();
+			WIDE_TARGET(OP_TAIL_CALL):
+				SAFEPOINT();
+				SAMPLE(ip - 1);
+				SAVE_FRAME();
+				if (tail_call(operand))
+				{
+					returned = pop();
+					goto return_to_caller;
+				}
+
+				LOAD_FRAME();
+				DISPATCH();
+
+			TARGET(OP_TAIL_CALL_GLOBAL):
+				operand = READ_SHORT();
+				operand2 = READ_BYTE();
+			WIDE_TARGET(OP_TAIL_CALL_GLOBAL):
+				SAFEPOINT();
+				SAMPLE(ip - 1);
+				INSERT_GLOBAL_CALLEE(operand, operand2);
+				SAVE_FRAME();
+				if (tail_call(operand2))
+				{
+					returned = pop();
+					goto return_to_caller;
+				}
+
+				LOAD_FRAME();
+				DISPATCH();
+
+			// reads the operands of the next instruction at their wide width and runs the rest of its handler
+			TARGET(OP_WIDE):
 			{
-				auto instance = peek(1)->as_instance();
-				auto name = read_constant().as_string();
+				auto op = READ_BYTE();
+				operand = READ_WIDE();
+				if (operand_count(op) > 1)
+					operand2 = READ_WIDE();
 
-				auto property = pop();
-				instance->fields[name] = property;
-				pop();
-				push(property);
-				break;
+				switch (op)
+				{
+					case OP_GET_GLOBAL_SLOT:      goto WIDE_TARGET(OP_GET_GLOBAL_SLOT);
+					case OP_CALL:                 goto WIDE_TARGET(OP_CALL);
+					case OP_BUILD_ARRAY:          goto WIDE_TARGET(OP_BUILD_ARRAY);
+					case OP_CLASS:                goto WIDE_TARGET(OP_CLASS);
+					case OP_GET_PROPERTY:         goto WIDE_TARGET(OP_GET_PROPERTY);
+					case OP_SET_PROPERTY:         goto WIDE_TARGET(OP_SET_PROPERTY);
+					case OP_CALL_GLOBAL:          goto WIDE_TARGET(OP_CALL_GLOBAL);
+					case OP_TAIL_CALL:            goto WIDE_TARGET(OP_TAIL_CALL);
+					case OP_TAIL_CALL_GLOBAL:     goto WIDE_TARGET(OP_TAIL_CALL_GLOBAL);
+
+					// handlers short enough to repeat here. entering the narrow ones
+					// part way through made gcc compile them noticeably worse
+					case OP_CONSTANT:             push(constants[operand]); DISPATCH();
+					case OP_ARRAY_CONSTANT:       push(constants[operand].as_array()->copy()); DISPATCH();
+					case OP_SET_GLOBAL_SLOT:      global_values[operand] = peek(); DISPATCH();
+					case OP_SET_GLOBAL_POP:       global_values[operand] = pop(); DISPATCH();
+					case OP_GET_LOCAL:            push(base[operand]); DISPATCH();
+					case OP_SET_LOCAL:            base[operand] = peek(); DISPATCH();
+					case OP_SET_LOCAL_POP:        base[operand] = pop(); DISPATCH();
+
+					case OP_JUMP_IF_FALSE:
+						if (peek().is_falsy())
+							ip += operand;
+
+						DISPATCH();
+
+					case OP_POP_JUMP_IF_FALSE:
+						if (pop().is_falsy())
+							ip += operand;
+
+						DISPATCH();
+
+					case OP_JUMP:
+						ip += operand;
+						DISPATCH();
+
+					case OP_LOOP:
+						ip -= operand;
+						SAFEPOINT();
+						SAMPLE(ip);
+						ENTER_JIT();
+						DISPATCH();
+
+					case OP_JUMP_IF_NOT_LESS:     BRANCH_OP(<, true, operand); DISPATCH();
+					case OP_JUMP_IF_NOT_GREATER:  BRANCH_OP(>, true, operand); DISPATCH();
+					case OP_JUMP_IF_NOT_EQUAL:    BRANCH_EQUAL(true, operand); DISPATCH();
+					case OP_JUMP_IF_LESS:         BRANCH_OP(<, false, operand); DISPATCH();
+					case OP_JUMP_IF_GREATER:      BRANCH_OP(>, false, operand); DISPATCH();
+					case OP_JUMP_IF_EQUAL:        BRANCH_EQUAL(false, operand); DISPATCH();
+				}
+
+				assert(!"Opcode has no wide form");
+				DISPATCH();
 			}
 
+	#ifndef COMPUTED_GOTO
 			default:
 				assert(!"Unknown opcode");
 		}
 	}
+	#endif
+
+	#undef LOAD_FRAME
+	#undef SAVE_FRAME
+	#undef SAFEPOINT
+	#undef SAMPLE
+	#undef ENTER_JIT
+	#undef NUMBERS
+	#undef NUMBER_OP
+	#undef QUICKEN
+	#undef READ_BYTE
+	#undef READ_OPCODE
+	#undef READ_SHORT
+	#undef READ_WIDE
+	#undef READ_CONSTANT
+	#undef RUNTIME_ERROR
+	#undef BINARY_OP
+	#undef INTEGER_OP
+	#undef ADD_OP
+	#undef BRANCH_OP
+	#undef BRANCH_EQUAL
+	#undef INSERT_GLOBAL_CALLEE
+	#undef TRACE
+	#undef DISPATCH
+	#undef TARGET
+	#undef WIDE_TARGET
 }
 
-void Vm::push(std::shared_ptr<Value> value)
+// runs the function in the top frame as machine code, starting at the instruction at,
+// until it returns. the frame is popped, and the caller pushes the result
+Value Vm::run_jit(u8 const *at)
 {
-	stack.push_back(value);
+	auto result = jit->run(this, frame->function, frame->base, stack_top, at);
+	stack_top = frame->base;
+	frame_count -= 1;
+
+	if (frame_count > 0)
+		frame = &frames[frame_count - 1];
+
+	return result;
 }
 
-std::shared_ptr<Value> Vm::pop()
+// pushes a frame for fn. a function with machine code runs to completion right
+// away instead, its result replacing it and its arguments, and true is returned
+bool Vm::call(Function *fn, int num_args)
 {
-	auto value = stack.back();
-	stack.pop_back();
-	return value;
+	push_frame(fn, num_args);
+
+	if (jit && jit->hot_call(fn))
+	{
+		push(run_jit(frame->ip));
+		return true;
+	}
+
+	return false;
 }
 
-std::shared_ptr<Value> Vm::peek(uint offset)
+// the error for a call push_frame can't make
+void Vm::call_error(Function *fn, int num_args)
 {
-	return stack[stack.size() - offset - 1];
+	if ((size_t) num_args != fn->num_params)
+		runtime_error("Expected " + std::to_string(fn->num_params) + " arguments but got " + std::to_string(num_args));
+	else
+		runtime_error("Stack overflow");
+
+	exit(1);
 }
 
-void Vm::binary_op(Operator op)
+// calls the function or class sitting on the stack below its arguments.
+// returns true if the callee was a function that already ran as machine code
+bool Vm::call_value(int num_args)
 {
-	if (!peek(0)->is_number() || !peek(1)->is_number())
+	auto callable = peek(num_args);
+
+	if (callable.is_fn())
+		return call(callable.as_fn(), num_args);
+
+	else if (callable.is_klass())
 	{
-		runtime_error("Operands must be numbers");
-		exit(1);
-		return;
+		// the new instance replaces the class and its arguments
+		auto instance = allocate<Instance>(callable.as_klass());
+		stack_top -= num_args + 1;
+		push(instance);
 	}
 
-	double result;
-	bool x;
-	auto b = pop()->as_number();
-	auto a = pop()->as_number();
+	else
+	{
+		assert(!"Tried to call an uncallable object");
+	}
+
+	return false;
+}
 
-	switch (op)
+// calls the function or class sitting on the stack below its arguments, from a call in tail position.
+// a function reuses the current frame, with the callee and arguments moved down to its base.
+// returns true if the callee already ran as machine code, in which case the reused frame is gone
+// and its result is on top of the stack
+bool Vm::tail_call(int num_args)
+{
+	auto callable = peek(num_args);
+	if (!callable.is_fn())
 	{
-		case Operator::Plus:
-			result = a + b;
-			push(std::make_shared<Value>(result));
-			break;
-
-		case Operator::Minus:
-			result = a - b;
-			push(std::make_shared<Value>(result));
-			break;
-		
-		case Operator::Star:
-			result = a * b;
-			push(std::make_shared<Value>(result));
-			break;
-
-		case Operator::Slash:
-			result = b / a;
-			push(std::make_shared<Value>(result));
-			break;
-
-		case Operator::Mod:
-			result = (int) a % (int) b;
-			push(std::make_shared<Value>(result));
-			break;
-		
-		case Operator::LessThan:
-			x = a < b;
-			push(std::make_shared<Value>(x));
-			break;
-		
-		case Operator::GreaterThan:
-			x = a > b;
-			push(std::make_shared<Value>(x));
-			break;
-		
-		case Operator::Amp:
-			x = (int) a & (int) b;
-			push(std::make_shared<Value>(x));
-			break;
-
-		case Operator::AmpAmp:
-			x = (int) a && (int) b;
-			push(std::make_shared<Value>(x));
-			break;
-		
-		case Operator::Pipe:
-			x = (int) a | (int) b;
-			push(std::make_shared<Value>(x));
-			break;
-		
-		case Operator::PipePipe:
-			x = (int) a || (int) b;
-			push(std::make_shared<Value>(x));
-			break;
-		
-		default:
-			assert(!"Unreachable");
+		call_value(num_args);
+		return false;
 	}
+
+	auto callee = stack_top - num_args - 1;
+	std::copy(callee, stack_top, frame->base);
+	stack_top = frame->base + num_args + 1;
+
+	frame_count -= 1;
+	return call(callable.as_fn(), num_args);
 }
 
-u8 Vm::read_byte()
+void Vm::collect_garbage()
 {
-	auto ip = frames.top().ip;
-	auto byte = frames.top().function.chunk.code[ip];
-	frames.top().ip += 1;
-	return byte;
+	heap.collect([this](Heap &heap) {
+		for (auto slot = stack.get(); slot < stack_top; slot++)
+			heap.visit(*slot);
+
+		for (int i = 0; i < frame_count; i++)
+			heap.visit(frames[i].function);
+
+		for (auto &value : globals.values)
+			heap.visit(value);
+
+		for (auto &name : globals.names)
+			heap.visit(name);
+	});
 }
 
-u16 Vm::read_short()
+// drops every reference the vm holds into the region, then frees it.
+// returns the run's result, or nil if it lived in the region
+Value Vm::end_region(Value result)
 {
-	auto ip = frames.top().ip;
-	auto a = frames.top().function.chunk.code[ip];
-	auto b = frames.top().function.chunk.code[ip + 1];
-	frames.top().ip += 2;
+	auto in_region = [](Value value) { return value.is_obj() && value.as_obj()->in_region; };
 
-	return (a << 8) | b;
+	for (auto &value : globals.values)
+	{
+		if (in_region(value))
+			value = Value(nullptr);
+	}
+
+	heap.end_region(reuse_region_blocks);
+	return in_region(result) ? Value(nullptr) : result;
 }
 
-Value Vm::read_constant()
+#ifdef DEBUG
+void Vm::print_stack()
 {
-	auto byte = read_byte();
-	return frames.top().function.chunk.constants[byte];
+	std::printf("stack:          ");
+	std::printf("[ ");
+	for (auto slot = stack.get(); slot < stack_top; slot++)
+		std::printf("%s ", slot->to_string().c_str());
+	std::printf("]\n");
 }
+#endif
 
 void Vm::runtime_error(std::string const &msg)
 {
-	auto ip = frames.top().ip;
-	auto line = frames.top().function.chunk.lines[ip - 1];
+	int line;
+	if (frame->pc)
+	{
+		auto &registers = frame->function->registers;
+		line = registers.lines[frame->pc - registers.code.data() - 1];
+	}
+
+	else
+	{
+		auto &chunk = frame->function->chunk;
+		line = chunk.line(frame->ip - chunk.bytecode() - 1);
+	}
+
 	std::printf("%s [line %d]\n", msg.c_str(), line);
 }
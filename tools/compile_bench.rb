@@ -0,0 +1,66 @@
+# Times how long topaz takes to compile generated scripts of 10k, 100k and 1M
+# lines, without running them, to check that compile time grows linearly
+# with the size of the source. Each script uses a handful of names, properties
+# and literals over and over, like real code does, so per use costs show up.
+#
+# usage: ruby tools/compile_bench.rb [path to topaz] [topaz flags...]
+
+require 'tmpdir'
+
+project_root = File.expand_path('..', __dir__)
+topaz = ARGV.shift || File.join(project_root, 'topaz')
+flags = ARGV.join(' ')
+
+# one long script body reading and writing a few globals
+def statements_script(lines)
+	out = ['total = 0', 'scale = 3']
+	(lines - 2).times { |i| out << "total = total + #{i % 100} * scale - #{i % 7}" }
+	out.join("\n")
+end
+
+# many small functions with parameters and property accesses
+def functions_script(lines)
+	out = ['class Point { }']
+	((lines - 1) / 6).times do |i|
+		out << "fn point_#{i}(alpha beta gamma) {"
+		out << "\tp = Point()"
+		out << "\tp.x = alpha + beta * 2"
+		out << "\tp.y = p.x * gamma + beta - 1"
+		out << "\tp.x + p.y + alpha"
+		out << '}'
+	end
+	out.join("\n")
+end
+
+def time_compile(command)
+	start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+	ok = system(command)
+	[Process.clock_gettime(Process::CLOCK_MONOTONIC) - start, ok]
+end
+
+benchmarks = [
+	['statements', method(:statements_script)],
+	['functions', method(:functions_script)],
+]
+
+Dir.mktmpdir do |dir|
+	printf("%-12s %9s %10s %10s %10s\n", 'script', 'lines', 'source', 'seconds', 'us/line')
+
+	benchmarks.each do |name, script|
+		[10_000, 100_000, 1_000_000].each do |lines|
+			path = File.join(dir, "#{name}_#{lines}.tz")
+			File.write(path, script.call(lines))
+
+			# the best of three runs
+			runs = 3.times.map { time_compile("#{topaz} --compile #{flags} #{path}") }
+			seconds, ok = runs.min_by(&:first)
+
+			if !ok
+				puts "#{name} #{lines}: compiling failed"
+				exit 1
+			end
+
+			printf("%-12s %9d %9dK %10.3f %10.2f\n", name, lines, File.size(path) / 1024, seconds, seconds * 1e6 / lines)
+		end
+	end
+end
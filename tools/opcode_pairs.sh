@@ -0,0 +1,37 @@
+#!/bin/sh
+# Prints the most frequently executed opcode pairs over a corpus of scripts,
+# which is what the compiler's superinstructions are chosen from.
+#
+# usage: tools/opcode_pairs.sh [-n count] [dir...]
+# defaults to the top 30 pairs over spec/ and bench/
+
+set -e
+cd "$(dirname "$0")/.."
+
+top=30
+if [ "$1" = "-n" ]; then
+	top=$2
+	shift 2
+fi
+
+if [ $# -eq 0 ]; then
+	set -- spec bench
+fi
+
+make histogram > /dev/null
+
+counts=$(mktemp)
+trap 'rm -f "$counts"' EXIT
+
+for dir in "$@"; do
+	[ -d "$dir" ] || continue
+	for script in $(find "$dir" -name '*.tz' | sort); do
+		./topazh "$script" 2>> "$counts" > /dev/null || true
+	done
+done
+
+awk '$2 ~ /^OP_/ { pairs[$2 " " $3] += $1; total += $1 }
+	END {
+		for (pair in pairs)
+			printf "%12d %6.2f%%  %s\n", pairs[pair], 100 * pairs[pair] / total, pair
+	}' "$counts" | sort -rn | head -n "$top"
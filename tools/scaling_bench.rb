@@ -0,0 +1,71 @@
+# Times topaz on generated scripts that grow past the limits of narrow operands:
+# a chunk with up to 100k constants, and a function whose loop body is
+# megabytes of source, so its jumps span far more than 64KiB of bytecode.
+# Each script is run at several sizes, which shows whether compile and run
+# time stay linear in the size of the program.
+#
+# usage: ruby tools/scaling_bench.rb [path to topaz] [topaz flags...]
+
+require 'tmpdir'
+
+project_root = File.expand_path('..', __dir__)
+topaz = ARGV.shift || File.join(project_root, 'topaz')
+flags = ARGV.join(' ')
+
+# every statement adds a constant of its own
+def constants_script(n)
+	lines = ['sum = 0']
+	n.times { |i| lines << "sum = sum + #{i}" }
+	lines << 'print sum'
+	lines.join("\n")
+end
+
+def constants_expected(n)
+	n * (n - 1) / 2
+end
+
+# a loop with a branch in it around n statements, run a few times
+def body_script(n)
+	lines = ['fn big(iterations) {', "\ts = 0", "\ti = 0", "\twhile i < iterations {", "\t\tif i % 2 == 0 {"]
+	n.times { |k| lines << "\t\t\ts = s + i * #{k % 50}" }
+	lines += ["\t\t} else { s = s - 1 }", "\t\ti = i + 1", "\t}", "\ts", '}', 'print big(10)']
+	lines.join("\n")
+end
+
+def body_expected(n)
+	per_even = (0...n).sum { |k| k % 50 }
+	20 * per_even - 5
+end
+
+def time_run(command)
+	start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+	output = `#{command}`
+	[Process.clock_gettime(Process::CLOCK_MONOTONIC) - start, output]
+end
+
+benchmarks = [
+	['constants', [1_000, 10_000, 100_000], method(:constants_script), method(:constants_expected)],
+	['function body', [1_000, 10_000, 100_000], method(:body_script), method(:body_expected)],
+]
+
+Dir.mktmpdir do |dir|
+	printf("%-14s %8s %10s %10s %12s\n", 'script', 'size', 'source', 'seconds', 'us/statement')
+
+	benchmarks.each do |name, sizes, script, expected|
+		sizes.each do |n|
+			path = File.join(dir, "#{name.tr(' ', '_')}_#{n}.tz")
+			File.write(path, script.call(n))
+
+			# the best of three runs
+			runs = 3.times.map { time_run("#{topaz} #{flags} #{path}") }
+			seconds, output = runs.min_by(&:first)
+
+			if output.to_f != expected.call(n)
+				puts "#{name} #{n}: expected #{expected.call(n)} but got #{output.strip[0, 80]}"
+				exit 1
+			end
+
+			printf("%-14s %8d %9dK %10.3f %12.2f\n", name, n, File.size(path) / 1024, seconds, seconds * 1e6 / n)
+		end
+	end
+end